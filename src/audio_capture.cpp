@@ -1,10 +1,14 @@
 #include "audio_capture.h"
+#include "wav_reader.h"
+#include "resampler.h"
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
 #include <chrono>
 #include <random>
 #include <thread>
 #include <cmath>
+#include <memory>
 
 AudioCapture::AudioCapture() {
 }
@@ -18,42 +22,18 @@ bool AudioCapture::initialize() {
     // First try to detect the audio server
     std::cout << "Detecting audio system..." << std::endl;
     
-    // Check if we're running on PipeWire with PulseAudio compatibility
-    pa_sample_spec ss;
-    ss.format = sample_format;
-    ss.rate = sample_rate;
-    ss.channels = channels;
-
-    int error;
-    pa_handle = pa_simple_new(nullptr, "SpeakPrompt", PA_STREAM_RECORD, nullptr,
-                             "voice capture", &ss, nullptr, nullptr, &error);
-    
-    if (pa_handle) {
+    // Works with PulseAudio and with PipeWire's PulseAudio compatibility layer
+    if (initialize_pulse()) {
         use_pulse = true;
         
-        std::cout << "Using PulseAudio for audio capture" << std::endl;
-        
-
-        
+        const pa_buffer_attr* attr = pa_stream_get_buffer_attr(record_stream);
+        int bytes_per_ms = sample_rate * channels * sizeof(int16_t) / 1000;
+        std::cout << "Using PulseAudio for audio capture (fragment "
+                  << (attr ? attr->fragsize / bytes_per_ms : fragment_ms) << " ms, buffer "
+                  << (attr ? attr->maxlength / bytes_per_ms : max_buffer_ms) << " ms)" << std::endl;
         return true;
-    } else {
-        std::cerr << "PulseAudio initialization failed: " << pa_strerror(error) << std::endl;
-        std::cerr << "Error details: ";
-        switch (error) {
-            case PA_ERR_CONNECTIONREFUSED:
-                std::cerr << "Connection refused - audio server may not be running" << std::endl;
-                break;
-            case PA_ERR_ACCESS:
-                std::cerr << "Access denied - check permissions" << std::endl;
-                break;
-            case PA_ERR_NOTSUPPORTED:
-                std::cerr << "Operation not supported" << std::endl;
-                break;
-            default:
-                std::cerr << "Unknown error (code: " << error << ")" << std::endl;
-                break;
-        }
     }
+    cleanup_pulse();
 #endif
     
     // Fallback to demo mode
@@ -68,7 +48,7 @@ bool AudioCapture::start_capture() {
     }
     
 #ifdef HAVE_PULSE
-    if (!pa_handle && use_pulse) {
+    if (!record_stream && use_pulse) {
         std::cerr << "AudioCapture not initialized" << std::endl;
         return false;
     }
@@ -77,7 +57,24 @@ bool AudioCapture::start_capture() {
     is_capturing = true;
     
     if (use_pulse) {
-        capture_thread = std::thread(&AudioCapture::capture_pulse_loop, this);
+#ifdef HAVE_PULSE
+        overrun_count = 0;
+        underrun_count = 0;
+        
+        // Throw away whatever the server buffered before this take, then start the stream
+        pa_threaded_mainloop_lock(pa_mainloop);
+        discard_until_flushed = true;
+        run_pulse_operation(pa_stream_flush(record_stream, pulse_success_callback, this));
+        discard_until_flushed = false;
+        bool started = run_pulse_operation(pa_stream_cork(record_stream, 0, pulse_success_callback, this));
+        pa_threaded_mainloop_unlock(pa_mainloop);
+        
+        if (!started) {
+            std::cerr << "Failed to start PulseAudio stream: " << pa_strerror(pa_context_errno(pa_ctx)) << std::endl;
+            is_capturing = false;
+            return false;
+        }
+#endif
     } else if (!wav_file_path.empty()) {
         capture_thread = std::thread(&AudioCapture::capture_wav_loop, this);
     } else {
@@ -88,21 +85,39 @@ bool AudioCapture::start_capture() {
 }
 
 void AudioCapture::stop_capture() {
-    is_capturing = false;
+    bool was_capturing = is_capturing.exchange(false);
+    
+#ifdef HAVE_PULSE
+    if (use_pulse && record_stream && was_capturing) {
+        // Corking stops the server from filling the buffer between takes
+        pa_threaded_mainloop_lock(pa_mainloop);
+        run_pulse_operation(pa_stream_cork(record_stream, 1, pulse_success_callback, this));
+        pa_threaded_mainloop_unlock(pa_mainloop);
+        
+        if (overrun_count.load() > 0) {
+            std::cerr << "Warning: " << overrun_count.load() << " capture overrun(s) during this take" << std::endl;
+        }
+    }
+#else
+    (void)was_capturing;
+#endif
     
     if (capture_thread.joinable()) {
         capture_thread.join();
     }
 }
 
+void AudioCapture::wait_until_finished() {
+    if (capture_thread.joinable()) {
+        capture_thread.join();
+    }
+}
+
 void AudioCapture::cleanup() {
     stop_capture();
     
 #ifdef HAVE_PULSE
-    if (pa_handle) {
-        pa_simple_free(pa_handle);
-        pa_handle = nullptr;
-    }
+    cleanup_pulse();
 #endif
 }
 
@@ -110,35 +125,222 @@ void AudioCapture::set_audio_data_callback(std::function<void(const std::vector<
     audio_data_callback = callback;
 }
 
-void AudioCapture::capture_pulse_loop() {
 #ifdef HAVE_PULSE
-    const int buffer_size = 1024; // samples per buffer
-    std::vector<int16_t> buffer(buffer_size);
-    std::vector<float> float_buffer(buffer_size);
+bool AudioCapture::initialize_pulse() {
+    pa_mainloop = pa_threaded_mainloop_new();
+    if (!pa_mainloop) {
+        std::cerr << "PulseAudio initialization failed: cannot create mainloop" << std::endl;
+        return false;
+    }
     
-    while (is_capturing.load()) {
-        int error;
-        int result = pa_simple_read(pa_handle, buffer.data(), 
-                                  buffer_size * sizeof(int16_t), &error);
-        
-        if (result < 0) {
-            std::cerr << "pa_simple_read() failed: " << pa_strerror(error) << std::endl;
+    pa_ctx = pa_context_new(pa_threaded_mainloop_get_api(pa_mainloop), "SpeakPrompt");
+    if (!pa_ctx) {
+        std::cerr << "PulseAudio initialization failed: cannot create context" << std::endl;
+        return false;
+    }
+    pa_context_set_state_callback(pa_ctx, pulse_context_state_callback, this);
+    
+    if (pa_context_connect(pa_ctx, nullptr, PA_CONTEXT_NOFLAGS, nullptr) < 0) {
+        report_pulse_error(pa_context_errno(pa_ctx));
+        return false;
+    }
+    
+    if (pa_threaded_mainloop_start(pa_mainloop) < 0) {
+        std::cerr << "PulseAudio initialization failed: cannot start mainloop" << std::endl;
+        return false;
+    }
+    
+    pa_threaded_mainloop_lock(pa_mainloop);
+    
+    // Wait for the connection to settle
+    while (true) {
+        pa_context_state_t state = pa_context_get_state(pa_ctx);
+        if (state == PA_CONTEXT_READY) {
             break;
         }
-        
-        // Convert int16_t to float
-        for (int i = 0; i < buffer_size; ++i) {
-            float_buffer[i] = static_cast<float>(buffer[i]) / 32768.0f;
+        if (!PA_CONTEXT_IS_GOOD(state)) {
+            int error = pa_context_errno(pa_ctx);
+            pa_threaded_mainloop_unlock(pa_mainloop);
+            report_pulse_error(error);
+            return false;
         }
-        
-        // Send audio data to callback
-        if (audio_data_callback) {
-            audio_data_callback(float_buffer);
+        pa_threaded_mainloop_wait(pa_mainloop);
+    }
+    
+    pa_sample_spec ss;
+    ss.format = sample_format;
+    ss.rate = sample_rate;
+    ss.channels = channels;
+    
+    record_stream = pa_stream_new(pa_ctx, "voice capture", &ss, nullptr);
+    if (!record_stream) {
+        int error = pa_context_errno(pa_ctx);
+        pa_threaded_mainloop_unlock(pa_mainloop);
+        report_pulse_error(error);
+        return false;
+    }
+    pa_stream_set_state_callback(record_stream, pulse_stream_state_callback, this);
+    pa_stream_set_read_callback(record_stream, pulse_stream_read_callback, this);
+    pa_stream_set_overflow_callback(record_stream, pulse_stream_overflow_callback, this);
+    pa_stream_set_underflow_callback(record_stream, pulse_stream_underflow_callback, this);
+    
+    // Small fragments keep capture latency low; maxlength bounds how much
+    // the server may hold before it reports an overrun
+    const uint32_t bytes_per_ms = sample_rate * channels * sizeof(int16_t) / 1000;
+    pa_buffer_attr attr;
+    attr.maxlength = max_buffer_ms * bytes_per_ms;
+    attr.fragsize = fragment_ms * bytes_per_ms;
+    attr.tlength = static_cast<uint32_t>(-1);
+    attr.prebuf = static_cast<uint32_t>(-1);
+    attr.minreq = static_cast<uint32_t>(-1);
+    
+    std::string device = source_name;
+    if (device.empty()) {
+        const char* env_source = std::getenv("SPEAKPROMPT_PULSE_SOURCE");
+        if (env_source) {
+            device = env_source;
         }
     }
-#endif
+    
+    // Start corked: nothing is captured until start_capture()
+    pa_stream_flags_t flags = static_cast<pa_stream_flags_t>(PA_STREAM_ADJUST_LATENCY | PA_STREAM_START_CORKED);
+    if (pa_stream_connect_record(record_stream, device.empty() ? nullptr : device.c_str(), &attr, flags) < 0) {
+        int error = pa_context_errno(pa_ctx);
+        pa_threaded_mainloop_unlock(pa_mainloop);
+        report_pulse_error(error);
+        return false;
+    }
+    
+    while (true) {
+        pa_stream_state_t state = pa_stream_get_state(record_stream);
+        if (state == PA_STREAM_READY) {
+            break;
+        }
+        if (!PA_STREAM_IS_GOOD(state)) {
+            int error = pa_context_errno(pa_ctx);
+            pa_threaded_mainloop_unlock(pa_mainloop);
+            report_pulse_error(error);
+            return false;
+        }
+        pa_threaded_mainloop_wait(pa_mainloop);
+    }
+    
+    // Size the conversion buffer once so the read callback never allocates
+    const pa_buffer_attr* actual = pa_stream_get_buffer_attr(record_stream);
+    uint32_t max_bytes = actual ? actual->maxlength : attr.maxlength;
+    pulse_float_buffer.reserve(max_bytes / sizeof(int16_t) / channels);
+    
+    pa_threaded_mainloop_unlock(pa_mainloop);
+    return true;
 }
 
+void AudioCapture::cleanup_pulse() {
+    if (!pa_mainloop) {
+        return;
+    }
+    
+    pa_threaded_mainloop_lock(pa_mainloop);
+    if (record_stream) {
+        pa_stream_disconnect(record_stream);
+        pa_stream_unref(record_stream);
+        record_stream = nullptr;
+    }
+    if (pa_ctx) {
+        pa_context_disconnect(pa_ctx);
+        pa_context_unref(pa_ctx);
+        pa_ctx = nullptr;
+    }
+    pa_threaded_mainloop_unlock(pa_mainloop);
+    
+    pa_threaded_mainloop_stop(pa_mainloop);
+    pa_threaded_mainloop_free(pa_mainloop);
+    pa_mainloop = nullptr;
+}
+
+void AudioCapture::report_pulse_error(int error) {
+    std::cerr << "PulseAudio initialization failed: " << pa_strerror(error) << std::endl;
+    std::cerr << "Error details: ";
+    switch (error) {
+        case PA_ERR_CONNECTIONREFUSED:
+            std::cerr << "Connection refused - audio server may not be running" << std::endl;
+            break;
+        case PA_ERR_ACCESS:
+            std::cerr << "Access denied - check permissions" << std::endl;
+            break;
+        case PA_ERR_NOTSUPPORTED:
+            std::cerr << "Operation not supported" << std::endl;
+            break;
+        case PA_ERR_NOENTITY:
+            std::cerr << "No such source - check the configured source name" << std::endl;
+            break;
+        default:
+            std::cerr << "Unknown error (code: " << error << ")" << std::endl;
+            break;
+    }
+}
+
+bool AudioCapture::run_pulse_operation(pa_operation* op) {
+    // Caller holds the mainloop lock; waiting releases it for the mainloop thread
+    if (!op) {
+        return false;
+    }
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
+        pa_threaded_mainloop_wait(pa_mainloop);
+    }
+    bool done = pa_operation_get_state(op) == PA_OPERATION_DONE;
+    pa_operation_unref(op);
+    return done;
+}
+
+void AudioCapture::pulse_context_state_callback(pa_context*, void* userdata) {
+    auto* self = static_cast<AudioCapture*>(userdata);
+    pa_threaded_mainloop_signal(self->pa_mainloop, 0);
+}
+
+void AudioCapture::pulse_stream_state_callback(pa_stream*, void* userdata) {
+    auto* self = static_cast<AudioCapture*>(userdata);
+    pa_threaded_mainloop_signal(self->pa_mainloop, 0);
+}
+
+void AudioCapture::pulse_success_callback(pa_stream*, int, void* userdata) {
+    auto* self = static_cast<AudioCapture*>(userdata);
+    pa_threaded_mainloop_signal(self->pa_mainloop, 0);
+}
+
+void AudioCapture::pulse_stream_overflow_callback(pa_stream*, void* userdata) {
+    static_cast<AudioCapture*>(userdata)->overrun_count++;
+}
+
+void AudioCapture::pulse_stream_underflow_callback(pa_stream*, void* userdata) {
+    static_cast<AudioCapture*>(userdata)->underrun_count++;
+}
+
+void AudioCapture::pulse_stream_read_callback(pa_stream* stream, size_t, void* userdata) {
+    // Runs on the PulseAudio mainloop thread
+    auto* self = static_cast<AudioCapture*>(userdata);
+    const size_t frame_bytes = sizeof(int16_t) * self->channels;
+    
+    const void* data = nullptr;
+    size_t nbytes = 0;
+    while (pa_stream_peek(stream, &data, &nbytes) == 0 && nbytes > 0) {
+        // data is null for holes in the stream; those are dropped like stale audio
+        if (data && self->is_capturing.load() && !self->discard_until_flushed.load()) {
+            size_t frames = nbytes / frame_bytes;
+            self->pulse_float_buffer.resize(frames);
+            
+            // Convert int16_t to float
+            self->pulse_converter.convert(data, frames, self->pulse_float_buffer.data());
+            
+            // Send audio data to callback
+            if (self->audio_data_callback) {
+                self->audio_data_callback(self->pulse_float_buffer);
+            }
+        }
+        pa_stream_drop(stream);
+    }
+}
+#endif
+
 void AudioCapture::capture_file_loop() {
     // Demo mode - generate simulated audio data
     const int buffer_size = 1024;
@@ -169,119 +371,53 @@ void AudioCapture::capture_file_loop() {
     }
 }
 
-bool AudioCapture::read_wav_header(std::ifstream& file, int& file_sample_rate, int& file_channels, int& bits_per_sample, int& data_start) {
-    char header[44];
-    file.read(header, 44);
-    
-    if (file.gcount() < 44) {
-        return false;
-    }
-    
-    // Check RIFF header
-    if (strncmp(header, "RIFF", 4) != 0 || strncmp(header + 8, "WAVE", 4) != 0) {
-        return false;
-    }
-    
-    // Extract format information
-    file_channels = *reinterpret_cast<uint16_t*>(header + 22);
-    file_sample_rate = *reinterpret_cast<uint32_t*>(header + 24);
-    bits_per_sample = *reinterpret_cast<uint16_t*>(header + 34);
-    
-    // Find data chunk
-    data_start = 12; // Start after RIFF header
-    while (data_start < 100) { // Reasonable limit to search
-        file.seekg(data_start);
-        char chunk_id[5];
-        file.read(chunk_id, 4);
-        chunk_id[4] = '\0';
-        
-        if (strcmp(chunk_id, "data") == 0) {
-            data_start += 8; // Skip chunk ID and size
-            file.seekg(data_start);
-            return true;
-        }
-        
-        // Skip to next chunk
-        uint32_t chunk_size;
-        file.seekg(data_start + 4);
-        file.read(reinterpret_cast<char*>(&chunk_size), 4);
-        data_start += 8 + chunk_size;
-    }
-    
-    return false;
-}
-
 void AudioCapture::capture_wav_loop() {
-    std::ifstream wav_file(wav_file_path, std::ios::binary);
-    if (!wav_file.is_open()) {
-        std::cerr << "Failed to open WAV file: " << wav_file_path << std::endl;
-        is_capturing = false;
-        return;
-    }
-    
-    int file_sample_rate, file_channels, bits_per_sample, data_start;
-    if (!read_wav_header(wav_file, file_sample_rate, file_channels, bits_per_sample, data_start)) {
-        std::cerr << "Failed to read WAV file header" << std::endl;
+    WavReader reader;
+    if (!reader.open(wav_file_path)) {
         is_capturing = false;
         return;
     }
     
     std::cout << "Playing WAV file: " << wav_file_path << std::endl;
-    std::cout << "Format: " << file_sample_rate << "Hz, " << file_channels << " channels, " << bits_per_sample << " bits" << std::endl;
+    std::cout << "Format: " << reader.get_sample_rate() << "Hz, " << reader.get_channels() << " channels, "
+              << reader.get_bits_per_sample() << " bits" << std::endl;
     
-    wav_file.seekg(data_start);
+    // Whisper expects 16 kHz; convert anything else on the fly
+    std::unique_ptr<PolyphaseResampler> resampler;
+    if (reader.get_sample_rate() != sample_rate) {
+        resampler = std::make_unique<PolyphaseResampler>(reader.get_sample_rate(), sample_rate);
+        std::cout << "Resampling " << reader.get_sample_rate() << "Hz -> " << sample_rate << "Hz" << std::endl;
+    }
     
-    const int buffer_size = 1024;
+    const int buffer_size = 1024; // frames per buffer
+    std::vector<float> file_buffer(buffer_size);
     std::vector<float> float_buffer(buffer_size);
     
-    if (bits_per_sample == 16) {
-        std::vector<int16_t> int_buffer(buffer_size);
-        
-        while (is_capturing.load() && wav_file.read(reinterpret_cast<char*>(int_buffer.data()), buffer_size * sizeof(int16_t))) {
-            int samples_read = wav_file.gcount() / sizeof(int16_t);
-            
-            // Convert to float and potentially resample if needed
-            for (int i = 0; i < samples_read; ++i) {
-                float_buffer[i] = static_cast<float>(int_buffer[i]) / 32768.0f;
-                
-                // Handle multi-channel by taking first channel
-                if (file_channels > 1) {
-                    i += (file_channels - 1);
-                    samples_read = std::min(samples_read, buffer_size);
+    while (is_capturing.load()) {
+        size_t frames_read = reader.read(file_buffer.data(), buffer_size);
+        if (frames_read == 0) {
+            if (resampler) {
+                resampler->flush(float_buffer);
+                if (!float_buffer.empty() && audio_data_callback) {
+                    audio_data_callback(float_buffer);
                 }
             }
-            
-            if (audio_data_callback) {
-                audio_data_callback(float_buffer);
-            }
-            
-            // Simulate real-time playback with slightly faster processing for better responsiveness
-            std::this_thread::sleep_for(std::chrono::milliseconds(buffer_size * 900 / sample_rate));
+            break;
         }
-    } else if (bits_per_sample == 32) {
-        std::vector<float> file_buffer(buffer_size);
         
-        while (is_capturing.load() && wav_file.read(reinterpret_cast<char*>(file_buffer.data()), buffer_size * sizeof(float))) {
-            int samples_read = wav_file.gcount() / sizeof(float);
-            
-            // Handle multi-channel by taking first channel
-            if (file_channels > 1) {
-                int write_pos = 0;
-                for (int i = 0; i < samples_read; i += file_channels) {
-                    float_buffer[write_pos++] = file_buffer[i];
-                    if (write_pos >= buffer_size) break;
-                }
-                samples_read = write_pos;
-            } else {
-                float_buffer.assign(file_buffer.begin(), file_buffer.begin() + samples_read);
-            }
-            
-            if (audio_data_callback) {
-                audio_data_callback(float_buffer);
-            }
-            
-            // Simulate real-time playback with slightly faster processing for better responsiveness
-            std::this_thread::sleep_for(std::chrono::milliseconds(buffer_size * 900 / sample_rate));
+        if (resampler) {
+            resampler->process(file_buffer.data(), frames_read, float_buffer);
+        } else {
+            float_buffer.assign(file_buffer.begin(), file_buffer.begin() + frames_read);
+        }
+        
+        if (!float_buffer.empty() && audio_data_callback) {
+            audio_data_callback(float_buffer);
+        }
+        
+        // Simulate real-time playback with slightly faster processing for better responsiveness
+        if (realtime_pacing) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(float_buffer.size() * 900 / sample_rate));
         }
     }
     
@@ -2,7 +2,6 @@
 #define AUDIO_CAPTURE_H
 
 #ifdef HAVE_PULSE
-#include <pulse/simple.h>
 #include <pulse/error.h>
 #include <pulse/context.h>
 #include <pulse/introspect.h>
@@ -15,32 +14,59 @@
 #include <functional>
 #include <thread>
 #include <atomic>
-#include <fstream>
+#include <string>
+#include <cstdint>
+#include "sample_convert.h"
 
 class AudioCapture {
 private:
 #ifdef HAVE_PULSE
-    pa_simple* pa_handle = nullptr;
+    // Asynchronous record stream driven by PulseAudio's own mainloop thread
+    pa_threaded_mainloop* pa_mainloop = nullptr;
+    pa_context* pa_ctx = nullptr;
+    pa_stream* record_stream = nullptr;
+    std::string source_name;
+    int fragment_ms = 20;     // Delivery granularity (fragsize)
+    int max_buffer_ms = 200;  // Server-side buffer before overruns (maxlength)
+    
+    // Set on start until the server acknowledges the flush of stale audio
+    std::atomic<bool> discard_until_flushed{false};
+    std::atomic<uint64_t> overrun_count{0};
+    std::atomic<uint64_t> underrun_count{0};
+    std::vector<float> pulse_float_buffer;
 #endif
     std::thread capture_thread;
     std::atomic<bool> is_capturing{false};
     std::atomic<bool> use_pulse{false};
+    bool realtime_pacing = true;
     
     // Audio parameters
     const int sample_rate = 16000;
     const int channels = 1;
 #ifdef HAVE_PULSE
     const pa_sample_format_t sample_format = PA_SAMPLE_S16LE;
+    SampleConverter pulse_converter{SampleFormat::S16, channels};
 #endif
     
     std::function<void(const std::vector<float>&)> audio_data_callback;
     std::string wav_file_path;
     
+#ifdef HAVE_PULSE
+    bool initialize_pulse();
+    void cleanup_pulse();
+    void report_pulse_error(int error);
+    bool run_pulse_operation(pa_operation* op);
+    
+    static void pulse_context_state_callback(pa_context* context, void* userdata);
+    static void pulse_stream_state_callback(pa_stream* stream, void* userdata);
+    static void pulse_stream_read_callback(pa_stream* stream, size_t nbytes, void* userdata);
+    static void pulse_stream_overflow_callback(pa_stream* stream, void* userdata);
+    static void pulse_stream_underflow_callback(pa_stream* stream, void* userdata);
+    static void pulse_success_callback(pa_stream* stream, int success, void* userdata);
+#endif
     void capture_loop();
-    void capture_pulse_loop();
     void capture_file_loop();
     void capture_wav_loop();
-    bool read_wav_header(std::ifstream& file, int& sample_rate, int& channels, int& bits_per_sample, int& data_start);
 
 public:
     AudioCapture();
@@ -54,6 +80,23 @@ public:
     void set_audio_data_callback(std::function<void(const std::vector<float>&)> callback);
     void set_wav_file_path(const std::string& path) { wav_file_path = path; }
     
+#ifdef HAVE_PULSE
+    // Capture tuning; must be set before initialize(). An empty source name
+    // uses $SPEAKPROMPT_PULSE_SOURCE, or the server default if that is unset.
+    void set_source_name(const std::string& name) { source_name = name; }
+    void set_fragment_ms(int ms) { fragment_ms = ms; }
+    void set_max_buffer_ms(int ms) { max_buffer_ms = ms; }
+    
+    uint64_t get_overrun_count() const { return overrun_count.load(); }
+    uint64_t get_underrun_count() const { return underrun_count.load(); }
+#endif
+    
+    // WAV playback sleeps between blocks to mimic a live source unless disabled
+    void set_realtime_pacing(bool enabled) { realtime_pacing = enabled; }
+    
+    // Blocks until a finite source (WAV file) has been fully delivered
+    void wait_until_finished();
+    
     bool is_active() const { return is_capturing.load(); }
     
     // Audio configuration
@@ -0,0 +1,138 @@
+#include "audio_ring_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+static size_t round_up_pow2(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+AudioRingBuffer::AudioRingBuffer(size_t min_capacity)
+    : buffer(round_up_pow2(std::max<size_t>(min_capacity, 2))),
+      mask(buffer.size() - 1) {
+}
+
+size_t AudioRingBuffer::write(const float* data, size_t count) {
+    const size_t w = write_index.load(std::memory_order_relaxed);
+    const size_t r = read_index.load(std::memory_order_acquire);
+    const size_t free_space = buffer.size() - (w - r);
+    const size_t n = std::min(count, free_space);
+
+    if (n > 0) {
+        const size_t start = w & mask;
+        const size_t first = std::min(n, buffer.size() - start);
+        std::memcpy(buffer.data() + start, data, first * sizeof(float));
+        if (n > first) {
+            std::memcpy(buffer.data(), data + first, (n - first) * sizeof(float));
+        }
+        // seq_cst pairs with the consumer_waiting handshake in wait_for_data()
+        write_index.store(w + n, std::memory_order_seq_cst);
+    }
+
+    if (n < count) {
+        dropped.fetch_add(count - n, std::memory_order_relaxed);
+    }
+
+    if (n > 0 && consumer_waiting.load(std::memory_order_seq_cst)) {
+        data_cv.notify_one();
+    }
+
+    return n;
+}
+
+size_t AudioRingBuffer::read(float* out, size_t max_count) {
+    const size_t r = read_index.load(std::memory_order_relaxed);
+    const size_t w = write_index.load(std::memory_order_acquire);
+    const size_t n = std::min(max_count, w - r);
+
+    if (n > 0) {
+        const size_t start = r & mask;
+        const size_t first = std::min(n, buffer.size() - start);
+        std::memcpy(out, buffer.data() + start, first * sizeof(float));
+        if (n > first) {
+            std::memcpy(out + first, buffer.data(), (n - first) * sizeof(float));
+        }
+        read_index.store(r + n, std::memory_order_seq_cst);
+    }
+
+    if (n > 0 && producer_waiting.load(std::memory_order_seq_cst)) {
+        space_cv.notify_one();
+    }
+
+    return n;
+}
+
+size_t AudioRingBuffer::discard(size_t count) {
+    const size_t r = read_index.load(std::memory_order_relaxed);
+    const size_t w = write_index.load(std::memory_order_acquire);
+    const size_t n = std::min(count, w - r);
+
+    if (n > 0) {
+        read_index.store(r + n, std::memory_order_seq_cst);
+        if (producer_waiting.load(std::memory_order_seq_cst)) {
+            space_cv.notify_one();
+        }
+    }
+
+    return n;
+}
+
+bool AudioRingBuffer::wait_for_data(size_t min_samples, std::chrono::milliseconds timeout) {
+    if (available() >= min_samples) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    consumer_waiting.store(true, std::memory_order_seq_cst);
+
+    // The producer signals without holding wait_mutex, so a wake-up racing
+    // with the predicate check can be missed; the timeout bounds that case.
+    data_cv.wait_for(lock, timeout, [this, min_samples] {
+        return wake_requested || available() >= min_samples;
+    });
+
+    wake_requested = false;
+    consumer_waiting.store(false, std::memory_order_relaxed);
+    return available() >= min_samples;
+}
+
+bool AudioRingBuffer::wait_for_space(size_t min_space, std::chrono::milliseconds timeout) {
+    min_space = std::min(min_space, buffer.size());
+    if (free_space() >= min_space) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    producer_waiting.store(true, std::memory_order_seq_cst);
+
+    space_cv.wait_for(lock, timeout, [this, min_space] {
+        return wake_requested || free_space() >= min_space;
+    });
+
+    wake_requested = false;
+    producer_waiting.store(false, std::memory_order_relaxed);
+    return free_space() >= min_space;
+}
+
+void AudioRingBuffer::notify() {
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    wake_requested = true;
+    data_cv.notify_all();
+    space_cv.notify_all();
+}
+
+void AudioRingBuffer::clear() {
+    read_index.store(write_index.load(std::memory_order_acquire), std::memory_order_release);
+    dropped.store(0, std::memory_order_relaxed);
+}
+
+size_t AudioRingBuffer::available() const {
+    return write_index.load(std::memory_order_seq_cst) - read_index.load(std::memory_order_relaxed);
+}
+
+size_t AudioRingBuffer::free_space() const {
+    return buffer.size() - (write_index.load(std::memory_order_relaxed) - read_index.load(std::memory_order_seq_cst));
+}
@@ -0,0 +1,80 @@
+#ifndef AUDIO_RING_BUFFER_H
+#define AUDIO_RING_BUFFER_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+
+// Single-producer/single-consumer ring of float samples.
+//
+// The producer (audio capture thread) never takes a lock and never allocates:
+// write() copies into preallocated storage and publishes with a release store.
+// If the consumer falls behind, the samples that do not fit are dropped and
+// counted rather than blocking capture. The consumer side offers a blocking
+// wait so the transcription thread can sleep until enough audio arrives.
+// Producers that can afford to block (offline file input) may instead wait
+// for free space, which gives backpressure without dropping samples.
+class AudioRingBuffer {
+private:
+    std::vector<float> buffer;
+    size_t mask;
+
+    // Monotonic sample counters; the index into buffer is (counter & mask).
+    alignas(64) std::atomic<size_t> write_index{0};
+    alignas(64) std::atomic<size_t> read_index{0};
+
+    std::atomic<size_t> dropped{0};
+
+    // Consumer parking. The producer only signals when the consumer has
+    // announced it is waiting, and never touches wait_mutex itself.
+    std::atomic<bool> consumer_waiting{false};
+    std::mutex wait_mutex;
+    std::condition_variable data_cv;
+    bool wake_requested = false;
+
+    // Producer parking, used only by wait_for_space()
+    std::atomic<bool> producer_waiting{false};
+    std::condition_variable space_cv;
+
+public:
+    // Capacity is rounded up to the next power of two.
+    explicit AudioRingBuffer(size_t min_capacity);
+
+    AudioRingBuffer(const AudioRingBuffer&) = delete;
+    AudioRingBuffer& operator=(const AudioRingBuffer&) = delete;
+
+    // Producer side. Returns the number of samples stored; the rest are dropped.
+    size_t write(const float* data, size_t count);
+
+    // Consumer side. Returns the number of samples copied into out.
+    size_t read(float* out, size_t max_count);
+
+    // Consumer side. Drops up to count of the oldest samples without copying
+    // them (skipping ahead when the consumer is too far behind).
+    size_t discard(size_t count);
+
+    // Blocks until at least min_samples are readable, the timeout elapses or
+    // notify() is called. Returns true if the requested amount is available.
+    bool wait_for_data(size_t min_samples, std::chrono::milliseconds timeout);
+
+    // Blocks the producer until at least min_space samples can be written,
+    // the timeout elapses or notify() is called.
+    bool wait_for_space(size_t min_space, std::chrono::milliseconds timeout);
+
+    // Wakes a waiting consumer or producer (used on shutdown).
+    void notify();
+
+    // Discards all readable samples and resets the drop counter.
+    // Only call while no producer is writing.
+    void clear();
+
+    size_t available() const;
+    size_t free_space() const;
+    size_t capacity() const { return buffer.size(); }
+    size_t dropped_samples() const { return dropped.load(std::memory_order_relaxed); }
+};
+
+#endif // AUDIO_RING_BUFFER_H
@@ -0,0 +1,47 @@
+#include "audio_window.h"
+#include <algorithm>
+#include <cstring>
+
+AudioWindow::AudioWindow(size_t capacity) : storage(capacity) {
+}
+
+void AudioWindow::compact() {
+    if (head == 0) {
+        return;
+    }
+
+    size_t live = tail - head;
+    if (live > 0) {
+        std::memmove(storage.data(), storage.data() + head, live * sizeof(float));
+    }
+    head = 0;
+    tail = live;
+}
+
+float* AudioWindow::prepare_write(size_t n) {
+    if (tail + n > storage.size()) {
+        compact();
+    }
+    return storage.data() + tail;
+}
+
+void AudioWindow::commit(size_t n) {
+    tail = std::min(tail + n, storage.size());
+}
+
+void AudioWindow::append(const float* samples, size_t n) {
+    n = std::min(n, free_space());
+    std::memcpy(prepare_write(n), samples, n * sizeof(float));
+    commit(n);
+}
+
+void AudioWindow::consume(size_t n) {
+    head += std::min(n, size());
+    if (head == tail) {
+        head = tail = 0;
+    }
+}
+
+void AudioWindow::clear() {
+    head = tail = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef AUDIO_WINDOW_H
+#define AUDIO_WINDOW_H
+
+#include <vector>
+#include <cstddef>
+
+// Fixed-capacity sliding window over the incoming sample stream.
+//
+// Samples are appended at the tail and consumed from the head by advancing an
+// offset, so the live region is always contiguous and can be handed to
+// Whisper as a pointer without copying. When the tail reaches the end of the
+// storage, the (short) live region is moved back to the front; this happens
+// once per capacity worth of input instead of once per chunk.
+class AudioWindow {
+private:
+    std::vector<float> storage;
+    size_t head = 0;
+    size_t tail = 0;
+
+    void compact();
+
+public:
+    explicit AudioWindow(size_t capacity);
+
+    // Returns a pointer with room for at least n samples at the tail
+    // (n must not exceed free_space()); call commit() with the amount written.
+    float* prepare_write(size_t n);
+    void commit(size_t n);
+
+    void append(const float* samples, size_t n);
+
+    // Drops n samples from the head of the window.
+    void consume(size_t n);
+    void clear();
+
+    const float* data() const { return storage.data() + head; }
+    size_t size() const { return tail - head; }
+    bool empty() const { return tail == head; }
+    size_t capacity() const { return storage.size(); }
+    size_t free_space() const { return storage.size() - size(); }
+};
+
+#endif // AUDIO_WINDOW_H
@@ -0,0 +1,503 @@
+#include "batch_transcriber.h"
+#include "wav_reader.h"
+#include "resampler.h"
+#include "voice_activity_detector.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string json_escape(const std::string& text) {
+    std::string escaped;
+    escaped.reserve(text.size() + 2);
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buffer[8];
+                    std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    escaped += buffer;
+                } else {
+                    escaped += static_cast<char>(c);
+                }
+        }
+    }
+    return escaped;
+}
+
+// Reads back the "text" field of each line of a transcript written by
+// write_output(), joined with spaces
+bool read_transcript_text(const std::string& path, std::string& text) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    const std::string key = "\"text\":\"";
+    std::string line;
+    text.clear();
+    while (std::getline(file, line)) {
+        // The text is the last field, and escaped quotes never match the key
+        size_t start = line.rfind(key);
+        if (start == std::string::npos) {
+            continue;
+        }
+        std::string segment;
+        bool closed = false;
+        for (size_t i = start + key.size(); i < line.size() && !closed; ++i) {
+            char c = line[i];
+            if (c == '"') {
+                closed = true;
+            } else if (c != '\\' || i + 1 >= line.size()) {
+                segment += c;
+            } else {
+                char escaped = line[++i];
+                switch (escaped) {
+                    case 'n': segment += '\n'; break;
+                    case 'r': segment += '\r'; break;
+                    case 't': segment += '\t'; break;
+                    case 'u':
+                        // Only control characters are written as \u00XX
+                        if (i + 4 < line.size()) {
+                            segment += static_cast<char>(std::strtol(line.substr(i + 1, 4).c_str(), nullptr, 16));
+                            i += 4;
+                        }
+                        break;
+                    default: segment += escaped; break;
+                }
+            }
+        }
+        if (!closed) {
+            return false;
+        }
+        if (!segment.empty()) {
+            if (!text.empty()) {
+                text += ' ';
+            }
+            text += segment;
+        }
+    }
+    return true;
+}
+
+bool is_wav_file(const fs::path& path) {
+    std::string extension = path.extension().string();
+    for (char& c : extension) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return extension == ".wav";
+}
+
+} // namespace
+
+BatchTranscriber::BatchTranscriber(TranscriptionEngine& engine)
+    : engine(engine) {
+}
+
+BatchTranscriber::~BatchTranscriber() {
+    pool.reset();
+    for (whisper_state* state : states) {
+        engine.free_decoder_state(state);
+    }
+}
+
+bool BatchTranscriber::collect_inputs(const std::vector<std::string>& inputs, std::vector<std::shared_ptr<FileJob>>& found) {
+    std::set<std::string> outputs;
+    bool ok = true;
+
+    auto add = [&](const fs::path& input, const fs::path& relative) {
+        fs::path output = fs::path(output_dir) / relative;
+        output.replace_extension(".jsonl");
+        if (!outputs.insert(output.string()).second) {
+            std::cerr << "Skipping " << input.string() << ": output " << output.string()
+                      << " is already used by another input" << std::endl;
+            return;
+        }
+
+        auto job = std::make_shared<FileJob>();
+        job->input_path = input.string();
+        job->output_path = output.string();
+        job->display_name = relative.string();
+        found.push_back(job);
+    };
+
+    for (const auto& input : inputs) {
+        std::error_code error;
+        fs::path path(input);
+        if (fs::is_directory(path, error)) {
+            // Keep the directory layout below the input in the output
+            for (fs::recursive_directory_iterator it(path, error), end; !error && it != end; it.increment(error)) {
+                if (it->is_regular_file(error) && is_wav_file(it->path())) {
+                    add(it->path(), fs::relative(it->path(), path));
+                }
+            }
+            if (error) {
+                std::cerr << "Failed to scan " << input << ": " << error.message() << std::endl;
+                ok = false;
+            }
+        } else if (fs::is_regular_file(path, error)) {
+            add(path, path.filename());
+        } else {
+            std::cerr << "Input not found: " << input << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool BatchTranscriber::run(const std::vector<std::string>& inputs) {
+    std::vector<std::shared_ptr<FileJob>> found;
+    bool inputs_ok = collect_inputs(inputs, found);
+
+    // Finished outputs are kept unless asked to redo them
+    jobs.clear();
+    files_resumed = 0;
+    std::vector<std::shared_ptr<FileJob>> resumed;
+    for (auto& job : found) {
+        if (!overwrite && fs::exists(job->output_path)) {
+            files_resumed++;
+            resumed.push_back(job);
+        } else {
+            jobs.push_back(job);
+        }
+    }
+
+    files_total = jobs.size();
+    files_done = 0;
+    std::cout << "Files: " << found.size() << " found, " << files_resumed << " already transcribed, "
+              << files_total << " to do" << std::endl;
+
+    // Finished transcripts are offered again, so work that follows them
+    // (and was interrupted) can catch up while the rest decode
+    if (file_callback) {
+        for (auto& job : resumed) {
+            std::string text;
+            if (read_transcript_text(job->output_path, text)) {
+                file_callback(job->output_path, text, true);
+            } else {
+                std::cerr << "Could not read " << job->output_path << std::endl;
+            }
+        }
+    }
+    if (jobs.empty()) {
+        return inputs_ok && !found.empty();
+    }
+
+    // Largest files first, so the last ones to finish are short
+    std::vector<std::pair<uintmax_t, std::shared_ptr<FileJob>>> by_size;
+    for (auto& job : jobs) {
+        std::error_code error;
+        uintmax_t size = fs::file_size(job->input_path, error);
+        by_size.emplace_back(error ? 0 : size, job);
+    }
+    std::stable_sort(by_size.begin(), by_size.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    for (int i = static_cast<int>(states.size()); i < n_workers; ++i) {
+        whisper_state* state = engine.create_decoder_state();
+        if (!state) {
+            break;
+        }
+        states.push_back(state);
+    }
+    if (states.empty()) {
+        std::cerr << "No decoder could be created" << std::endl;
+        return false;
+    }
+    if (static_cast<int>(states.size()) < n_workers) {
+        std::cerr << "Running with " << states.size() << " of " << n_workers << " workers" << std::endl;
+    }
+
+    std::cout << "Workers: " << states.size() << " x " << threads_per_worker << " threads" << std::endl;
+
+    auto start_time = std::chrono::steady_clock::now();
+    pool = std::make_unique<WorkStealingPool>(static_cast<int>(states.size()));
+    for (auto& entry : by_size) {
+        std::shared_ptr<FileJob> job = entry.second;
+        pool->submit([this, job](int worker) { split_file(worker, job); });
+    }
+    pool->wait_idle();
+    wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    return inputs_ok && files_failed.load() == 0;
+}
+
+void BatchTranscriber::split_file(int worker, std::shared_ptr<FileJob> job) {
+    WavReader reader;
+    if (!reader.open(job->input_path)) {
+        job->read_failed = true;
+        finish_segment(job);
+        return;
+    }
+
+    std::unique_ptr<PolyphaseResampler> resampler;
+    if (reader.get_sample_rate() != sample_rate) {
+        resampler = std::make_unique<PolyphaseResampler>(reader.get_sample_rate(), sample_rate);
+    }
+
+    VoiceActivityDetector vad(sample_rate);
+    const size_t frame = vad.frame_size();
+    const size_t max_frames = static_cast<size_t>(max_segment_seconds * sample_rate) / frame;
+    const size_t min_frames = std::min(max_frames, static_cast<size_t>(min_segment_seconds * sample_rate) / frame);
+    const size_t min_speech_frames = static_cast<size_t>(min_speech_seconds * sample_rate) / frame;
+
+    // Audio from the start of the next segment on, and the VAD decision for
+    // each whole frame of it
+    std::vector<float> pending;
+    std::vector<uint8_t> speech;
+    uint64_t pending_start = 0;
+
+    auto classify = [&]() {
+        while ((speech.size() + 1) * frame <= pending.size()) {
+            speech.push_back(vad.process_frame(pending.data() + speech.size() * frame) ? 1 : 0);
+        }
+    };
+
+    // Emits pending[0, n) as a segment unless it is (nearly) all silence
+    auto cut = [&](size_t n) {
+        size_t n_frames = std::min(speech.size(), n / frame);
+        size_t speech_frames = 0;
+        for (size_t i = 0; i < n_frames; ++i) {
+            speech_frames += speech[i];
+        }
+        if (speech_frames > 0 && speech_frames >= min_speech_frames) {
+            spawn_segment(worker, job, pending.data(), n, pending_start);
+        } else {
+            silent_samples += n;
+        }
+        pending.erase(pending.begin(), pending.begin() + n);
+        speech.erase(speech.begin(), speech.begin() + n_frames);
+        pending_start += n;
+    };
+
+    // Cuts at the middle of the longest pause between min and max length;
+    // run-on speech without any pause is cut at the maximum length
+    auto cut_full_segments = [&]() {
+        while (speech.size() >= max_frames) {
+            size_t best_begin = 0, best_length = 0;
+            size_t run_begin = min_frames, run_length = 0;
+            for (size_t i = min_frames; i < max_frames; ++i) {
+                if (speech[i]) {
+                    run_length = 0;
+                    continue;
+                }
+                if (run_length == 0) {
+                    run_begin = i;
+                }
+                run_length++;
+                if (run_length >= best_length) {
+                    best_begin = run_begin;
+                    best_length = run_length;
+                }
+            }
+            size_t cut_frame = best_length > 0 ? best_begin + best_length / 2 : max_frames;
+            cut(std::max<size_t>(1, cut_frame) * frame);
+        }
+    };
+
+    const size_t block_size = 16384;
+    std::vector<float> file_buffer(block_size);
+    std::vector<float> converted;
+    uint64_t total_samples = 0;
+
+    while (true) {
+        size_t frames_read = reader.read(file_buffer.data(), block_size);
+        if (frames_read == 0) {
+            if (resampler) {
+                resampler->flush(converted);
+                pending.insert(pending.end(), converted.begin(), converted.end());
+                total_samples += converted.size();
+            }
+            break;
+        }
+
+        if (resampler) {
+            resampler->process(file_buffer.data(), frames_read, converted);
+            pending.insert(pending.end(), converted.begin(), converted.end());
+            total_samples += converted.size();
+        } else {
+            pending.insert(pending.end(), file_buffer.begin(), file_buffer.begin() + frames_read);
+            total_samples += frames_read;
+        }
+
+        classify();
+        cut_full_segments();
+    }
+
+    classify();
+    cut_full_segments();
+    if (!pending.empty()) {
+        cut(pending.size());
+    }
+
+    job->duration = static_cast<double>(total_samples) / sample_rate;
+    audio_samples += total_samples;
+    finish_segment(job);
+}
+
+void BatchTranscriber::spawn_segment(int worker, const std::shared_ptr<FileJob>& job, const float* samples,
+                                     size_t n_samples, uint64_t start_sample) {
+    size_t index;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        Segment segment;
+        segment.start = static_cast<double>(start_sample) / sample_rate;
+        segment.end = static_cast<double>(start_sample + n_samples) / sample_rate;
+        job->segments.push_back(segment);
+        index = job->segments.size() - 1;
+    }
+
+    job->remaining++;
+    auto audio = std::make_shared<std::vector<float>>(samples, samples + n_samples);
+    pool->spawn(worker, [this, job, index, audio](int decoder) {
+        decode_segment(decoder, job, index, *audio);
+    });
+}
+
+void BatchTranscriber::decode_segment(int worker, const std::shared_ptr<FileJob>& job, size_t index,
+                                      const std::vector<float>& samples) {
+    std::string text;
+    bool decoded = engine.transcribe_segment(states[worker], samples.data(), samples.size(), threads_per_worker, text);
+    if (decoded) {
+        segments_decoded++;
+    } else {
+        segments_failed++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->segments[index].text = std::move(text);
+        job->segments[index].decoded = decoded;
+    }
+    finish_segment(job);
+}
+
+void BatchTranscriber::finish_segment(const std::shared_ptr<FileJob>& job) {
+    if (--job->remaining > 0) {
+        return;
+    }
+
+    // Last piece of this file: every segment has been decoded or has failed
+    bool complete = !job->read_failed;
+    for (const auto& segment : job->segments) {
+        complete = complete && segment.decoded;
+    }
+    bool written = complete && write_output(*job);
+    if (written) {
+        files_written++;
+        if (file_callback) {
+            std::string text;
+            for (const auto& segment : job->segments) {
+                if (segment.text.empty()) {
+                    continue;
+                }
+                if (!text.empty()) {
+                    text += ' ';
+                }
+                text += segment.text;
+            }
+            file_callback(job->output_path, text, false);
+        }
+    } else {
+        files_failed++;
+    }
+
+    std::lock_guard<std::mutex> lock(output_mutex);
+    files_done++;
+    std::cout << "[" << files_done << "/" << files_total << "] " << job->display_name;
+    if (written) {
+        std::cout << std::fixed << std::setprecision(1) << " (" << job->duration << " s, "
+                  << job->segments.size() << " segments)" << std::endl;
+    } else {
+        std::cout << " FAILED" << std::endl;
+    }
+}
+
+bool BatchTranscriber::write_output(const FileJob& job) {
+    fs::path output(job.output_path);
+    std::error_code error;
+    if (output.has_parent_path()) {
+        fs::create_directories(output.parent_path(), error);
+        if (error) {
+            std::cerr << "Failed to create " << output.parent_path().string() << ": " << error.message() << std::endl;
+            return false;
+        }
+    }
+
+    // Written aside and renamed, so an output file is never half written
+    fs::path temporary = output;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary);
+        if (!file) {
+            std::cerr << "Failed to write " << temporary.string() << std::endl;
+            return false;
+        }
+
+        for (const auto& segment : job.segments) {
+            if (segment.text.empty()) {
+                continue;
+            }
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(2)
+                 << "{\"file\":\"" << json_escape(job.input_path) << "\","
+                 << "\"start\":" << segment.start << ","
+                 << "\"end\":" << segment.end << ","
+                 << "\"text\":\"" << json_escape(segment.text) << "\"}";
+            file << line.str() << '\n';
+        }
+
+        if (!file.flush()) {
+            std::cerr << "Failed to write " << temporary.string() << std::endl;
+            return false;
+        }
+    }
+
+    fs::rename(temporary, output, error);
+    if (error) {
+        std::cerr << "Failed to write " << output.string() << ": " << error.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void BatchTranscriber::print_summary() const {
+    double audio_seconds = get_audio_duration();
+    double silent_seconds = static_cast<double>(silent_samples.load()) / sample_rate;
+
+    std::cout << "\n=== Batch Summary ===" << std::endl;
+    std::cout << "Files: " << files_written.load() << " transcribed, " << files_resumed
+              << " already done, " << files_failed.load() << " failed" << std::endl;
+    std::cout << "Segments: " << segments_decoded.load() << " decoded, " << segments_failed.load() << " failed"
+              << std::fixed << std::setprecision(1) << ", " << silent_seconds << " s of silence skipped" << std::endl;
+    const DecodeWatchdog::Stats& watchdog = engine.get_watchdog_stats();
+    std::cout << "Watchdog: " << watchdog.repetitions.load() << " loops cut, "
+              << (watchdog.low_logprob.load() + watchdog.fallbacks.load()) << " decodes abandoned, "
+              << watchdog.no_speech.load() << " no-speech segments dropped, ~"
+              << watchdog.saved_seconds() << " s of decoding saved" << std::endl;
+    if (pool) {
+        std::cout << "Tasks: " << pool->get_tasks_run() << " run, " << pool->get_steals() << " stolen" << std::endl;
+    }
+
+    if (wall_seconds > 0.0) {
+        // Audio hours per wall-clock hour is simply the speed-up over real time
+        std::cout << std::setprecision(2) << "Audio: " << (audio_seconds / 3600.0) << " h in "
+                  << std::setprecision(1) << wall_seconds << " s"
+                  << " (" << (audio_seconds / wall_seconds) << " audio hours per wall-clock hour)" << std::endl;
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef BATCH_TRANSCRIBER_H
+#define BATCH_TRANSCRIBER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include "transcription_engine.h"
+#include "work_stealing_pool.h"
+
+// Transcribes many audio files as fast as the hardware allows.
+//
+// Every file becomes a task on a work-stealing pool. The task streams the
+// file once, cuts it at pauses into segments of at most max_segment_seconds
+// and spawns one decode task per segment; segments without speech are never
+// decoded. Idle workers steal segments (or whole files) from busy ones, so a
+// single long file still spreads over all decoders. Each worker decodes on
+// its own whisper_state of the one loaded model.
+//
+// Results go to one JSONL file per input, written once all of its segments
+// are done (via a temporary file and rename), so an existing output always
+// means a finished file and interrupted runs resume where they left off.
+class BatchTranscriber {
+private:
+    struct Segment {
+        double start = 0.0;
+        double end = 0.0;
+        std::string text;
+        bool decoded = false;
+    };
+
+    struct FileJob {
+        std::string input_path;
+        std::string output_path;
+        std::string display_name;
+        std::mutex mutex;
+        std::vector<Segment> segments;
+        std::atomic<size_t> remaining{1};   // Segments in flight plus the splitting task
+        double duration = 0.0;
+        bool read_failed = false;
+    };
+
+    TranscriptionEngine& engine;
+    const int sample_rate = 16000;
+    std::string output_dir = "transcripts";
+    int n_workers = 1;
+    int threads_per_worker = 1;
+    bool overwrite = false;
+    double max_segment_seconds = 28.0;   // Whisper decodes 30 s windows
+    double min_segment_seconds = 10.0;   // Cuts are only searched past this point
+    const double min_speech_seconds = 0.25; // Segments with less speech are skipped
+
+    // Called with the output path and full text of every transcript, and
+    // whether it was written by an earlier run
+    std::function<void(const std::string&, const std::string&, bool)> file_callback;
+
+    std::unique_ptr<WorkStealingPool> pool;
+    std::vector<whisper_state*> states;  // One per worker
+    std::vector<std::shared_ptr<FileJob>> jobs;
+
+    std::mutex output_mutex;
+    size_t files_total = 0;
+    size_t files_done = 0;
+
+    // Totals for the run
+    std::atomic<size_t> files_written{0};
+    std::atomic<size_t> files_failed{0};
+    size_t files_resumed = 0;
+    std::atomic<uint64_t> segments_decoded{0};
+    std::atomic<uint64_t> segments_failed{0};
+    std::atomic<uint64_t> audio_samples{0};
+    std::atomic<uint64_t> silent_samples{0};
+    double wall_seconds = 0.0;
+
+    bool collect_inputs(const std::vector<std::string>& inputs, std::vector<std::shared_ptr<FileJob>>& found);
+    void split_file(int worker, std::shared_ptr<FileJob> job);
+    void spawn_segment(int worker, const std::shared_ptr<FileJob>& job, const float* samples, size_t n_samples, uint64_t start_sample);
+    void decode_segment(int worker, const std::shared_ptr<FileJob>& job, size_t index, const std::vector<float>& samples);
+    void finish_segment(const std::shared_ptr<FileJob>& job);
+    bool write_output(const FileJob& job);
+
+public:
+    explicit BatchTranscriber(TranscriptionEngine& engine);
+    ~BatchTranscriber();
+
+    void set_output_dir(const std::string& dir) { output_dir = dir; }
+    void set_worker_count(int workers) { n_workers = std::max(1, workers); }
+    void set_threads_per_worker(int threads) { threads_per_worker = std::max(1, threads); }
+    void set_overwrite(bool enabled) { overwrite = enabled; }
+    void set_max_segment_seconds(double seconds) { max_segment_seconds = std::max(2.0, std::min(seconds, 30.0)); }
+
+    // Runs once per transcript: from run() for those already on disk, and on
+    // a decoding thread for each one written in this run
+    void set_file_callback(std::function<void(const std::string&, const std::string&, bool)> callback) { file_callback = callback; }
+
+    // Inputs are WAV files or directories (searched recursively for .wav).
+    // Returns false if nothing could be run or any file failed.
+    bool run(const std::vector<std::string>& inputs);
+
+    void print_summary() const;
+
+    size_t get_files_written() const { return files_written.load(); }
+    size_t get_files_failed() const { return files_failed.load(); }
+    size_t get_files_resumed() const { return files_resumed; }
+    double get_audio_duration() const { return static_cast<double>(audio_samples.load()) / sample_rate; }
+    double get_wall_duration() const { return wall_seconds; }
+};
+
+#endif // BATCH_TRANSCRIBER_H
@@ -0,0 +1,67 @@
+#include "chunk_scheduler.h"
+#include <thread>
+#include <algorithm>
+
+namespace {
+
+// Weight of the newest measurement in the moving average
+const double LOAD_SMOOTHING = 0.3;
+
+} // namespace
+
+ChunkScheduler::ChunkScheduler() {
+    levels = {
+        {2000, 1000, false, 5},  // Full 30 s encoder window, beam search
+        {2000, 1000, true, 5},   // Encoder sized to the chunk
+        {3000, 750, true, 2},    // Longer chunks: less audio decoded twice
+        {4000, 500, true, 1},    // Greedy
+    };
+}
+
+void ChunkScheduler::record(double decode_seconds, double audio_seconds, double backlog_seconds) {
+    if (audio_seconds <= 0.0) {
+        return;
+    }
+
+    double load = decode_seconds / audio_seconds;
+    load_average = have_measurement ? load_average + LOAD_SMOOTHING * (load - load_average) : load;
+    have_measurement = true;
+    decodes_since_change++;
+
+    // A backlog means we are already behind: react without waiting for the average
+    if (backlog_seconds > backlog_limit_seconds && level + 1 < levels.size()) {
+        change_level(level + 1);
+        return;
+    }
+
+    if (decodes_since_change < min_decodes_between_changes) {
+        return;
+    }
+
+    if (load_average > high_load && level + 1 < levels.size()) {
+        change_level(level + 1);
+    } else if (load_average < low_load && level > 0) {
+        change_level(level - 1);
+    }
+}
+
+void ChunkScheduler::change_level(size_t new_level) {
+    level = new_level;
+    decodes_since_change = 0;
+    level_changes++;
+}
+
+void ChunkScheduler::reset() {
+    // Keep the level: the hardware has not changed between sessions
+    load_average = 0.0;
+    have_measurement = false;
+    decodes_since_change = 0;
+    level_changes = 0;
+    catch_up = false;
+}
+
+int ChunkScheduler::default_thread_count() {
+    // Whisper gains little beyond 16 threads and suffers when oversubscribed
+    unsigned int hardware = std::thread::hardware_concurrency();
+    return static_cast<int>(std::clamp(hardware, 1u, 16u));
+}
@@ -0,0 +1,67 @@
+#ifndef CHUNK_SCHEDULER_H
+#define CHUNK_SCHEDULER_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Decoding settings for one quality level
+struct ChunkSettings {
+    int chunk_ms;     // Fixed chunk length; VAD segments are force-cut at 3x this
+    int overlap_ms;   // Audio shared between consecutive chunks
+    bool fit_audio_ctx; // Encode only the frames that hold audio instead of all 30 s
+    int beam_size;    // 1 = greedy
+};
+
+// Picks chunking and decoder settings from the measured real-time factor.
+//
+// Levels are ordered from most accurate to cheapest. After every final
+// decode the engine reports how long decoding took (partials included) and
+// how much stream time it covered; the scheduler keeps a moving average of
+// that load and steps to a cheaper level when it runs hot or a backlog
+// builds up, and back towards accuracy once there is clear headroom.
+class ChunkScheduler {
+private:
+    std::vector<ChunkSettings> levels;
+    size_t level = 0;
+
+    double load_average = 0.0;
+    bool have_measurement = false;
+    int decodes_since_change = 0;
+    uint64_t level_changes = 0;
+    bool catch_up = false;
+
+    // Thresholds on decode time / stream time
+    double high_load = 0.85;
+    double low_load = 0.4;
+    double backlog_limit_seconds = 2.0;
+    int min_decodes_between_changes = 3;
+
+    void change_level(size_t new_level);
+
+public:
+    ChunkScheduler();
+
+    // decode_seconds: wall time spent decoding; audio_seconds: stream time it
+    // advanced; backlog_seconds: audio waiting to be processed
+    void record(double decode_seconds, double audio_seconds, double backlog_seconds);
+
+    void reset();
+
+    // While catching up with a backlog the cheapest level is used regardless
+    // of the measured load; measurements continue in the background
+    void set_catch_up(bool enabled) { catch_up = enabled; }
+    bool is_catching_up() const { return catch_up; }
+
+    const ChunkSettings& current() const { return catch_up ? levels.back() : levels[level]; }
+    const ChunkSettings& most_accurate() const { return levels.front(); }
+    size_t get_level() const { return level; }
+    size_t get_level_count() const { return levels.size(); }
+    double get_load() const { return load_average; }
+    uint64_t get_level_changes() const { return level_changes; }
+
+    // Threads for whisper on this machine
+    static int default_thread_count();
+};
+
+#endif // CHUNK_SCHEDULER_H
@@ -0,0 +1,193 @@
+#include "decode_watchdog.h"
+#include "whisper.h"
+#include <algorithm>
+#include <cmath>
+
+void DecodeWatchdog::Stats::record(const DecodeWatchdog& watchdog) {
+    decodes++;
+    switch (watchdog.get_verdict()) {
+        case Verdict::REPETITION: repetitions++; break;
+        case Verdict::LOW_LOGPROB: low_logprob++; break;
+        case Verdict::FALLBACK: fallbacks++; break;
+        case Verdict::NO_SPEECH: no_speech++; break;
+        case Verdict::NONE: break;
+    }
+    saved_us += static_cast<uint64_t>(watchdog.get_saved_seconds() * 1e6);
+}
+
+void DecodeWatchdog::Stats::reset() {
+    decodes = 0;
+    repetitions = 0;
+    low_logprob = 0;
+    fallbacks = 0;
+    no_speech = 0;
+    saved_us = 0;
+}
+
+DecodeWatchdog::DecodeWatchdog(whisper_context* ctx, int token_limit, const Limits& limits)
+    : ctx(ctx), limits(limits), token_limit(std::max(1, token_limit)) {
+    eot = whisper_token_eot(ctx);
+    n_vocab = whisper_n_vocab(ctx);
+}
+
+void DecodeWatchdog::attach(whisper_full_params& params) {
+    params.logits_filter_callback = &DecodeWatchdog::logits_filter;
+    params.logits_filter_callback_user_data = this;
+    params.abort_callback = &DecodeWatchdog::abort_callback;
+    params.abort_callback_user_data = this;
+    params.new_segment_callback = &DecodeWatchdog::new_segment;
+    params.new_segment_callback_user_data = this;
+    params.encoder_begin_callback = &DecodeWatchdog::encoder_begin;
+    params.encoder_begin_callback_user_data = this;
+
+    // Whisper retries at temperature + k * temperature_inc up to 1.0
+    fallback_attempts = 0;
+    if (params.temperature_inc > 0.0f) {
+        fallback_attempts = static_cast<int>(std::floor((1.0f - params.temperature) / params.temperature_inc + 1e-3f));
+    }
+}
+
+void DecodeWatchdog::logits_filter(whisper_context*, whisper_state*, const whisper_token_data* tokens,
+                                   int n_tokens, float* logits, void* user_data) {
+    static_cast<DecodeWatchdog*>(user_data)->check_step(tokens, n_tokens, logits);
+}
+
+bool DecodeWatchdog::abort_callback(void* user_data) {
+    return static_cast<DecodeWatchdog*>(user_data)->abort_requested.load();
+}
+
+bool DecodeWatchdog::encoder_begin(whisper_context*, whisper_state*, void* user_data) {
+    // Once per window: the decode that follows starts a fresh attempt
+    auto* watchdog = static_cast<DecodeWatchdog*>(user_data);
+    std::lock_guard<std::mutex> lock(watchdog->mutex);
+    watchdog->attempt_started = false;
+    watchdog->attempt_tokens = 0;
+    watchdog->step_tokens = -1;
+    watchdog->step_best_logprob = -1e9f;
+    return !watchdog->abort_requested.load();
+}
+
+void DecodeWatchdog::new_segment(whisper_context*, whisper_state* state, int n_new, void* user_data) {
+    auto* watchdog = static_cast<DecodeWatchdog*>(user_data);
+    std::lock_guard<std::mutex> lock(watchdog->mutex);
+    int n_segments = whisper_full_n_segments_from_state(state);
+    bool silent = n_new > 0;
+    for (int i = std::max(0, n_segments - n_new); i < n_segments; ++i) {
+        silent = silent && whisper_full_get_segment_no_speech_prob_from_state(state, i) > watchdog->limits.no_speech_thold;
+    }
+
+    // The rest of a long input is not worth decoding after a silent window
+    if (silent) {
+        watchdog->request_abort(Verdict::NO_SPEECH, 0.0);
+    }
+}
+
+double DecodeWatchdog::step_seconds(int n_tokens) const {
+    double elapsed = std::chrono::duration<double>(Clock::now() - attempt_start).count();
+    return elapsed / std::max(1, n_tokens);
+}
+
+void DecodeWatchdog::request_abort(Verdict reason, double remaining_seconds) {
+    // Caller holds mutex
+    if (abort_requested.exchange(true)) {
+        return;
+    }
+    if (verdict == Verdict::NONE) {
+        verdict = reason;
+    }
+    saved_seconds += std::max(0.0, remaining_seconds);
+}
+
+void DecodeWatchdog::check_step(const whisper_token_data* tokens, int n_tokens, float* logits) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (abort_requested.load()) {
+        return;
+    }
+
+    if (!attempt_started) {
+        // The first step follows the encoder; step times are measured from here
+        attempt_started = true;
+        attempt_start = Clock::now();
+    } else if (n_tokens == 0 && attempt_tokens > 0) {
+        // Whisper judged the attempt a failure and starts over hotter (a new
+        // window would have passed through encoder_begin first)
+        double attempt_seconds = std::chrono::duration<double>(Clock::now() - attempt_start).count();
+        request_abort(Verdict::FALLBACK, attempt_seconds * fallback_attempts);
+        return;
+    }
+    attempt_tokens = std::max(attempt_tokens, n_tokens);
+
+    // Confidence of the best beam, judged once a step is complete
+    if (n_tokens != step_tokens) {
+        if (step_tokens >= limits.min_tokens && step_best_logprob < limits.abort_logprob) {
+            request_abort(Verdict::LOW_LOGPROB, step_seconds(step_tokens) * (token_limit - step_tokens));
+            return;
+        }
+        step_tokens = n_tokens;
+        step_best_logprob = -1e9f;
+    }
+    if (n_tokens > 0) {
+        float sum = 0.0f;
+        for (int i = 0; i < n_tokens; ++i) {
+            sum += tokens[i].plog;
+        }
+        step_best_logprob = std::max(step_best_logprob, sum / n_tokens);
+    }
+
+    std::vector<int32_t> ids;
+    ids.reserve(n_tokens);
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i].id < eot) {
+            ids.push_back(tokens[i].id);
+        }
+    }
+    if (repetition_start(ids, limits) == ids.size()) {
+        return;
+    }
+
+    // Looping: end-of-text is the only way on
+    for (int i = 0; i < n_vocab; ++i) {
+        if (i != eot) {
+            logits[i] = -INFINITY;
+        }
+    }
+    if (!truncated) {
+        truncated = true;
+        if (verdict == Verdict::NONE) {
+            verdict = Verdict::REPETITION;
+        }
+        saved_seconds += step_seconds(n_tokens) * std::max(0, token_limit - n_tokens);
+    }
+}
+
+bool DecodeWatchdog::keep_segment(float no_speech_prob, float mean_logprob) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (no_speech_prob > limits.no_speech_thold && mean_logprob < limits.logprob_thold) {
+        if (verdict == Verdict::NONE) {
+            verdict = Verdict::NO_SPEECH;
+        }
+        return false;
+    }
+    return true;
+}
+
+size_t DecodeWatchdog::repetition_start(const std::vector<int32_t>& ids, const Limits& limits) {
+    size_t n = ids.size();
+    for (size_t length = 1; length <= limits.max_ngram; ++length) {
+        size_t needed = static_cast<size_t>(length == 1 ? limits.token_repeats : limits.ngram_repeats);
+        if (n < length * needed) {
+            break;
+        }
+
+        // Back-to-back copies of the last `length` tokens
+        size_t copies = 1;
+        while ((copies + 1) * length <= n &&
+               std::equal(ids.end() - length, ids.end(), ids.end() - (copies + 1) * length)) {
+            copies++;
+        }
+        if (copies >= needed) {
+            return n - (copies - 1) * length;
+        }
+    }
+    return n;
+}
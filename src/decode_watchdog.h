@@ -0,0 +1,132 @@
+#ifndef DECODE_WATCHDOG_H
+#define DECODE_WATCHDOG_H
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+struct whisper_context;
+struct whisper_state;
+struct whisper_full_params;
+struct whisper_token_data;
+
+struct DecodeWatchdogLimits {
+    size_t max_ngram = 16;        // Longest repeated phrase looked for, in tokens
+    int ngram_repeats = 3;        // Back-to-back copies of a 2..max_ngram token phrase
+    int token_repeats = 6;        // Back-to-back copies of a single token
+    int min_tokens = 6;           // Tokens decoded before confidence is judged
+    float abort_logprob = -1.5f;  // Mean log-probability that abandons a decode
+    float logprob_thold = -1.0f;  // Whisper's own threshold for a failed decode
+    float no_speech_thold = 0.6f; // Segment no-speech probability treated as silence
+};
+
+// Stops Whisper decodes that are producing garbage.
+//
+// Attached to one whisper_full() call through its logits filter, abort,
+// encoder-begin and new-segment callbacks. Whisper runs the logits filter for
+// each beam or best-of decoder on its own thread, so the callbacks share the
+// state below under a mutex. Every decoding step is checked for:
+//  - repetition: a phrase of up to max_ngram tokens repeating back to back. Only
+//    end-of-text is allowed from then on, so the decode ends with the text
+//    before the loop instead of running to the token limit;
+//  - low confidence: a mean log-probability below abort_logprob (for the
+//    best beam) once min_tokens have been decoded, typical of text made up
+//    from noise. The decode is aborted;
+//  - temperature fallback: Whisper restarts a failed decode at a higher
+//    temperature up to five times. The first restart aborts instead. A
+//    restart is an empty sequence with no encoder pass before it; each new
+//    window of a long input also starts empty, but after its encoder pass.
+// whisper.cpp masks the no-speech token before the logits filter runs, so
+// no-speech probability is only known per finished segment: such segments
+// are dropped by keep_segment(), and a no-speech segment aborts any
+// windows still to come.
+//
+// Aborted decodes are reported as such; the time they would still have
+// taken is estimated from this decode's own step times and the token limit,
+// which makes the saving an upper bound.
+class DecodeWatchdog {
+public:
+    enum class Verdict {
+        NONE,
+        REPETITION,
+        LOW_LOGPROB,
+        FALLBACK,
+        NO_SPEECH
+    };
+
+    using Limits = DecodeWatchdogLimits;
+
+    // Totals across decodes, updated from any decoder thread
+    struct Stats {
+        std::atomic<uint64_t> decodes{0};
+        std::atomic<uint64_t> repetitions{0};
+        std::atomic<uint64_t> low_logprob{0};
+        std::atomic<uint64_t> fallbacks{0};
+        std::atomic<uint64_t> no_speech{0};
+        std::atomic<uint64_t> saved_us{0};
+
+        void record(const DecodeWatchdog& watchdog);
+        void reset();
+        uint64_t interventions() const { return repetitions.load() + low_logprob.load() + fallbacks.load() + no_speech.load(); }
+        double saved_seconds() const { return static_cast<double>(saved_us.load()) / 1e6; }
+    };
+
+private:
+    whisper_context* ctx;
+    Limits limits;
+    int token_limit;
+    int eot = 0;
+    int n_vocab = 0;
+
+    std::mutex mutex;   // Held by the callbacks while they read or change the state below
+    std::atomic<bool> abort_requested{false};
+    Verdict verdict = Verdict::NONE;
+    bool truncated = false;
+
+    // Current attempt (Whisper restarts at a higher temperature on failure);
+    // reset when the encoder starts on a new window
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point attempt_start;
+    bool attempt_started = false;
+    int attempt_tokens = 0;              // Longest sequence seen in this attempt
+    int step_tokens = -1;                // Sequence length of the step being scored
+    float step_best_logprob = -1e9f;     // Best mean log-probability among its beams
+    double saved_seconds = 0.0;
+    int fallback_attempts = 0;           // Restarts Whisper would still make after a failure
+
+    static void logits_filter(whisper_context* ctx, whisper_state* state, const whisper_token_data* tokens,
+                              int n_tokens, float* logits, void* user_data);
+    static bool abort_callback(void* user_data);
+    static bool encoder_begin(whisper_context* ctx, whisper_state* state, void* user_data);
+    static void new_segment(whisper_context* ctx, whisper_state* state, int n_new, void* user_data);
+
+    void check_step(const whisper_token_data* tokens, int n_tokens, float* logits);
+    void request_abort(Verdict reason, double remaining_seconds);
+    double step_seconds(int n_tokens) const;
+
+public:
+    DecodeWatchdog(whisper_context* ctx, int token_limit, const Limits& limits = Limits());
+
+    DecodeWatchdog(const DecodeWatchdog&) = delete;
+    DecodeWatchdog& operator=(const DecodeWatchdog&) = delete;
+
+    // Installs the callbacks; the watchdog must outlive the whisper_full() call
+    void attach(whisper_full_params& params);
+
+    // False for a finished segment that is silence with made-up text
+    bool keep_segment(float no_speech_prob, float mean_logprob);
+
+    // Length of ids once a repeated tail is cut back to its first copy
+    static size_t repetition_start(const std::vector<int32_t>& ids, const Limits& limits);
+
+    bool aborted() const { return abort_requested.load(); }
+    bool was_truncated() const { return truncated; }
+    Verdict get_verdict() const { return verdict; }
+    double get_saved_seconds() const { return saved_seconds; }
+    const Limits& get_limits() const { return limits; }
+};
+
+#endif // DECODE_WATCHDOG_H
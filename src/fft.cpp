@@ -0,0 +1,59 @@
+#include "fft.h"
+#include <cmath>
+#include <algorithm>
+
+FFT::FFT(size_t size)
+    : n(size), twiddles(size), input(size), output(size) {
+    for (size_t k = 0; k < n; ++k) {
+        double angle = -2.0 * M_PI * static_cast<double>(k) / static_cast<double>(n);
+        twiddles[k] = std::complex<float>(static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)));
+    }
+}
+
+void FFT::transform(const std::complex<float>* in, size_t stride, size_t size, std::complex<float>* out) const {
+    // A sub-transform of this size uses every (n / size)-th twiddle
+    const size_t twiddle_step = n / size;
+
+    if (size == 1) {
+        out[0] = in[0];
+        return;
+    }
+
+    if (size % 2 != 0) {
+        // Direct DFT for odd sizes
+        for (size_t k = 0; k < size; ++k) {
+            std::complex<float> sum(0.0f, 0.0f);
+            for (size_t j = 0; j < size; ++j) {
+                sum += in[j * stride] * twiddles[(j * k % size) * twiddle_step];
+            }
+            out[k] = sum;
+        }
+        return;
+    }
+
+    // Even samples into the first half, odd samples into the second, then combine
+    const size_t half = size / 2;
+    transform(in, stride * 2, half, out);
+    transform(in + stride, stride * 2, half, out + half);
+
+    for (size_t k = 0; k < half; ++k) {
+        std::complex<float> even = out[k];
+        std::complex<float> odd = out[k + half] * twiddles[k * twiddle_step];
+        out[k] = even + odd;
+        out[k + half] = even - odd;
+    }
+}
+
+void FFT::power_spectrum(const float* samples, size_t n_input, float* power) {
+    size_t used = std::min(n_input, n);
+    for (size_t i = 0; i < used; ++i) {
+        input[i] = std::complex<float>(samples[i], 0.0f);
+    }
+    std::fill(input.begin() + used, input.end(), std::complex<float>(0.0f, 0.0f));
+
+    transform(input.data(), 1, n, output.data());
+
+    for (size_t k = 0; k < bins(); ++k) {
+        power[k] = std::norm(output[k]);
+    }
+}
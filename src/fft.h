@@ -0,0 +1,34 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <vector>
+#include <complex>
+#include <cstddef>
+
+// Real-input FFT for a fixed transform size.
+//
+// Even sizes are split recursively (radix-2, decimation in time) and odd
+// leftovers are handled with a direct DFT, so any size works and powers of two
+// run in O(n log n). Twiddle factors and scratch space are allocated once in
+// the constructor; transforms never allocate.
+class FFT {
+private:
+    size_t n;
+    std::vector<std::complex<float>> twiddles;  // exp(-2*pi*i*k/n)
+    std::vector<std::complex<float>> input;
+    std::vector<std::complex<float>> output;
+
+    void transform(const std::complex<float>* in, size_t stride, size_t size, std::complex<float>* out) const;
+
+public:
+    explicit FFT(size_t size);
+
+    // Power spectrum |X[k]|^2 of n_input real samples (zero-padded to the
+    // transform size). Writes bins() values.
+    void power_spectrum(const float* samples, size_t n_input, float* power);
+
+    size_t size() const { return n; }
+    size_t bins() const { return n / 2 + 1; }
+};
+
+#endif // FFT_H
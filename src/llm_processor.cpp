@@ -5,8 +5,19 @@
 #include <sstream>
 #include <chrono>
 #include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <filesystem>
+#include <cstring>
+#include <cctype>
 
-LLMProcessor::LLMProcessor() : model(nullptr), ctx(nullptr), is_initialized(false), is_processing(false) {
+LLMProcessor::LLMProcessor() : model(nullptr), ctx(nullptr), is_initialized(false) {
+    // Default location for the decoded instruction prefix
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME")) {
+        prefix_cache_dir = std::string(cache_home) + "/speakprompt";
+    } else if (const char* home = std::getenv("HOME")) {
+        prefix_cache_dir = std::string(home) + "/.cache/speakprompt";
+    }
 }
 
 LLMProcessor::~LLMProcessor() {
@@ -42,12 +53,27 @@ bool LLMProcessor::initialize(const std::string& model_file_path) {
     
     // Initialize context parameters
     llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = 4096; // Context size
     ctx_params.n_batch = 512;
+    
+    // Sequences for parallel requests or the chunks of a long one, in one
+    // pool of cells so the prefix is stored once
+    n_sequences = std::max(n_parallel, chunk_sequences);
+    ctx_params.n_seq_max = n_sequences + 1;
+    ctx_params.kv_unified = true;
     ctx_params.n_threads = 8;
     ctx_params.n_threads_batch = 8;
     
-    ctx = llama_init_from_model(model, ctx_params);
+    if (size_context(ctx_params)) {
+        ctx = llama_init_from_model(model, ctx_params);
+        if (!ctx && kv_cache_type != "f16") {
+            // Without flash attention there is no quantized V cache
+            std::cerr << "Could not create a " << kv_cache_type << " KV cache, using f16" << std::endl;
+            kv_cache_type = "f16";
+            if (size_context(ctx_params)) {
+                ctx = llama_init_from_model(model, ctx_params);
+            }
+        }
+    }
     if (!ctx) {
         std::cerr << "Failed to create LLM context" << std::endl;
         llama_model_free(model);
@@ -55,7 +81,33 @@ bool LLMProcessor::initialize(const std::string& model_file_path) {
         return false;
     }
     
+    std::cout << "LLM KV cache: " << kv_cache_tokens << " tokens, " << kv_cache_type << ", about "
+              << kv_cache_bytes / (1024 * 1024) << " MB";
+    if (kv_budget_mb > 0) {
+        std::cout << " (budget " << kv_budget_mb << " MB)";
+    }
+    std::cout << std::endl;
+    
+    // Decode the shared instructions once, up front
+    if (!prepare_prefix()) {
+        std::cerr << "Failed to decode the cleanup instructions" << std::endl;
+        llama_free(ctx);
+        ctx = nullptr;
+        llama_model_free(model);
+        model = nullptr;
+        return false;
+    }
+    
+    // A draft model is an optional speed-up; without it cleanup still works
+    if (!draft_model_path.empty() && !load_draft_model()) {
+        std::cerr << "Continuing without a draft model" << std::endl;
+    }
+    
+    // Requests are stopped mid-decode when cancelled or late
+    llama_set_abort_callback(ctx, abort_callback, this);
+    
     is_initialized = true;
+    worker = std::thread(&LLMProcessor::worker_loop, this);
     
     // Extract model name from the loaded model
     char desc_buf[512];
@@ -94,7 +146,8 @@ bool LLMProcessor::initialize(const std::string& model_file_path) {
 }
 
 void LLMProcessor::cleanup() {
-    cancel_processing();
+    stop_worker();
+    free_draft_model();
     
     if (ctx) {
         llama_free(ctx);
@@ -106,11 +159,66 @@ void LLMProcessor::cleanup() {
         model = nullptr;
     }
     
-    is_initialized = false;
+    cached_tokens.clear();
+    prefilled_chunks.clear();
+}
+
+std::shared_ptr<LLMProcessor::Job> LLMProcessor::make_job(const std::string& raw_text, const JobOptions& options) {
+    auto job = std::make_shared<Job>();
+    job->raw_text = raw_text;
+    job->options = options;
+    job->on_done = options.on_done;
+    job->deadline = options.timeout_ms > 0
+        ? std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout_ms)
+        : std::chrono::steady_clock::time_point::max();
+    return job;
+}
+
+void LLMProcessor::enqueue(const std::shared_ptr<Job>& job) {
+    std::shared_ptr<Job> rejected;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (!is_initialized || stopping) {
+            rejected = job;
+        } else {
+            job->sequence = next_sequence++;
+            queue.push_back(job);
+            
+            // Over the limit, the least important request goes: lowest
+            // priority, newest among equals
+            if (queue.size() > max_queued) {
+                auto victim = std::min_element(queue.begin(), queue.end(), [](const auto& a, const auto& b) {
+                    if (a->options.priority != b->options.priority) {
+                        return a->options.priority < b->options.priority;
+                    }
+                    return a->sequence > b->sequence;
+                });
+                rejected = *victim;
+                queue.erase(victim);
+                std::cerr << "LLM request queue is full, dropping a request" << std::endl;
+            }
+            jobs_waiting = queue.size();
+        }
+    }
+    queue_cv.notify_one();
+    
+    if (rejected) {
+        LLMResult result;
+        result.status = LLMResult::Status::REJECTED;
+        finish_job(rejected, result);
+    }
+}
+
+std::future<LLMResult> LLMProcessor::submit(const std::string& raw_text, const JobOptions& options) {
+    auto job = make_job(raw_text, options);
+    std::future<LLMResult> future = job->promise.get_future();
+    enqueue(job);
+    return future;
 }
 
 void LLMProcessor::process_text_async(const std::string& raw_text, 
-                                    std::function<void(const std::string&)> callback) {
+                                    std::function<void(const std::string&)> callback,
+                                    std::function<void(const std::string&)> on_token) {
     if (!is_initialized) {
         std::cerr << "LLM processor not initialized" << std::endl;
         if (callback) {
@@ -119,70 +227,660 @@ void LLMProcessor::process_text_async(const std::string& raw_text,
         return;
     }
     
-    if (is_processing.load()) {
-        std::cerr << "LLM processor is busy, cannot process new text" << std::endl;
-        if (callback) {
-            callback("");
+    JobOptions options;
+    options.on_token = on_token;
+    
+    // The worker reports through the callback; nobody waits on the future
+    auto job = make_job(raw_text, options);
+    if (callback) {
+        job->on_done = [callback](const LLMResult& result) {
+            callback(result.status == LLMResult::Status::OK ? result.text : "");
+        };
+    }
+    enqueue(job);
+}
+
+std::string LLMProcessor::process_text(const std::string& raw_text,
+                                       std::function<void(const std::string&)> on_token) {
+    if (!is_initialized) {
+        std::cerr << "LLM processor not initialized" << std::endl;
+        return "";
+    }
+    
+    JobOptions options;
+    options.on_token = on_token;
+    LLMResult result = submit(raw_text, options).get();
+    return result.status == LLMResult::Status::OK ? result.text : "";
+}
+
+void LLMProcessor::prefill_async(const std::string& transcript) {
+    if (!is_initialized || transcript.empty()) {
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        prefill_text = transcript;
+        prefill_pending = true;
+    }
+    queue_cv.notify_one();
+}
+
+bool LLMProcessor::is_busy() const {
+    return jobs_running.load() > 0 || jobs_waiting.load() > 0;
+}
+
+void LLMProcessor::cancel_processing() {
+    std::vector<std::shared_ptr<Job>> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        cancelled.swap(queue);
+        jobs_waiting = 0;
+        
+        // Running requests notice at their next token or decode step
+        for (Job* job : running_jobs) {
+            job->options.cancel.cancel();
         }
+    }
+    
+    for (const auto& job : cancelled) {
+        LLMResult result;
+        result.status = LLMResult::Status::CANCELLED;
+        finish_job(job, result);
+    }
+}
+
+void LLMProcessor::stop_worker() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+        prefill_pending = false;
+        
+        // Requests from here on are rejected rather than left to a worker that is gone
+        is_initialized = false;
+    }
+    cancel_processing();
+    queue_cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = false;
+}
+
+void LLMProcessor::finish_job(const std::shared_ptr<Job>& job, LLMResult result) {
+    if (job->on_done) {
+        job->on_done(result);
+    }
+    job->promise.set_value(std::move(result));
+}
+
+bool LLMProcessor::abort_callback(void* user_data) {
+    // Called from inside llama_decode() on the worker thread. A batch is
+    // only abandoned once every request in it is to stop; single requests
+    // are dropped from a batch between steps instead.
+    auto* self = static_cast<LLMProcessor*>(user_data);
+    
+    // A long request finishes on the thread that cancelled its last queued
+    // chunk, so running_jobs can change under us. The check is repeated
+    // often; when the lock is busy it simply waits for the next one.
+    std::unique_lock<std::mutex> lock(self->queue_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || self->running_jobs.empty()) {
+        return false;
+    }
+    for (Job* job : self->running_jobs) {
+        if (!job->cancelled() && !job->expired()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<LLMProcessor::Job> LLMProcessor::next_job() {
+    std::shared_ptr<Job> job;
+    std::vector<std::shared_ptr<Job>> dropped;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        
+        // Requests cancelled or past their deadline while queued are
+        // answered without running
+        auto gone = std::stable_partition(queue.begin(), queue.end(), [](const auto& queued) {
+            return !queued->cancelled() && !queued->expired();
+        });
+        dropped.assign(gone, queue.end());
+        queue.erase(gone, queue.end());
+        
+        if (!queue.empty() && !stopping) {
+            auto next = std::max_element(queue.begin(), queue.end(), [](const auto& a, const auto& b) {
+                if (a->options.priority != b->options.priority) {
+                    return a->options.priority < b->options.priority;
+                }
+                return a->sequence > b->sequence;
+            });
+            job = *next;
+            queue.erase(next);
+            
+            // The request supersedes any transcript still waiting to be prefilled
+            prefill_pending = false;
+            running_jobs.push_back(job.get());
+            jobs_running++;
+        }
+        jobs_waiting = queue.size();
+    }
+    
+    for (const auto& queued : dropped) {
+        LLMResult result;
+        result.status = stop_status(*queued);
+        finish_job(queued, result);
+    }
+    return job;
+}
+
+void LLMProcessor::end_job(const std::shared_ptr<Job>& job, LLMResult result) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        running_jobs.erase(std::remove(running_jobs.begin(), running_jobs.end(), job.get()), running_jobs.end());
+    }
+    finish_job(job, std::move(result));
+    jobs_running--;
+}
+
+void LLMProcessor::worker_loop() {
+    while (true) {
+        std::string text;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return stopping || !queue.empty() || prefill_pending; });
+            if (stopping) {
+                return;
+            }
+            if (queue.empty()) {
+                text = std::move(prefill_text);
+                prefill_pending = false;
+            }
+        }
+        
+        if (!text.empty()) {
+            prefill(text);
+            continue;
+        }
+        
+        std::shared_ptr<Job> job = next_job();
+        if (!job) {
+            continue;
+        }
+        if (split_long_job(job)) {
+            run_batched(nullptr);
+        } else if (n_parallel > 1) {
+            run_batched(job);
+        } else {
+            drop_prefilled_chunks();
+            end_job(job, run_job(*job));
+        }
+    }
+}
+
+void LLMProcessor::prefill(const std::string& text) {
+    // The last tokens of a transcript may still merge with text to come
+    const size_t holdback = 2;
+    
+    std::vector<int32_t> tokens = tokenize(text, false);
+    size_t room = llama_n_ctx(ctx) - prefix_tokens.size() - 1;
+    if (tokens.size() <= holdback) {
         return;
     }
     
-    completion_callback = callback;
-    is_processing = true;
+    // Long transcripts are cleaned up in chunks, without sequence 0
+    if (static_cast<int>(tokens.size()) > chunk_tokens) {
+        prefill_chunks(text);
+        return;
+    }
+    drop_prefilled_chunks();
+    tokens.resize(std::min(tokens.size() - holdback, room));
     
-    // Start processing in a separate thread
-    processing_thread = std::thread(&LLMProcessor::processing_worker, this, raw_text);
-    processing_thread.detach();
+    int n_keep = reuse_cached_tokens(tokens, tokens.size());
+    if (n_keep < 0) {
+        return;
+    }
+    
+    // One batch at a time, so a new request gets the context soon
+    size_t n_batch = llama_n_batch(ctx);
+    for (size_t i = n_keep; i < tokens.size() && jobs_waiting.load() == 0; i += n_batch) {
+        size_t n = std::min(n_batch, tokens.size() - i);
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, static_cast<int32_t>(n))) != 0) {
+            llama_memory_seq_rm(llama_get_memory(ctx), 0, static_cast<llama_pos>(prefix_tokens.size() + cached_tokens.size()), -1);
+            break;
+        }
+        cached_tokens.insert(cached_tokens.end(), tokens.begin() + i, tokens.begin() + i + n);
+    }
+    
+    // The draft model reads along, so its first draft need not wait for it
+    if (draft_ctx && jobs_waiting.load() == 0) {
+        std::vector<int32_t> history(prefix_tokens);
+        history.insert(history.end(), cached_tokens.begin(), cached_tokens.end());
+        sync_draft(history);
+    }
 }
 
-std::string LLMProcessor::process_text(const std::string& raw_text) {
-    if (!is_initialized) {
-        std::cerr << "LLM processor not initialized" << std::endl;
-        return "";
+LLMResult LLMProcessor::run_job(Job& job) {
+    if (job.raw_text.empty()) {
+        LLMResult result;
+        result.status = LLMResult::Status::OK;
+        return result;
     }
     
-    if (is_processing.load()) {
-        std::cerr << "LLM processor is busy" << std::endl;
+    std::string prompt = create_cleanup_prompt(job.raw_text);
+    return generate_response(prompt, job);
+}
+
+bool LLMProcessor::split_long_job(const std::shared_ptr<Job>& job) {
+    // Chunks arrive tokenized and are never split again
+    if (job->raw_text.empty() || !job->prompt_tokens.empty()) {
+        return false;
+    }
+    int n_tokens = static_cast<int>(tokenize(job->raw_text, false).size());
+    if (n_tokens <= chunk_tokens) {
+        return false;
+    }
+    
+    auto chunked = std::make_shared<ChunkedJob>();
+    chunked->parent = job;
+    chunked->start = std::chrono::steady_clock::now();
+    chunked->chunks = split_transcript(job->raw_text);
+    if (chunked->chunks.size() < 2) {
+        return false;
+    }
+    chunked->results.resize(chunked->chunks.size());
+    
+    // The chunks share the request's cancel token and deadline, and its
+    // place in the queue, so they run before anything submitted later
+    std::vector<std::shared_ptr<Job>> parts;
+    for (size_t i = 0; i < chunked->chunks.size(); ++i) {
+        auto part = std::make_shared<Job>();
+        part->sequence = job->sequence;
+        part->raw_text = chunked->chunks[i].text;
+        part->options.priority = job->options.priority;
+        part->options.cancel = job->options.cancel;
+        part->deadline = job->deadline;
+        part->prompt_tokens = tokenize(create_chunk_prompt(chunked->chunks[i]), false);
+        // The part is alive while its own on_done runs
+        part->on_done = [this, chunked, i, chunk = part.get()](const LLMResult& result) {
+            chunk_finished(chunked, i, *chunk, result);
+        };
+        parts.push_back(part);
+    }
+    
+    std::cout << "Cleaning up " << n_tokens << "-token transcript in " << parts.size() << " chunks" << std::endl;
+    
+    bool shut_down = false;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (stopping) {
+            shut_down = true;
+        } else {
+            queue.insert(queue.end(), parts.begin(), parts.end());
+            jobs_waiting = queue.size();
+        }
+    }
+    if (shut_down) {
+        for (const auto& part : parts) {
+            LLMResult result;
+            result.status = LLMResult::Status::CANCELLED;
+            finish_job(part, result);
+        }
+    }
+    return true;
+}
+
+static std::string trim_whitespace(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\n\r");
+    if (begin == std::string::npos) {
         return "";
     }
+    size_t end = text.find_last_not_of(" \t\n\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+std::vector<LLMProcessor::TranscriptChunk> LLMProcessor::split_transcript(const std::string& text) {
+    struct Piece {
+        std::string text;
+        bool paragraph_start = false;
+        int n_tokens = 0;
+    };
     
-    is_processing = true;
-    std::string result = clean_up_text(raw_text);
-    is_processing = false;
+    // Sentences, ended by . ! ? before whitespace or by a blank line
+    std::vector<Piece> sentences;
+    size_t start = 0;
+    bool paragraph_start = false;
+    auto add_sentence = [&](size_t end, bool paragraph_end) {
+        std::string sentence = trim_whitespace(text.substr(start, end - start));
+        if (!sentence.empty()) {
+            sentences.push_back({sentence, paragraph_start, 0});
+            paragraph_start = false;
+        }
+        if (paragraph_end && !sentences.empty()) {
+            paragraph_start = true;
+        }
+        start = end;
+    };
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '\n' && i + 1 < text.size() && text[i + 1] == '\n') {
+            add_sentence(i, true);
+        } else if ((c == '.' || c == '!' || c == '?') &&
+                   (i + 1 == text.size() || std::isspace(static_cast<unsigned char>(text[i + 1])))) {
+            add_sentence(i + 1, false);
+        }
+    }
+    add_sentence(text.size(), false);
     
-    return result;
+    // A sentence longer than a chunk (speech without punctuation) is cut
+    // into equal runs of words
+    std::vector<Piece> pieces;
+    for (auto& sentence : sentences) {
+        sentence.n_tokens = static_cast<int>(tokenize(sentence.text, false).size());
+        int n_parts = (sentence.n_tokens + chunk_tokens - 1) / chunk_tokens;
+        if (n_parts <= 1) {
+            pieces.push_back(sentence);
+            continue;
+        }
+        size_t from = 0;
+        for (int part = 1; part <= n_parts && from < sentence.text.size(); ++part) {
+            size_t to = sentence.text.size();
+            if (part < n_parts) {
+                to = sentence.text.find(' ', sentence.text.size() * part / n_parts);
+                if (to == std::string::npos) {
+                    to = sentence.text.size();
+                }
+            }
+            Piece piece;
+            piece.text = trim_whitespace(sentence.text.substr(from, to - from));
+            piece.paragraph_start = sentence.paragraph_start && from == 0;
+            piece.n_tokens = static_cast<int>(tokenize(piece.text, false).size());
+            if (!piece.text.empty()) {
+                pieces.push_back(piece);
+            }
+            from = to;
+        }
+    }
+    
+    // Sentences are packed into chunks; a paragraph starts a new chunk once
+    // the current one is half full
+    std::vector<TranscriptChunk> chunks;
+    std::vector<size_t> chunk_starts;
+    int n_chunk = 0;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        const Piece& piece = pieces[i];
+        bool cut = chunks.empty() || n_chunk + piece.n_tokens > chunk_tokens ||
+                   (piece.paragraph_start && n_chunk >= chunk_tokens / 2);
+        if (cut) {
+            chunks.emplace_back();
+            chunks.back().paragraph_start = piece.paragraph_start;
+            chunk_starts.push_back(i);
+            n_chunk = 0;
+        } else {
+            chunks.back().text += piece.paragraph_start ? "\n\n" : " ";
+        }
+        chunks.back().text += piece.text;
+        n_chunk += piece.n_tokens;
+    }
+    
+    // Context is the whole sentences ending the previous chunk that fit in
+    // the overlap, or at least the end of its last one
+    for (size_t c = 1; c < chunks.size(); ++c) {
+        std::string context;
+        int n_context = 0;
+        for (size_t i = chunk_starts[c]; i > chunk_starts[c - 1]; --i) {
+            const Piece& piece = pieces[i - 1];
+            if (n_context + piece.n_tokens > chunk_overlap_tokens) {
+                if (context.empty()) {
+                    // Roughly four characters per token
+                    size_t keep = static_cast<size_t>(chunk_overlap_tokens) * 4;
+                    size_t from = piece.text.size() > keep ? piece.text.find(' ', piece.text.size() - keep) : 0;
+                    context = from == std::string::npos ? "" : trim_whitespace(piece.text.substr(from));
+                }
+                break;
+            }
+            context = context.empty() ? piece.text : piece.text + " " + context;
+            n_context += piece.n_tokens;
+        }
+        chunks[c].context = context;
+    }
+    return chunks;
 }
 
-bool LLMProcessor::is_busy() const {
-    return is_processing.load();
+std::string LLMProcessor::create_chunk_prompt(const TranscriptChunk& chunk) {
+    if (chunk.context.empty()) {
+        return create_cleanup_prompt(chunk.text);
+    }
+    
+    std::stringstream prompt;
+    prompt << "(Continuing after: \"" << chunk.context << "\")\n\n";
+    prompt << chunk.text << "\n\n";
+    prompt << "Provide only the cleaned-up text that follows the part in parentheses, without any explanations or commentary.";
+    
+    return prompt.str();
 }
 
-void LLMProcessor::cancel_processing() {
-    is_processing = false;
-    if (processing_thread.joinable()) {
-        processing_thread.join();
+void LLMProcessor::chunk_finished(const std::shared_ptr<ChunkedJob>& chunked, size_t index, const Job& chunk, const LLMResult& result) {
+    LLMResult done;
+    {
+        std::lock_guard<std::mutex> lock(chunked->mutex);
+        chunked->results[index] = result;
+        chunked->n_prompt += static_cast<int>(chunk.prompt_tokens.size());
+        chunked->n_reused += chunk.reused_tokens;
+        chunked->n_generated += chunk.generated_tokens;
+        
+        // Text is passed on in transcript order, as far as it is complete
+        const auto& on_token = chunked->parent->options.on_token;
+        while (chunked->n_joined < chunked->results.size() &&
+               chunked->results[chunked->n_joined] &&
+               chunked->results[chunked->n_joined]->status == LLMResult::Status::OK) {
+            size_t i = chunked->n_joined++;
+            std::string piece = join_chunk(chunked->text, chunked->results[i]->text, chunked->chunks[i].paragraph_start);
+            if (piece.empty()) {
+                continue;
+            }
+            if (chunked->first_piece_ms < 0.0) {
+                chunked->first_piece_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - chunked->start).count();
+            }
+            if (on_token) {
+                on_token(piece);
+            }
+        }
+        
+        if (++chunked->n_finished < chunked->results.size()) {
+            return;
+        }
+        
+        // The first chunk that did not complete decides the outcome; the
+        // text is what came before it
+        done.status = LLMResult::Status::OK;
+        for (const auto& chunk_result : chunked->results) {
+            if (chunk_result->status != LLMResult::Status::OK) {
+                done.status = chunk_result->status;
+                break;
+            }
+        }
+        done.text = chunked->text;
+        
+        // Statistics describe the request rather than its last chunk. Only
+        // a request that ran to the end on the worker records them.
+        if (done.status == LLMResult::Status::OK) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - chunked->start).count();
+            last_first_token_ms = std::max(0.0, chunked->first_piece_ms);
+            last_generated_tokens = chunked->n_generated;
+            last_tokens_per_second = seconds > 0.0 ? chunked->n_generated / seconds : 0.0;
+            last_prefill_ms = 0.0;
+            last_prompt_tokens = chunked->n_prompt - chunked->n_reused;
+            last_reused_tokens = chunked->n_reused;
+        }
+    }
+    end_job(chunked->parent, std::move(done));
+}
+
+// Words of text, lowercased and without punctuation, with the offset just
+// past each one
+static std::vector<std::pair<std::string, size_t>> comparable_words(const std::string& text) {
+    std::vector<std::pair<std::string, size_t>> words;
+    std::string word;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (std::isspace(c)) {
+            if (!word.empty()) {
+                words.emplace_back(word, i);
+                word.clear();
+            }
+        } else if (std::isalnum(c) || c >= 0x80) {
+            word += static_cast<char>(std::tolower(c));
+        }
     }
+    return words;
 }
 
-void LLMProcessor::processing_worker(const std::string& text) {
-    std::string result = clean_up_text(text);
-    is_processing = false;
+std::string LLMProcessor::join_chunk(std::string& text, const std::string& chunk, bool paragraph_start) {
+    // The model may still repeat the context it was given: the longest run
+    // of three or more words that both ends text and starts chunk is dropped
+    const size_t min_repeat = 3;
+    const size_t max_repeat = chunk_overlap_tokens;   // A word is at least one token
+    const size_t window = 1024;
     
-    if (completion_callback) {
-        completion_callback(result);
+    auto tail = comparable_words(text.size() > window ? text.substr(text.size() - window) : text);
+    auto head = comparable_words(chunk.substr(0, window));
+    size_t skip = 0;
+    for (size_t n = std::min({max_repeat, tail.size(), head.size()}); n >= min_repeat; --n) {
+        if (std::equal(head.begin(), head.begin() + n, tail.end() - n,
+                       [](const auto& a, const auto& b) { return a.first == b.first; })) {
+            skip = head[n - 1].second;
+            break;
+        }
+    }
+    
+    std::string rest = trim_whitespace(chunk.substr(skip));
+    if (rest.empty()) {
+        return "";
     }
+    std::string piece = text.empty() ? rest : (paragraph_start ? "\n\n" : " ") + rest;
+    text += piece;
+    return piece;
 }
 
-std::string LLMProcessor::clean_up_text(const std::string& raw_text) {
-    if (!is_initialized || raw_text.empty()) {
-        return raw_text;
+static bool kv_type_from_name(const std::string& name, ggml_type& type) {
+    static const std::pair<const char*, ggml_type> types[] = {
+        {"f16", GGML_TYPE_F16},
+        {"q8_0", GGML_TYPE_Q8_0},
+        {"q5_0", GGML_TYPE_Q5_0},
+        {"q4_0", GGML_TYPE_Q4_0},
+    };
+    for (const auto& entry : types) {
+        if (name == entry.first) {
+            type = entry.second;
+            return true;
+        }
     }
+    return false;
+}
+
+bool LLMProcessor::set_kv_cache_type(const std::string& type) {
+    ggml_type parsed;
+    if (!kv_type_from_name(type, parsed)) {
+        std::cerr << "Unknown KV cache type: " << type << " (use f16, q8_0, q5_0 or q4_0)" << std::endl;
+        return false;
+    }
+    kv_cache_type = type;
+    return true;
+}
+
+// An integer from the model's GGUF metadata, or fallback if it is missing
+static int64_t model_meta_int(const llama_model* model, const std::string& key, int64_t fallback) {
+    char buf[64];
+    if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) <= 0) {
+        return fallback;
+    }
+    int64_t value = std::atoll(buf);
+    return value > 0 ? value : fallback;
+}
+
+double LLMProcessor::kv_bytes_per_token() const {
+    ggml_type type = GGML_TYPE_F16;
+    kv_type_from_name(kv_cache_type, type);
+    
+    // Heads can be narrower than n_embd / n_head; the GGUF records their width
+    char arch[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+    int64_t head_dim = llama_model_n_embd(model) / std::max(1, llama_model_n_head(model));
+    int64_t key_length = model_meta_int(model, std::string(arch) + ".attention.key_length", head_dim);
+    int64_t value_length = model_meta_int(model, std::string(arch) + ".attention.value_length", head_dim);
     
-    std::string prompt = create_cleanup_prompt(raw_text);
-    return generate_response(prompt);
+    double bytes_per_value = static_cast<double>(ggml_type_size(type)) / ggml_blck_size(type);
+    return static_cast<double>(llama_model_n_layer(model)) * llama_model_n_head_kv(model) *
+           (key_length + value_length) * bytes_per_value;
 }
 
-std::string LLMProcessor::create_cleanup_prompt(const std::string& raw_text) {
+bool LLMProcessor::size_context(llama_context_params& params) {
+    int n_prefix = static_cast<int>(tokenize(create_cleanup_prefix(), true).size());
+    
+    // Cells a request of n transcript tokens takes: its prompt, with the
+    // context and wording of a chunk, and a response a little longer
+    TranscriptChunk wrapper;
+    wrapper.context = "...";
+    int n_wrapper = static_cast<int>(tokenize(create_chunk_prompt(wrapper), false).size());
+    auto sequence_cells = [&](int n_text) {
+        int n_prompt = n_text + chunk_overlap_tokens + n_wrapper;
+        return n_prompt + std::min(max_response_tokens, n_prompt + 32);
+    };
+    
+    // Room for the expected transcript, or as many of its chunks as decode
+    // at once, and for every parallel request
+    int n_ctx = context_tokens;
+    if (n_ctx == 0) {
+        int at_once = (expected_transcript_tokens + chunk_tokens - 1) / chunk_tokens;
+        at_once = std::max(n_parallel, std::min(at_once, chunk_sequences));
+        n_ctx = n_prefix + at_once * sequence_cells(std::min(expected_transcript_tokens, chunk_tokens));
+        n_ctx = (n_ctx + 255) / 256 * 256;
+    }
+    if (llama_model_n_ctx_train(model) > 0) {
+        n_ctx = std::min(n_ctx, llama_model_n_ctx_train(model));
+    }
+    
+    double per_token = kv_bytes_per_token();
+    if (kv_budget_mb > 0) {
+        int affordable = static_cast<int>(kv_budget_mb * 1024.0 * 1024.0 / per_token) / 256 * 256;
+        n_ctx = std::min(n_ctx, affordable);
+    }
+    
+    // Longer transcripts are chunked, small enough for a chunk to fit
+    int fitting = chunk_tokens;
+    while (fitting > 128 && n_prefix + sequence_cells(fitting) > n_ctx) {
+        fitting = std::max(128, fitting - 16);
+    }
+    if (n_prefix + sequence_cells(fitting) > n_ctx) {
+        std::cerr << "An LLM context of " << n_ctx << " tokens is too small for cleanup; at least "
+                  << n_prefix + sequence_cells(fitting) << " are needed" << std::endl;
+        return false;
+    }
+    if (fitting < chunk_tokens) {
+        std::cout << "Transcripts over " << fitting << " tokens are cleaned up in chunks to fit the context" << std::endl;
+        chunk_tokens = fitting;
+    }
+    
+    ggml_type type = GGML_TYPE_F16;
+    kv_type_from_name(kv_cache_type, type);
+    params.n_ctx = n_ctx;
+    params.type_k = type;
+    params.type_v = type;
+    
+    // A quantized V cache requires flash attention; otherwise the backend
+    // uses it where supported
+    params.flash_attn_type = type == GGML_TYPE_F16 ? LLAMA_FLASH_ATTN_TYPE_AUTO : LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    
+    kv_cache_tokens = n_ctx;
+    kv_cache_bytes = static_cast<size_t>(per_token * n_ctx);
+    return true;
+}
+
+std::string LLMProcessor::create_cleanup_prefix() {
     std::stringstream prompt;
     prompt << "You are a text cleaning assistant. Your task is to improve spoken transcriptions by:\n";
     prompt << "1. Removing repetitions and filler words (um, uh, like, you know, etc.)\n";
@@ -191,41 +889,386 @@ std::string LLMProcessor::create_cleanup_prompt(const std::string& raw_text) {
     prompt << "4. Preserving the original meaning and key points\n";
     prompt << "5. Organizing rambling thoughts into clear, structured sentences\n\n";
     prompt << "Please clean up the following transcribed text:\n\n";
+    
+    return prompt.str();
+}
+
+std::string LLMProcessor::create_cleanup_prompt(const std::string& raw_text) {
+    std::stringstream prompt;
     prompt << raw_text << "\n\n";
     prompt << "Provide only the cleaned-up text without any explanations or commentary.";
     
     return prompt.str();
 }
 
-std::string LLMProcessor::generate_response(const std::string& prompt) {
-    if (!ctx || !model) {
-        return "";
-    }
-    
-    // Get vocab from model
+std::vector<int32_t> LLMProcessor::tokenize(const std::string& text, bool add_special) {
     const llama_vocab * vocab = llama_model_get_vocab(model);
     
-    // Tokenize the prompt
-    std::vector<llama_token> tokens;
-    tokens.resize(prompt.length() * 2);  // Estimate
-    
-    int n_tokens = llama_tokenize(
-        vocab,
-        prompt.c_str(),
-        prompt.length(),
-        tokens.data(),
-        tokens.size(),
-        true,  // add_bos
-        false  // special
-    );
+    std::vector<llama_token> tokens(text.length() + 2);
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), add_special, false);
+    if (n_tokens < 0) {
+        // Buffer too small: the negated count is the size needed
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), add_special, false);
+    }
     
     if (n_tokens < 0) {
         std::cerr << "Failed to tokenize prompt" << std::endl;
+        return {};
+    }
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+bool LLMProcessor::decode_tokens(std::vector<int32_t>& tokens) {
+    // A single llama_decode() takes at most n_batch tokens
+    int n_batch = static_cast<int>(llama_n_batch(ctx));
+    for (size_t i = 0; i < tokens.size(); i += n_batch) {
+        int n = std::min(n_batch, static_cast<int>(tokens.size() - i));
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string LLMProcessor::prefix_cache_path() const {
+    if (prefix_cache_dir.empty()) {
         return "";
     }
     
-    tokens.resize(n_tokens);
+    // Keyed on everything that shapes the cached state
+    std::stringstream key;
+    key << model_path << '\n' << llama_model_size(model) << '\n' << llama_n_ctx(ctx) << '\n' << llama_n_seq_max(ctx)
+        << '\n' << kv_cache_type << '\n' << create_cleanup_prefix();
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(model_path, error);
+    if (!error) {
+        key << '\n' << modified.time_since_epoch().count();
+    }
+    
+    std::string stem = model_path.substr(model_path.find_last_of("/\\") + 1);
+    stem = stem.substr(0, stem.find_last_of('.'));
+    std::stringstream path;
+    path << prefix_cache_dir << '/' << stem << '-' << std::hex << std::setw(16) << std::setfill('0')
+         << std::hash<std::string>{}(key.str()) << ".session";
+    return path.str();
+}
+
+bool LLMProcessor::prepare_prefix() {
+    prefix_tokens = tokenize(create_cleanup_prefix(), true);
+    if (prefix_tokens.empty()) {
+        return false;
+    }
+    
+    llama_memory_t mem = llama_get_memory(ctx);
+    std::string path = prefix_cache_path();
+    
+    // A state saved by an earlier run makes startup instant
+    if (!path.empty() && std::filesystem::exists(path)) {
+        std::vector<llama_token> loaded(prefix_tokens.size() + 1);
+        size_t n_loaded = 0;
+        if (llama_state_load_file(ctx, path.c_str(), loaded.data(), loaded.size(), &n_loaded) &&
+            n_loaded == prefix_tokens.size() &&
+            std::equal(prefix_tokens.begin(), prefix_tokens.end(), loaded.begin()) &&
+            llama_memory_seq_pos_max(mem, 0) + 1 == static_cast<llama_pos>(prefix_tokens.size())) {
+            prefix_from_disk = true;
+            std::cout << "Loaded " << prefix_tokens.size() << "-token cleanup instructions from " << path << std::endl;
+            return true;
+        }
+        llama_memory_clear(mem, true);
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int32_t> tokens = prefix_tokens;
+    if (!decode_tokens(tokens)) {
+        return false;
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Decoded " << prefix_tokens.size() << "-token cleanup instructions in "
+              << static_cast<int>(elapsed_ms) << " ms" << std::endl;
+    
+    if (!path.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(prefix_cache_dir, error);
+        if (error || !llama_state_save_file(ctx, path.c_str(), prefix_tokens.data(), prefix_tokens.size())) {
+            std::cerr << "Could not save cleanup instructions to " << path << std::endl;
+        }
+    }
+    return true;
+}
+
+int LLMProcessor::reuse_cached_tokens(const std::vector<int32_t>& tokens, size_t max_keep) {
+    size_t n_keep = 0;
+    size_t limit = std::min({cached_tokens.size(), tokens.size(), max_keep});
+    while (n_keep < limit && cached_tokens[n_keep] == tokens[n_keep]) {
+        ++n_keep;
+    }
+    
+    // The prefix stays in the cache; only what differs is removed
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(prefix_tokens.size() + n_keep), -1)) {
+        cached_tokens.resize(n_keep);
+        return static_cast<int>(n_keep);
+    }
     
+    // Caches that cannot be cut part-way (recurrent models) start over
+    llama_memory_clear(mem, true);
+    cached_tokens.clear();
+    prefilled_chunks.clear();
+    std::vector<int32_t> prefix = prefix_tokens;
+    return decode_tokens(prefix) ? 0 : -1;
+}
+
+static void add_to_batch(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq = 0, bool logits = true) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+size_t LLMProcessor::lookup_draft(const std::vector<int32_t>& source, const std::vector<int32_t>& generated,
+                                  size_t max_draft, size_t& cursor, std::vector<int32_t>& draft) {
+    // Longest n-grams first: a longer match is a better predictor
+    for (size_t n = std::min(lookup_ngram_max, generated.size()); n >= 1; --n) {
+        auto tail = generated.end() - n;
+        
+        // Text is copied in order, so a match at or after the previous draft
+        // wins over an earlier one
+        size_t match = std::string::npos;
+        for (size_t i = 0; i + n < source.size(); ++i) {
+            if (std::equal(tail, generated.end(), source.begin() + i)) {
+                if (match == std::string::npos || match < cursor) {
+                    match = i;
+                }
+                if (i >= cursor) {
+                    break;
+                }
+            }
+        }
+        
+        if (match != std::string::npos) {
+            size_t start = match + n;
+            size_t count = std::min(max_draft, source.size() - start);
+            draft.assign(source.begin() + start, source.begin() + start + count);
+            cursor = start;
+            return count;
+        }
+    }
+    return 0;
+}
+
+bool LLMProcessor::vocabs_compatible(const llama_model* target, const llama_model* draft) {
+    const llama_vocab* vocab_target = llama_model_get_vocab(target);
+    const llama_vocab* vocab_draft = llama_model_get_vocab(draft);
+    
+    if (llama_vocab_type(vocab_target) != llama_vocab_type(vocab_draft) ||
+        llama_vocab_get_add_bos(vocab_target) != llama_vocab_get_add_bos(vocab_draft) ||
+        llama_vocab_bos(vocab_target) != llama_vocab_bos(vocab_draft) ||
+        llama_vocab_eos(vocab_target) != llama_vocab_eos(vocab_draft)) {
+        return false;
+    }
+    
+    // Sizes may differ by a few added tokens; shared ids must mean the same text
+    int n_target = llama_vocab_n_tokens(vocab_target);
+    int n_draft = llama_vocab_n_tokens(vocab_draft);
+    if (std::abs(n_target - n_draft) > 128) {
+        return false;
+    }
+    for (int id = 0; id < std::min(n_target, n_draft); ++id) {
+        if (std::strcmp(llama_vocab_get_text(vocab_target, id), llama_vocab_get_text(vocab_draft, id)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LLMProcessor::load_draft_model() {
+    std::ifstream file(draft_model_path);
+    if (!file.good()) {
+        std::cerr << "Draft model file not found: " << draft_model_path << std::endl;
+        return false;
+    }
+    
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = -1;
+    model_params.use_mmap = true;
+    draft_model = llama_model_load_from_file(draft_model_path.c_str(), model_params);
+    if (!draft_model) {
+        std::cerr << "Failed to load draft model: " << draft_model_path << std::endl;
+        return false;
+    }
+    
+    if (!vocabs_compatible(model, draft_model)) {
+        std::cerr << "Draft model vocabulary does not match " << model_path << std::endl;
+        free_draft_model();
+        return false;
+    }
+    
+    // Same window as the main context, so any prompt it holds fits
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = llama_n_ctx(ctx);
+    ctx_params.n_batch = llama_n_batch(ctx);
+    ctx_params.n_threads = 8;
+    ctx_params.n_threads_batch = 8;
+    draft_ctx = llama_init_from_model(draft_model, ctx_params);
+    if (!draft_ctx) {
+        std::cerr << "Failed to create draft model context" << std::endl;
+        free_draft_model();
+        return false;
+    }
+    llama_set_abort_callback(draft_ctx, abort_callback, this);
+    draft_sampler = llama_sampler_init_greedy();
+    
+    // The instructions are the start of every request
+    if (!sync_draft(prefix_tokens)) {
+        std::cerr << "Failed to decode the cleanup instructions with the draft model" << std::endl;
+        free_draft_model();
+        return false;
+    }
+    
+    std::cout << "Draft model loaded: " << draft_model_path << std::endl;
+    return true;
+}
+
+void LLMProcessor::free_draft_model() {
+    if (draft_sampler) {
+        llama_sampler_free(draft_sampler);
+        draft_sampler = nullptr;
+    }
+    if (draft_ctx) {
+        llama_free(draft_ctx);
+        draft_ctx = nullptr;
+    }
+    if (draft_model) {
+        llama_model_free(draft_model);
+        draft_model = nullptr;
+    }
+    draft_tokens.clear();
+}
+
+bool LLMProcessor::sync_draft(const std::vector<int32_t>& history) {
+    if (history.empty()) {
+        return false;
+    }
+    
+    // The last token is decoded again when nothing else is, for its logits
+    size_t n_keep = 0;
+    size_t limit = std::min(draft_tokens.size(), history.size() - 1);
+    while (n_keep < limit && draft_tokens[n_keep] == history[n_keep]) {
+        ++n_keep;
+    }
+    
+    llama_memory_t mem = llama_get_memory(draft_ctx);
+    if (!llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(n_keep), -1)) {
+        llama_memory_clear(mem, true);
+        n_keep = 0;
+    }
+    draft_tokens.resize(n_keep);
+    
+    std::vector<int32_t> remaining(history.begin() + n_keep, history.end());
+    int n_batch = static_cast<int>(llama_n_batch(draft_ctx));
+    for (size_t i = 0; i < remaining.size(); i += n_batch) {
+        int n = std::min(n_batch, static_cast<int>(remaining.size() - i));
+        if (llama_decode(draft_ctx, llama_batch_get_one(remaining.data() + i, n)) != 0) {
+            llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(draft_tokens.size()), -1);
+            return false;
+        }
+        draft_tokens.insert(draft_tokens.end(), remaining.begin() + i, remaining.begin() + i + n);
+    }
+    return true;
+}
+
+void LLMProcessor::draft_from_model(const std::vector<int32_t>& history, size_t max_draft, std::vector<int32_t>& draft) {
+    draft.clear();
+    if (!sync_draft(history)) {
+        return;
+    }
+    
+    const llama_vocab* vocab = llama_model_get_vocab(draft_model);
+    llama_memory_t mem = llama_get_memory(draft_ctx);
+    while (draft.size() < max_draft) {
+        llama_token token = llama_sampler_sample(draft_sampler, draft_ctx, -1);
+        if (llama_vocab_is_eog(vocab, token)) {
+            break;
+        }
+        draft.push_back(token);
+        if (draft.size() == max_draft) {
+            break;
+        }
+        
+        if (llama_decode(draft_ctx, llama_batch_get_one(&draft.back(), 1)) != 0) {
+            llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(draft_tokens.size()), -1);
+            break;
+        }
+        draft_tokens.push_back(token);
+    }
+}
+
+// Length of the longest prefix of text that does not end inside a UTF-8
+// character; a token may carry only part of one
+static size_t complete_utf8_length(const std::string& text) {
+    size_t n = text.size();
+    size_t i = n;
+    // Walk back over at most three continuation bytes to the lead byte
+    while (i > 0 && n - i < 4 && (static_cast<unsigned char>(text[i - 1]) & 0xC0) == 0x80) {
+        --i;
+    }
+    if (i == 0) {
+        return n;
+    }
+    
+    unsigned char lead = static_cast<unsigned char>(text[i - 1]);
+    size_t expected = 1;
+    if ((lead & 0xE0) == 0xC0) {
+        expected = 2;
+    } else if ((lead & 0xF0) == 0xE0) {
+        expected = 3;
+    } else if ((lead & 0xF8) == 0xF0) {
+        expected = 4;
+    }
+    return (n - (i - 1) >= expected) ? n : i - 1;
+}
+
+void LLMProcessor::ResponseStream::append(const char* piece, int length) {
+    if (length > 0) {
+        text.append(piece, length);
+    }
+    n_tokens++;
+    if (n_tokens == 1) {
+        first_token = std::chrono::steady_clock::now();
+    }
+    if (!on_token) {
+        return;
+    }
+    
+    if (!streaming_started) {
+        n_streamed = std::min(text.size(), text.find_first_not_of(" \t\n\r"));
+    }
+    size_t end = complete_utf8_length(text);
+    size_t content_end = text.find_last_not_of(" \t\n\r", end == 0 ? 0 : end - 1);
+    end = (content_end == std::string::npos || content_end < n_streamed) ? n_streamed : std::min(end, content_end + 1);
+    if (end > n_streamed) {
+        if (!streaming_started) {
+            first_piece_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            streaming_started = true;
+        }
+        on_token(text.substr(n_streamed, end - n_streamed));
+        n_streamed = end;
+    }
+}
+
+std::string LLMProcessor::ResponseStream::trimmed() const {
+    // Remove any leading/trailing whitespace
+    std::string response = text;
+    response.erase(0, response.find_first_not_of(" \t\n\r"));
+    response.erase(response.find_last_not_of(" \t\n\r") + 1);
+    return response;
+}
+
+llama_sampler* LLMProcessor::create_sampler() {
     // Initialize sampler with temperature and other parameters
     auto sparams = llama_sampler_chain_default_params();
     sparams.no_perf = false;
@@ -236,62 +1279,514 @@ std::string LLMProcessor::generate_response(const std::string& prompt) {
     llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.8f, 1));
     llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.3f));
     llama_sampler_chain_add(smpl, llama_sampler_init_dist(1234));  // seed
+    return smpl;
+}
+
+bool LLMProcessor::append_token(ResponseStream& stream, int32_t token) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    if (llama_vocab_is_eog(vocab, token)) {
+        return false;
+    }
     
-    // Clear the KV cache (not needed with new API - fresh context)
-    // llama_kv_cache_clear(ctx);
+    // Convert token to string
+    char buf[256];
+    int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+    stream.append(buf, n);
+    return true;
+}
+
+void LLMProcessor::record_generation(const ResponseStream& stream) {
+    // Without streaming, the first token is when text could first have been shown
+    last_generated_tokens = stream.n_tokens;
+    last_first_token_ms = 0.0;
+    last_tokens_per_second = 0.0;
+    if (stream.n_tokens == 0) {
+        return;
+    }
+    last_first_token_ms = stream.streaming_started
+        ? stream.first_piece_ms
+        : std::chrono::duration<double, std::milli>(stream.first_token - stream.start).count();
+    double generation_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stream.first_token).count();
+    if (stream.n_tokens > 1 && generation_seconds > 0.0) {
+        last_tokens_per_second = (stream.n_tokens - 1) / generation_seconds;
+    }
+}
+
+LLMResult LLMProcessor::generate_response(const std::string& prompt, const Job& job) {
+    LLMResult result;
+    if (!ctx || !model) {
+        return result;
+    }
     
-    // Process the prompt
-    llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+    auto request_start = std::chrono::steady_clock::now();
+    last_drafted_tokens = 0;
+    last_accepted_tokens = 0;
+    last_decode_calls = 0;
+    last_model_drafted_tokens = 0;
+    last_model_accepted_tokens = 0;
+    
+    // Only the request itself is tokenized
+    std::vector<llama_token> tokens = tokenize(prompt, false);
+    if (tokens.empty()) {
+        return result;
+    }
     
-    // Decode prompt
-    if (llama_decode(ctx, batch) != 0) {
-        std::cerr << "Failed to decode prompt" << std::endl;
+    int n_ctx = static_cast<int>(llama_n_ctx(ctx));
+    int n_past = static_cast<int>(prefix_tokens.size() + tokens.size());
+    if (n_past >= n_ctx) {
+        std::cerr << "Transcript too long for the LLM context (" << n_past << " of " << n_ctx << " tokens)" << std::endl;
+        return result;
+    }
+    
+    // Whatever was prefilled is kept; the last token is always decoded
+    // again, since its logits are needed to start generating
+    int n_keep = reuse_cached_tokens(tokens, tokens.size() - 1);
+    if (n_keep < 0) {
+        std::cerr << "Failed to restore the cleanup instructions" << std::endl;
+        return result;
+    }
+    std::vector<llama_token> remaining(tokens.begin() + n_keep, tokens.end());
+    
+    llama_sampler * smpl = create_sampler();
+    
+    // Process the prompt
+    auto prefill_start = std::chrono::steady_clock::now();
+    if (!decode_tokens(remaining)) {
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, static_cast<llama_pos>(prefix_tokens.size() + n_keep), -1);
         llama_sampler_free(smpl);
-        return "";
+        if (job.cancelled() || job.expired()) {
+            result.status = stop_status(job);
+        } else {
+            std::cerr << "Failed to decode prompt" << std::endl;
+        }
+        return result;
     }
+    cached_tokens = tokens;
+    last_prefill_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - prefill_start).count();
+    last_prompt_tokens = static_cast<int>(remaining.size());
+    last_reused_tokens = n_keep;
     
     // Generate response
-    std::string response;
-    const int max_tokens = 1024;  // Maximum tokens to generate
-    int n_decode = 0;
+    ResponseStream stream(job.options.on_token, request_start);
+    result.status = LLMResult::Status::OK;
+    
+    // Adds a sampled token to the response; false once generation is over
+    auto emit = [&](llama_token token) {
+        return append_token(stream, token) && stream.n_tokens < max_response_tokens;
+    };
     
-    while (n_decode < max_tokens) {
-        // Sample next token
-        llama_token new_token = llama_sampler_sample(smpl, ctx, -1);
+    // Each step decodes the sampled token together with a draft looked up
+    // in the prompt, then samples every drafted position as usual. A draft
+    // token is kept only while it equals what was sampled, so the output is
+    // the same as decoding one token at a time; agreeing drafts just cost
+    // no extra llama_decode() call.
+    std::vector<llama_token> generated;
+    std::vector<llama_token> draft;
+    size_t lookup_cursor = 0;
+    int draft_limit = lookup_draft_max;   // Halved on a miss, doubled on a full match
+    int model_draft_limit = draft_model_max;
+    std::vector<int32_t> history;
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_batch batch = llama_batch_init(std::max({lookup_draft_max, draft_ctx ? draft_model_max : 0, 0}) + 1, 0, 1);
+    
+    llama_token new_token = llama_sampler_sample(smpl, ctx, -1);
+    while (emit(new_token)) {
+        if (job.cancelled() || job.expired()) {
+            result.status = stop_status(job);
+            break;
+        }
+        generated.push_back(new_token);
         
-        // Check for end of sequence
-        if (new_token == llama_vocab_eos(vocab)) {
+        int n_cur = static_cast<int>(prefix_tokens.size() + cached_tokens.size());
+        if (n_cur >= n_ctx) {
             break;
         }
+        int room = std::min({draft_limit, n_ctx - n_cur - 1, max_response_tokens - stream.n_tokens});
+        draft.clear();
+        if (room > 0) {
+            lookup_draft(tokens, generated, static_cast<size_t>(room), lookup_cursor, draft);
+        }
         
-        // Convert token to string
-        char buf[256];
-        int n = llama_token_to_piece(vocab, new_token, buf, sizeof(buf), 0, true);
-        if (n > 0) {
-            response.append(buf, n);
+        // Where the transcript has no continuation, the draft model guesses one
+        bool from_model = false;
+        int model_room = std::min({model_draft_limit, n_ctx - n_cur - 1, max_response_tokens - stream.n_tokens});
+        if (draft.empty() && draft_ctx && model_room > 0) {
+            history.assign(prefix_tokens.begin(), prefix_tokens.end());
+            history.insert(history.end(), cached_tokens.begin(), cached_tokens.end());
+            history.push_back(new_token);
+            draft_from_model(history, static_cast<size_t>(model_room), draft);
+            from_model = !draft.empty();
         }
         
-        // Prepare next batch
-        batch = llama_batch_get_one(&new_token, 1);
+        batch.n_tokens = 0;
+        add_to_batch(batch, new_token, n_cur);
+        for (size_t i = 0; i < draft.size(); ++i) {
+            add_to_batch(batch, draft[i], n_cur + 1 + static_cast<int>(i));
+        }
         
         // Decode
         if (llama_decode(ctx, batch) != 0) {
-            std::cerr << "Failed to decode during generation" << std::endl;
+            if (job.cancelled() || job.expired()) {
+                result.status = stop_status(job);
+            } else {
+                std::cerr << "Failed to decode during generation" << std::endl;
+                result.status = LLMResult::Status::FAILED;
+            }
+            llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(prefix_tokens.size() + cached_tokens.size()), -1);
             break;
         }
+        cached_tokens.push_back(new_token);
+        last_decode_calls++;
         
-        n_decode++;
+        size_t accepted = 0;
+        bool finished = false;
+        new_token = llama_sampler_sample(smpl, ctx, 0);
+        while (accepted < draft.size() && new_token == draft[accepted]) {
+            if (!emit(new_token)) {
+                finished = true;
+                break;
+            }
+            generated.push_back(new_token);
+            cached_tokens.push_back(new_token);
+            ++accepted;
+            new_token = llama_sampler_sample(smpl, ctx, static_cast<int32_t>(accepted));
+        }
+        last_drafted_tokens += static_cast<int>(draft.size());
+        last_accepted_tokens += static_cast<int>(accepted);
+        if (from_model) {
+            last_model_drafted_tokens += static_cast<int>(draft.size());
+            last_model_accepted_tokens += static_cast<int>(accepted);
+            model_draft_limit = (accepted == draft.size()) ? std::min(draft_model_max, model_draft_limit * 2)
+                              : (accepted == 0) ? std::max(1, model_draft_limit / 2) : model_draft_limit;
+        } else if (!draft.empty()) {
+            draft_limit = (accepted == draft.size()) ? std::min(lookup_draft_max, draft_limit * 2)
+                        : (accepted == 0) ? std::max(1, draft_limit / 2) : draft_limit;
+        }
+        
+        // Rejected draft positions leave the cache
+        if (accepted < draft.size()) {
+            llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(prefix_tokens.size() + cached_tokens.size()), -1);
+        }
+        if (finished) {
+            break;
+        }
     }
+    llama_batch_free(batch);
+    record_generation(stream);
     
     // Cleanup
     llama_sampler_free(smpl);
     
-    // Clean up the response
-    // Remove any leading/trailing whitespace
-    response.erase(0, response.find_first_not_of(" \t\n\r"));
-    response.erase(response.find_last_not_of(" \t\n\r") + 1);
+    result.text = stream.trimmed();
+    return result;
+}
+
+void LLMProcessor::prefill_chunks(const std::string& text) {
+    // Sequence 0 keeps only the instructions, as it does for the batch
+    if (reuse_cached_tokens({}, 0) < 0) {
+        return;
+    }
     
-    return response;
+    // The last chunk may still grow; the ones before it are cut as they
+    // will be once the transcript is final
+    std::vector<TranscriptChunk> chunks = split_transcript(text);
+    prefilled_chunks.resize(n_sequences);
+    
+    llama_memory_t mem = llama_get_memory(ctx);
+    int n_ctx = static_cast<int>(llama_n_ctx(ctx));
+    size_t n_batch = llama_n_batch(ctx);
+    size_t n_prefix = prefix_tokens.size();
+    int cells_used = static_cast<int>(n_prefix);
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(n_batch), 0, 1);
+    bool failed = false;
+    for (size_t i = 0; i + 1 < chunks.size() && i < prefilled_chunks.size() && !failed && jobs_waiting.load() == 0; ++i) {
+        std::vector<int32_t> prompt = tokenize(create_chunk_prompt(chunks[i]), false);
+        
+        // Only chunks that join the first batch, in the cells it will set aside
+        int n_prompt = static_cast<int>(prompt.size());
+        cells_used += n_prompt + std::min(max_response_tokens, n_prompt + 32);
+        if (n_prompt < 2 || cells_used > n_ctx) {
+            break;
+        }
+        prompt.pop_back();
+        
+        std::vector<int32_t>& cached = prefilled_chunks[i];
+        llama_seq_id seq = static_cast<llama_seq_id>(i + 1);
+        size_t n_keep = 0;
+        size_t limit = std::min(cached.size(), prompt.size());
+        while (n_keep < limit && cached[n_keep] == prompt[n_keep]) {
+            ++n_keep;
+        }
+        if (n_keep == 0 || !llama_memory_seq_rm(mem, seq, static_cast<llama_pos>(n_prefix + n_keep), -1)) {
+            llama_memory_seq_rm(mem, seq, -1, -1);
+            llama_memory_seq_cp(mem, 0, seq, 0, static_cast<llama_pos>(n_prefix));
+            n_keep = 0;
+        }
+        cached.resize(n_keep);
+        
+        // One batch at a time, so a new request gets the context soon
+        for (size_t j = n_keep; j < prompt.size() && jobs_waiting.load() == 0; j += n_batch) {
+            size_t n = std::min(n_batch, prompt.size() - j);
+            batch.n_tokens = 0;
+            for (size_t k = j; k < j + n; ++k) {
+                add_to_batch(batch, prompt[k], static_cast<llama_pos>(n_prefix + k), seq, false);
+            }
+            if (llama_decode(ctx, batch) != 0) {
+                llama_memory_seq_rm(mem, seq, static_cast<llama_pos>(n_prefix + cached.size()), -1);
+                failed = true;
+                break;
+            }
+            cached.insert(cached.end(), prompt.begin() + j, prompt.begin() + j + n);
+        }
+    }
+    llama_batch_free(batch);
+}
+
+int LLMProcessor::drop_prefilled_chunks() {
+    llama_memory_t mem = llama_get_memory(ctx);
+    int freed = 0;
+    for (size_t i = 0; i < prefilled_chunks.size(); ++i) {
+        if (!prefilled_chunks[i].empty()) {
+            llama_memory_seq_rm(mem, static_cast<llama_seq_id>(i + 1), -1, -1);
+            freed += static_cast<int>(prefilled_chunks[i].size());
+            prefilled_chunks[i].clear();
+        }
+    }
+    return freed;
+}
+
+void LLMProcessor::run_batched(std::shared_ptr<Job> first) {
+    struct Slot {
+        std::shared_ptr<Job> job;
+        llama_seq_id seq = 0;
+        llama_sampler* sampler = nullptr;
+        std::unique_ptr<ResponseStream> stream;
+        size_t n_prompt_done = 0;
+        llama_pos pos = 0;           // Next position in the sequence
+        llama_token pending = 0;     // Sampled, still to be decoded
+        int max_new = 0;
+        int cells = 0;               // KV cells set aside for the request
+        int batch_index = -1;        // Its logits in the current batch
+    };
+    
+    llama_memory_t mem = llama_get_memory(ctx);
+    int n_ctx = static_cast<int>(llama_n_ctx(ctx));
+    int n_batch = static_cast<int>(llama_n_batch(ctx));
+    int n_prefix = static_cast<int>(prefix_tokens.size());
+    
+    // Sequence 0 keeps only the instructions, which every slot copies;
+    // with a unified cache the copy shares the cells instead of using more
+    reuse_cached_tokens({}, 0);
+    int cells_used = n_prefix;
+    
+    // Chunks prefilled while recording hold their cells until a slot takes them
+    prefilled_chunks.resize(n_sequences);
+    for (const auto& cached : prefilled_chunks) {
+        cells_used += static_cast<int>(cached.size());
+    }
+    
+    // Counters describe this run of the batch; there is no drafting here
+    last_decode_calls = 0;
+    last_drafted_tokens = 0;
+    last_accepted_tokens = 0;
+    last_model_drafted_tokens = 0;
+    last_model_accepted_tokens = 0;
+    
+    std::vector<Slot> slots(n_sequences);
+    for (int i = 0; i < n_sequences; ++i) {
+        slots[i].seq = i + 1;
+    }
+    auto finish_slot = [&](Slot& slot, LLMResult::Status status) {
+        llama_memory_seq_rm(mem, slot.seq, -1, -1);
+        llama_sampler_free(slot.sampler);
+        record_generation(*slot.stream);
+        slot.job->generated_tokens = slot.stream->n_tokens;
+        
+        // Prompts decode with the other sequences, so prefill is not timed apart
+        last_prefill_ms = 0.0;
+        last_prompt_tokens = static_cast<int>(slot.job->prompt_tokens.size()) - slot.job->reused_tokens;
+        last_reused_tokens = slot.job->reused_tokens;
+        
+        LLMResult result;
+        result.status = status;
+        result.text = slot.stream->trimmed();
+        end_job(slot.job, std::move(result));
+        cells_used -= slot.cells;
+        slot.job.reset();
+        slot.stream.reset();
+    };
+    
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::shared_ptr<Job> waiting = std::move(first);
+    
+    while (true) {
+        // Requests join while a slot and enough cells are free. One that does
+        // not fit waits, and keeps later ones waiting, for others to finish.
+        while (true) {
+            if (!waiting) {
+                waiting = next_job();
+            }
+            if (!waiting) {
+                break;
+            }
+            auto free_slot = std::find_if(slots.begin(), slots.end(), [](const Slot& slot) { return !slot.job; });
+            if (free_slot == slots.end()) {
+                break;
+            }
+            
+            if (waiting->cancelled() || waiting->expired()) {
+                LLMResult result;
+                result.status = stop_status(*waiting);
+                end_job(waiting, result);
+                waiting.reset();
+                continue;
+            }
+            if (split_long_job(waiting)) {
+                waiting.reset();
+                continue;
+            }
+            if (waiting->prompt_tokens.empty() && !waiting->raw_text.empty()) {
+                waiting->prompt_tokens = tokenize(create_cleanup_prompt(waiting->raw_text), false);
+            }
+            int n_prompt = static_cast<int>(waiting->prompt_tokens.size());
+            if (n_prompt == 0) {
+                LLMResult result;
+                result.status = waiting->raw_text.empty() ? LLMResult::Status::OK : LLMResult::Status::FAILED;
+                end_job(waiting, result);
+                waiting.reset();
+                continue;
+            }
+            
+            // Room for the prompt and a response somewhat longer than it
+            int max_new = std::min(max_response_tokens, n_prompt + 32);
+            int cells = n_prompt + max_new;
+            if (n_prefix + cells > n_ctx) {
+                std::cerr << "Transcript too long for the LLM context (" << (n_prefix + n_prompt) << " of " << n_ctx << " tokens)" << std::endl;
+                LLMResult result;
+                result.status = LLMResult::Status::FAILED;
+                end_job(waiting, result);
+                waiting.reset();
+                continue;
+            }
+            
+            // A sequence prefilled with the start of the prompt carries on
+            // from there; otherwise a slot with nothing prefilled is taken,
+            // leaving the others for their chunks
+            free_slot = slots.end();
+            size_t reused = 0;
+            for (auto it = slots.begin(); it != slots.end(); ++it) {
+                if (it->job) {
+                    continue;
+                }
+                const auto& cached = prefilled_chunks[it->seq - 1];
+                size_t n = 0;
+                size_t limit = std::min(cached.size(), waiting->prompt_tokens.size() - 1);
+                while (n < limit && cached[n] == waiting->prompt_tokens[n]) {
+                    ++n;
+                }
+                bool better = free_slot == slots.end() || n > reused ||
+                              (n == reused && cached.empty() && !prefilled_chunks[free_slot->seq - 1].empty());
+                if (better) {
+                    free_slot = it;
+                    reused = n;
+                }
+            }
+            int stale = static_cast<int>(prefilled_chunks[free_slot->seq - 1].size());
+            if (cells_used - stale + cells > n_ctx) {
+                // Prefilled chunks no request took give way
+                cells_used -= drop_prefilled_chunks();
+                reused = 0;
+                stale = 0;
+            }
+            if (cells_used - stale + cells > n_ctx) {
+                break;
+            }
+            
+            Slot& slot = *free_slot;
+            if (reused == 0 || !llama_memory_seq_rm(mem, slot.seq, static_cast<llama_pos>(n_prefix + reused), -1)) {
+                llama_memory_seq_rm(mem, slot.seq, -1, -1);
+                llama_memory_seq_cp(mem, 0, slot.seq, 0, n_prefix);
+                reused = 0;
+            }
+            prefilled_chunks[slot.seq - 1].clear();
+            waiting->reused_tokens = static_cast<int>(reused);
+            slot.job = std::move(waiting);
+            slot.sampler = create_sampler();
+            slot.stream = std::make_unique<ResponseStream>(slot.job->options.on_token, std::chrono::steady_clock::now());
+            slot.n_prompt_done = reused;
+            slot.pos = n_prefix + static_cast<llama_pos>(reused);
+            slot.max_new = max_new;
+            slot.cells = cells;
+            cells_used += cells - stale;
+        }
+        
+        bool any_active = std::any_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.job != nullptr; });
+        if (!any_active) {
+            break;
+        }
+        
+        // One batch per step: the next token of every generating request
+        // first, then as much pending prompt as fits
+        batch.n_tokens = 0;
+        for (auto& slot : slots) {
+            slot.batch_index = -1;
+            if (slot.job && slot.n_prompt_done == slot.job->prompt_tokens.size()) {
+                slot.batch_index = batch.n_tokens;
+                add_to_batch(batch, slot.pending, slot.pos++, slot.seq);
+            }
+        }
+        for (auto& slot : slots) {
+            if (!slot.job || slot.batch_index >= 0) {
+                continue;
+            }
+            const auto& prompt = slot.job->prompt_tokens;
+            while (slot.n_prompt_done < prompt.size() && batch.n_tokens < n_batch) {
+                bool last = slot.n_prompt_done + 1 == prompt.size();
+                if (last) {
+                    slot.batch_index = batch.n_tokens;
+                }
+                add_to_batch(batch, prompt[slot.n_prompt_done++], slot.pos++, slot.seq, last);
+            }
+        }
+        
+        if (llama_decode(ctx, batch) != 0) {
+            // Either every request was cancelled or the batch failed as a whole
+            for (auto& slot : slots) {
+                if (slot.job) {
+                    bool stopped = slot.job->cancelled() || slot.job->expired();
+                    if (!stopped) {
+                        std::cerr << "Failed to decode batch" << std::endl;
+                    }
+                    finish_slot(slot, stopped ? stop_status(*slot.job) : LLMResult::Status::FAILED);
+                }
+            }
+            continue;
+        }
+        last_decode_calls++;
+        
+        for (auto& slot : slots) {
+            if (!slot.job) {
+                continue;
+            }
+            if (slot.job->cancelled() || slot.job->expired()) {
+                finish_slot(slot, stop_status(*slot.job));
+                continue;
+            }
+            if (slot.batch_index < 0) {
+                continue;
+            }
+            
+            llama_token token = llama_sampler_sample(slot.sampler, ctx, slot.batch_index);
+            if (!append_token(*slot.stream, token) || slot.stream->n_tokens >= slot.max_new) {
+                finish_slot(slot, LLMResult::Status::OK);
+            } else {
+                slot.pending = token;
+            }
+        }
+    }
+    
+    llama_batch_free(batch);
+    drop_prefilled_chunks();
 }
 
 std::string LLMProcessor::get_model_name() const {
@@ -6,10 +6,57 @@
 #include <functional>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <optional>
 
 // Forward declaration for llama.cpp types
 struct llama_model;
 struct llama_context;
+struct llama_sampler;
+struct llama_context_params;
+
+// Cancels a cleanup request, queued or running; copies share one flag
+class LLMCancelToken {
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+    
+public:
+    void cancel() { flag->store(true); }
+    bool is_cancelled() const { return flag->load(); }
+};
+
+struct LLMResult {
+    enum class Status {
+        OK,
+        CANCELLED,
+        TIMED_OUT,
+        REJECTED,    // Queue full, or the processor shut down first
+        FAILED
+    };
+    
+    Status status = Status::FAILED;
+    std::string text;   // Partial text for cancelled and timed out requests
+};
+
+struct LLMJobOptions {
+    int priority = 0;      // Higher runs first; equal priorities run in order
+    int timeout_ms = 0;    // Counted from submission; 0 waits indefinitely
+    LLMCancelToken cancel;
+    
+    // Receives the response while it is generated, in pieces that never
+    // split a UTF-8 character
+    std::function<void(const std::string&)> on_token;
+    
+    // Receives the result just before the future is ready, on whichever
+    // thread finished the request (usually the worker)
+    std::function<void(const LLMResult&)> on_done;
+};
 
 class LLMProcessor {
 private:
@@ -17,14 +64,159 @@ private:
     llama_context* ctx;
     std::string model_path;
     std::string model_name;
-    bool is_initialized;
-    std::atomic<bool> is_processing;
+    std::atomic<bool> is_initialized;   // Cleared under queue_mutex, so no request is queued once stopping
+    
+    // One worker thread owns ctx. It runs queued requests, highest priority
+    // first, and prefills the transcript while the queue is empty.
+    struct Job {
+        uint64_t sequence = 0;
+        std::string raw_text;
+        LLMJobOptions options;
+        std::chrono::steady_clock::time_point deadline;
+        std::promise<LLMResult> promise;
+        std::function<void(const LLMResult&)> on_done;
+        std::vector<int32_t> prompt_tokens;   // Tokenized when it is first scheduled
+        int reused_tokens = 0;                // Of those, already in its sequence (batched only)
+        int generated_tokens = 0;             // Set as it finishes in a batch
+        
+        bool cancelled() const { return options.cancel.is_cancelled(); }
+        bool expired() const { return std::chrono::steady_clock::now() >= deadline; }
+    };
+    
+    std::thread worker;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::vector<std::shared_ptr<Job>> queue;
+    size_t max_queued = 8;
+    uint64_t next_sequence = 0;
+    bool stopping = false;
+    std::atomic<size_t> jobs_waiting{0};   // Queue size, read without the lock
+    std::atomic<size_t> jobs_running{0};
+    std::vector<Job*> running_jobs;        // Guarded by queue_mutex
+    
+    // With n_parallel > 1 requests decode side by side as sequences
+    // 1..n_parallel of one batch, each starting from a copy of the prefix in
+    // sequence 0, and join or leave the batch between steps
+    int n_parallel = 1;
+    int n_sequences = 1;   // Sequences besides 0 the context was created for
+    static constexpr int max_response_tokens = 1024;
+    
+    // A transcript of more than chunk_tokens tokens is cut at sentence or
+    // paragraph ends into chunks of at most that size, each of which also
+    // sees the end of the one before it (up to chunk_overlap_tokens) as
+    // context. Up to chunk_sequences chunks decode at once as parallel
+    // sequences, and their results are joined in transcript order.
+    int chunk_tokens = 768;
+    static constexpr int chunk_overlap_tokens = 64;
+    static constexpr int chunk_sequences = 4;
+    
+    struct TranscriptChunk {
+        std::string text;
+        std::string context;          // End of the previous chunk, not to be repeated
+        bool paragraph_start = false;
+    };
     
-    // Thread for async processing
-    std::thread processing_thread;
+    // A long request whose chunks run as requests of their own
+    struct ChunkedJob {
+        std::shared_ptr<Job> parent;
+        std::vector<TranscriptChunk> chunks;
+        std::vector<std::optional<LLMResult>> results;
+        std::mutex mutex;
+        size_t n_finished = 0;
+        size_t n_joined = 0;    // Leading chunks already in text
+        std::string text;
+        
+        // For the request's statistics, summed over its chunks
+        std::chrono::steady_clock::time_point start;
+        double first_piece_ms = -1.0;   // Until the first text was passed on
+        int n_prompt = 0;
+        int n_reused = 0;
+        int n_generated = 0;
+    };
     
-    // Callback for when processing is complete
-    std::function<void(const std::string&)> completion_callback;
+    // A response being generated: its text, the part already passed to
+    // on_token (leading whitespace, whitespace that may turn out to be
+    // trailing and the start of an unfinished UTF-8 character are held
+    // back) and its timing
+    struct ResponseStream {
+        std::function<void(const std::string&)> on_token;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point first_token;
+        std::string text;
+        size_t n_streamed = 0;
+        bool streaming_started = false;
+        double first_piece_ms = 0.0;
+        int n_tokens = 0;
+        
+        ResponseStream(std::function<void(const std::string&)> on_token, std::chrono::steady_clock::time_point start)
+            : on_token(std::move(on_token)), start(start), first_token(start) {}
+        
+        void append(const char* piece, int length);
+        std::string trimmed() const;
+    };
+    
+    // The instruction block is identical for every request: it is decoded
+    // once, stays in the KV cache as positions [0, n) of sequence 0 and is
+    // saved to disk, so a request only prefills the transcript
+    std::vector<int32_t> prefix_tokens;
+    std::string prefix_cache_dir;
+    bool prefix_from_disk = false;
+    double last_prefill_ms = 0.0;
+    int last_prompt_tokens = 0;
+    int last_reused_tokens = 0;
+    
+    // What follows the prefix in sequence 0. A request only decodes from
+    // where its prompt first differs, so a transcript prefilled while the
+    // user is still speaking leaves little to do when they stop.
+    std::vector<int32_t> cached_tokens;
+    std::string prefill_text;   // Latest transcript not yet decoded; guarded by queue_mutex
+    bool prefill_pending = false;
+    
+    // A transcript long enough to be chunked is prefilled chunk by chunk:
+    // each chunk that is already complete and would join the first batch
+    // goes into sequence i + 1 after a copy of the prefix, where
+    // run_batched() carries on from it. The last prompt token is left out,
+    // to be decoded again for its logits.
+    std::vector<std::vector<int32_t>> prefilled_chunks;
+    
+    // Prompt lookup: the cleaned text mostly copies the transcript, so up to
+    // lookup_draft_max tokens following the latest n-gram's match in the
+    // prompt are verified along with each generated token
+    int lookup_draft_max = 8;
+    static constexpr size_t lookup_ngram_max = 4;
+    
+    // Optional small model sharing the vocabulary. It drafts greedily when
+    // the prompt has nothing to offer; draft_tokens mirrors its sequence 0
+    // from position 0 and is brought in line with the main model's tokens
+    // by common prefix before each draft.
+    std::string draft_model_path;
+    llama_model* draft_model = nullptr;
+    llama_context* draft_ctx = nullptr;
+    llama_sampler* draft_sampler = nullptr;
+    std::vector<int32_t> draft_tokens;
+    int draft_model_max = 6;
+    
+    // The KV cache holds the prefix plus, for each request or chunk decoded
+    // at once, its prompt and response. It is sized for transcripts of
+    // expected_transcript_tokens (about 150 a minute of speech) unless
+    // context_tokens is set, and cut to kv_budget_mb if set; chunks shrink to
+    // fit what is left.
+    int expected_transcript_tokens = 1536;
+    int context_tokens = 0;
+    size_t kv_budget_mb = 0;
+    std::string kv_cache_type = "f16";
+    int kv_cache_tokens = 0;
+    size_t kv_cache_bytes = 0;   // Estimated from the model's dimensions
+    
+    // Generation of the last request
+    double last_first_token_ms = 0.0;   // From the request to the first piece of text
+    double last_tokens_per_second = 0.0;
+    int last_generated_tokens = 0;
+    int last_drafted_tokens = 0;
+    int last_accepted_tokens = 0;
+    int last_decode_calls = 0;
+    int last_model_drafted_tokens = 0;   // Part of the above from the draft model
+    int last_model_accepted_tokens = 0;
     
 public:
     LLMProcessor();
@@ -33,34 +225,208 @@ public:
     bool initialize(const std::string& model_file_path);
     void cleanup();
     
-    // Process text to clean it up (async)
+    using JobOptions = LLMJobOptions;
+    using Result = LLMResult;
+    using CancelToken = LLMCancelToken;
+    
+    // Queues a cleanup request. When the queue is full the request with the
+    // lowest priority (the newest among equals) is rejected.
+    std::future<LLMResult> submit(const std::string& raw_text, const JobOptions& options = JobOptions());
+    
+    // Process text to clean it up (async). on_token, if set, receives the
+    // response as it is generated; callback still gets the whole text (empty
+    // unless the request completed), on the worker thread.
     void process_text_async(const std::string& raw_text, 
-                           std::function<void(const std::string&)> callback);
+                           std::function<void(const std::string&)> callback,
+                           std::function<void(const std::string&)> on_token = nullptr);
+    
+    // Synchronous version (blocking); must not be called from a callback
+    std::string process_text(const std::string& raw_text,
+                             std::function<void(const std::string&)> on_token = nullptr);
     
-    // Synchronous version (blocking)
-    std::string process_text(const std::string& raw_text);
+    // Decodes a transcript that is still growing in the background, so that
+    // process_text() of it (or of a longer version) later only decodes what
+    // was added since. Only the latest transcript is kept when calls pile up.
+    void prefill_async(const std::string& transcript);
     
-    // Check if processing is currently happening
+    // Check if a model is loaded
+    bool is_ready() const { return is_initialized; }
+    
+    // Check if a request is running or queued
     bool is_busy() const;
     
-    // Cancel current processing
+    // Cancels the running request and every queued one
     void cancel_processing();
     
+    // Requests queued beyond this are rejected
+    void set_max_queued(size_t n) { max_queued = std::max<size_t>(1, n); }
+    
+    // Requests generated at once in one batch; set before initialize().
+    // Above 1 prefill reuse and speculative drafting are not used.
+    void set_parallel_sequences(int n) { n_parallel = std::max(1, n); }
+    int get_parallel_sequences() const { return n_parallel; }
+    
+    // Transcripts longer than this many tokens are cleaned up in chunks of
+    // about this size, decoded side by side
+    void set_chunk_tokens(int n) { chunk_tokens = std::max(128, std::min(n, max_response_tokens - 128)); }
+    int get_chunk_tokens() const { return chunk_tokens; }
+    
     // Get model information
     std::string get_model_name() const;
     
+    // KV cache sizing, set before initialize(). Without a budget the cache
+    // fits the expected transcripts; quantized types (q8_0, q5_0, q4_0)
+    // need flash attention, and fall back to f16 where it is unavailable.
+    void set_expected_transcript_tokens(int n) { expected_transcript_tokens = std::max(1, n); }
+    void set_context_tokens(int n) { context_tokens = std::max(0, n); }   // 0 sizes it automatically
+    void set_kv_budget_mb(size_t mb) { kv_budget_mb = mb; }
+    bool set_kv_cache_type(const std::string& type);
+    
+    int get_kv_cache_tokens() const { return kv_cache_tokens; }
+    size_t get_kv_cache_bytes() const { return kv_cache_bytes; }
+    std::string get_kv_cache_type() const { return kv_cache_type; }
+    
+    // Where the decoded instruction prefix is saved between runs; empty
+    // disables it. Defaults to $XDG_CACHE_HOME/speakprompt. Set before initialize().
+    void set_prefix_cache_dir(const std::string& dir) { prefix_cache_dir = dir; }
+    
+    int get_prefix_token_count() const { return static_cast<int>(prefix_tokens.size()); }
+    bool was_prefix_loaded_from_disk() const { return prefix_from_disk; }
+    
+    // Prefill of the last request: time and tokens decoded (prefix and
+    // tokens already in the cache excluded)
+    double get_last_prefill_ms() const { return last_prefill_ms; }
+    int get_last_prompt_tokens() const { return last_prompt_tokens; }
+    
+    // Prompt tokens of the last request that were already in the cache
+    int get_last_reused_tokens() const { return last_reused_tokens; }
+    
+    // Time to first token and generation speed of the last request
+    double get_last_first_token_ms() const { return last_first_token_ms; }
+    double get_last_tokens_per_second() const { return last_tokens_per_second; }
+    int get_last_generated_tokens() const { return last_generated_tokens; }
+    
+    // Tokens drafted from the prompt per generated token; 0 disables it.
+    // Set while no request is running.
+    void set_lookup_draft(int max_tokens) { lookup_draft_max = std::max(0, max_tokens); }
+    
+    // Prompt lookup of the last request
+    int get_last_drafted_tokens() const { return last_drafted_tokens; }
+    int get_last_accepted_tokens() const { return last_accepted_tokens; }
+    int get_last_decode_calls() const { return last_decode_calls; }
+    double get_last_acceptance_rate() const {
+        return last_drafted_tokens > 0 ? static_cast<double>(last_accepted_tokens) / last_drafted_tokens : 0.0;
+    }
+    
+    // Small GGUF model with the main model's vocabulary that drafts tokens
+    // for it. Set before initialize(); an incompatible model is not used.
+    void set_draft_model(const std::string& path) { draft_model_path = path; }
+    void set_draft_model_tokens(int max_tokens) { draft_model_max = std::max(1, max_tokens); }
+    bool has_draft_model() const { return draft_ctx != nullptr; }
+    
+    // Drafts of the last request that came from the draft model
+    int get_last_model_drafted_tokens() const { return last_model_drafted_tokens; }
+    int get_last_model_accepted_tokens() const { return last_model_accepted_tokens; }
+    
 private:
-    // Internal processing function
-    std::string clean_up_text(const std::string& raw_text);
+    static std::shared_ptr<Job> make_job(const std::string& raw_text, const JobOptions& options);
+    void enqueue(const std::shared_ptr<Job>& job);
+    void worker_loop();
+    void stop_worker();
+    
+    // Takes the next request to run from the queue, if any
+    std::shared_ptr<Job> next_job();
+    void end_job(const std::shared_ptr<Job>& job, LLMResult result);
+    
+    // Runs one request on the worker thread
+    LLMResult run_job(Job& job);
+    static void finish_job(const std::shared_ptr<Job>& job, LLMResult result);
+    
+    // Runs first (or the next queued request) and every request that
+    // arrives meanwhile as parallel sequences
+    void run_batched(std::shared_ptr<Job> first);
+    
+    // Queues the chunks of a long request ahead of everything of its
+    // priority; false if the request is short enough to run as it is
+    bool split_long_job(const std::shared_ptr<Job>& job);
+    std::vector<TranscriptChunk> split_transcript(const std::string& text);
+    std::string create_chunk_prompt(const TranscriptChunk& chunk);
+    
+    // Records a chunk's result, passes on the text completed in order and
+    // answers the long request once every chunk is done
+    void chunk_finished(const std::shared_ptr<ChunkedJob>& chunked, size_t index, const Job& chunk, const LLMResult& result);
+    
+    // Appends cleaned chunk text, minus words repeated from the end of text;
+    // returns what was appended
+    static std::string join_chunk(std::string& text, const std::string& chunk, bool paragraph_start);
+    
+    static LLMResult::Status stop_status(const Job& job) {
+        return job.cancelled() ? LLMResult::Status::CANCELLED : LLMResult::Status::TIMED_OUT;
+    }
+    
+    static llama_sampler* create_sampler();
     
-    // Thread function for async processing
-    void processing_worker(const std::string& text);
+    // Adds a sampled token to a response; false for end of generation
+    bool append_token(ResponseStream& stream, int32_t token);
+    void record_generation(const ResponseStream& stream);
     
-    // Create prompt for text cleanup
+    // Decodes prefill_text beyond what the cache holds, until a request arrives
+    void prefill(const std::string& text);
+    void prefill_chunks(const std::string& text);
+    
+    // Frees the sequences of prefilled chunks; returns the cells they held
+    int drop_prefilled_chunks();
+    
+    // Stops llama_decode() when the running request is cancelled or late
+    static bool abort_callback(void* user_data);
+    
+    // Chooses the context size and KV cache types within the budget, and
+    // shrinks chunks to fit; false if not even one chunk fits
+    bool size_context(llama_context_params& params);
+    
+    // KV cache bytes per token for the model and the current cache type
+    double kv_bytes_per_token() const;
+    
+    // Instructions shared by every cleanup prompt
+    static std::string create_cleanup_prefix();
+    
+    // The rest of the cleanup prompt, following the prefix
     std::string create_cleanup_prompt(const std::string& raw_text);
     
-    // Generate response from LLM
-    std::string generate_response(const std::string& prompt);
+    // Tokenizes text; BOS is added only when add_special is set
+    std::vector<int32_t> tokenize(const std::string& text, bool add_special);
+    
+    // Feeds tokens to sequence 0 at the next positions, n_batch at a time
+    bool decode_tokens(std::vector<int32_t>& tokens);
+    
+    // Decodes the prefix (or loads it from disk) into an empty cache
+    bool prepare_prefix();
+    
+    // Cuts the cache back to the prefix plus the longest start of tokens
+    // (at most max_keep) it already holds; returns that length, -1 on failure
+    int reuse_cached_tokens(const std::vector<int32_t>& tokens, size_t max_keep);
+    
+    std::string prefix_cache_path() const;
+    
+    // Fills draft with the tokens of source that follow the longest tail of
+    // generated found in it; cursor tracks where the last draft came from
+    static size_t lookup_draft(const std::vector<int32_t>& source, const std::vector<int32_t>& generated,
+                               size_t max_draft, size_t& cursor, std::vector<int32_t>& draft);
+    
+    bool load_draft_model();
+    void free_draft_model();
+    
+    // Whether two models tokenize identically, so drafted ids can be verified
+    static bool vocabs_compatible(const llama_model* target, const llama_model* draft);
+    
+    // Brings the draft context to exactly history (all positions from 0)
+    bool sync_draft(const std::vector<int32_t>& history);
+    
+    // Greedy continuation of history by the draft model, up to max_draft tokens
+    void draft_from_model(const std::vector<int32_t>& history, size_t max_draft, std::vector<int32_t>& draft);
+    
+    // Generate a response to the prompt following the cached prefix
+    LLMResult generate_response(const std::string& prompt, const Job& job);
 };
 
 #endif // LLM_PROCESSOR_H
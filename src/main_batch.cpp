@@ -0,0 +1,253 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <algorithm>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <utility>
+#include <limits>
+#include <memory>
+#include <atomic>
+#include <filesystem>
+#include "transcription_engine.h"
+#include "batch_transcriber.h"
+#include "llm_processor.h"
+
+static void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options] <file.wav|directory>..." << std::endl;
+    std::cout << "  -o, --output <dir>  Directory for the .jsonl transcripts (default transcripts)" << std::endl;
+    std::cout << "  --list <file>       Read further inputs from a file, one path per line" << std::endl;
+    std::cout << "  --workers <n>       Segments decoded at once (default: hardware threads / 4)" << std::endl;
+    std::cout << "  --threads <n>       Whisper threads per worker (default: hardware threads / workers)" << std::endl;
+    std::cout << "  --beam <n>          Beam width, 1 for greedy decoding (default 5)" << std::endl;
+    std::cout << "  --max-segment <s>   Longest segment cut from a file, in seconds (default 28)" << std::endl;
+    std::cout << "  --overwrite         Transcribe again even if the output exists" << std::endl;
+    std::cout << "  --llm <model.gguf>  Also clean up each new transcript into <name>.clean.txt" << std::endl;
+    std::cout << "  --llm-parallel <n>  Cleanups generated at once in one batch (default 4)" << std::endl;
+    std::cout << "  --kv-budget-mb <mb> Most memory the LLM KV cache may use" << std::endl;
+    std::cout << "  --kv-type <type>    LLM KV cache type: f16, q8_0, q5_0 or q4_0 (default f16)" << std::endl;
+}
+
+// transcripts/talk.jsonl -> transcripts/talk.clean.txt
+static std::string clean_output_path(const std::string& output_path) {
+    const std::string extension = ".jsonl";
+    std::string base = output_path;
+    if (base.size() > extension.size() &&
+        base.compare(base.size() - extension.size(), extension.size(), extension) == 0) {
+        base.resize(base.size() - extension.size());
+    }
+    return base + ".clean.txt";
+}
+
+// Written aside and renamed, so a cleanup is never half written; an
+// interrupted run leaves it missing and the next run redoes it
+static bool write_clean_text(const std::string& path, const std::string& text) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        file << text << std::endl;
+        if (!file) {
+            std::cerr << "Failed to write " << temporary << std::endl;
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::cerr << "Failed to write " << path << ": " << error.message() << std::endl;
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+static bool read_list(const std::string& path, std::vector<std::string>& inputs) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open input list: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] != '#') {
+            inputs.push_back(line);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> inputs;
+    std::string output_dir = "transcripts";
+    int workers = 0;
+    int threads = 0;
+    int beam = 5;
+    double max_segment = 0.0;
+    bool overwrite = false;
+    std::string llm_model;
+    int llm_parallel = 4;
+    int kv_budget_mb = 0;
+    std::string kv_type;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "--output" || arg == "-o") && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if (arg == "--list" && i + 1 < argc) {
+            if (!read_list(argv[++i], inputs)) {
+                return 1;
+            }
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = std::atoi(argv[++i]);
+            if (workers <= 0) {
+                std::cerr << "Invalid worker count: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+            if (threads <= 0) {
+                std::cerr << "Invalid thread count: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--beam" && i + 1 < argc) {
+            beam = std::atoi(argv[++i]);
+            if (beam <= 0) {
+                std::cerr << "Invalid beam width: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--max-segment" && i + 1 < argc) {
+            max_segment = std::atof(argv[++i]);
+            if (max_segment <= 0.0) {
+                std::cerr << "Invalid segment length: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--llm" && i + 1 < argc) {
+            llm_model = argv[++i];
+        } else if (arg == "--llm-parallel" && i + 1 < argc) {
+            llm_parallel = std::atoi(argv[++i]);
+            if (llm_parallel <= 0) {
+                std::cerr << "Invalid parallel sequence count: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--kv-budget-mb" && i + 1 < argc) {
+            kv_budget_mb = std::atoi(argv[++i]);
+            if (kv_budget_mb <= 0) {
+                std::cerr << "Invalid KV cache budget: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--kv-type" && i + 1 < argc) {
+            kv_type = argv[++i];
+        } else if (arg == "--overwrite") {
+            overwrite = true;
+        } else if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (!arg.empty() && arg[0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+
+    if (inputs.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Several mid-sized decoders keep the cores busier than one wide one
+    int hardware = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    if (workers == 0) {
+        workers = std::max(1, hardware / 4);
+    }
+    if (threads == 0) {
+        threads = std::max(1, hardware / workers);
+    }
+
+    TranscriptionEngine engine;
+    if (!engine.initialize()) {
+        std::cerr << "Failed to initialize transcription engine" << std::endl;
+        return 1;
+    }
+    engine.set_final_beam_size(beam);
+
+    BatchTranscriber batch(engine);
+    batch.set_output_dir(output_dir);
+    batch.set_worker_count(workers);
+    batch.set_threads_per_worker(threads);
+    batch.set_overwrite(overwrite);
+    if (max_segment > 0.0) {
+        batch.set_max_segment_seconds(max_segment);
+    }
+
+    // Transcripts are queued for cleanup as they are written, so the LLM
+    // works through them while the rest of the audio is still decoding.
+    // Finished transcripts without a cleanup yet (from an interrupted run)
+    // are queued as well.
+    std::atomic<size_t> cleaned{0};
+    std::unique_ptr<LLMProcessor> llm;
+    std::mutex cleanups_mutex;
+    std::vector<std::future<LLMResult>> cleanups;
+    if (!llm_model.empty()) {
+        llm = std::make_unique<LLMProcessor>();
+        llm->set_parallel_sequences(llm_parallel);
+        llm->set_max_queued(std::numeric_limits<size_t>::max());
+        if (kv_budget_mb > 0) {
+            llm->set_kv_budget_mb(kv_budget_mb);
+        }
+        if (!kv_type.empty() && !llm->set_kv_cache_type(kv_type)) {
+            return 1;
+        }
+        if (!llm->initialize(llm_model)) {
+            std::cerr << "Failed to initialize LLM: " << llm_model << std::endl;
+            return 1;
+        }
+        batch.set_file_callback([&](const std::string& output_path, const std::string& text, bool resumed) {
+            std::string clean_path = clean_output_path(output_path);
+            std::error_code error;
+            if (resumed && std::filesystem::exists(clean_path, error)) {
+                return;
+            }
+
+            // Each result is written as soon as it is ready
+            LLMJobOptions options;
+            options.on_done = [clean_path, &cleaned](const LLMResult& result) {
+                if (result.status != LLMResult::Status::OK) {
+                    std::cerr << "Cleanup failed: " << clean_path << std::endl;
+                } else if (write_clean_text(clean_path, result.text)) {
+                    cleaned++;
+                }
+            };
+            std::future<LLMResult> result = llm->submit(text, options);
+            std::lock_guard<std::mutex> lock(cleanups_mutex);
+            cleanups.push_back(std::move(result));
+        });
+    }
+
+    bool ok = batch.run(inputs);
+    batch.print_summary();
+
+    if (llm) {
+        auto start = std::chrono::steady_clock::now();
+        for (auto& cleanup : cleanups) {
+            cleanup.wait();
+        }
+        if (cleaned.load() < cleanups.size()) {
+            ok = false;
+        }
+        double wait_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Cleanup: " << cleaned.load() << " of " << cleanups.size() << " transcripts, "
+                  << llm_parallel << " at a time, " << wait_seconds << " s after transcription" << std::endl;
+        llm->cleanup();
+    }
+    return ok ? 0 : 1;
+}
@@ -4,6 +4,10 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
 #include "audio_capture.h"
 #include "transcription_engine.h"
 #include "terminal_output.h"
@@ -16,6 +20,7 @@ private:
     std::unique_ptr<TerminalOutput> terminal_output;
     std::unique_ptr<LLMProcessor> llm_processor;
     bool is_recording = false;
+    int decoders = 0;  // Concurrent Whisper decoders; 0 = automatic
 
 public:
     SimpleSpeakPrompt() {
@@ -28,6 +33,15 @@ public:
         // Set up transcription callback
         transcription_engine->set_transcription_callback([this](const std::string& text) {
             terminal_output->display_transcription(text);
+            
+            // Let the LLM read the transcript while the user is still speaking
+            if (llm_processor->is_ready()) {
+                llm_processor->prefill_async(terminal_output->get_accumulated_text());
+            }
+        });
+        
+        transcription_engine->set_partial_callback([this](const std::string& text) {
+            terminal_output->display_partial(text);
         });
         
         // Set up audio data callback
@@ -39,8 +53,9 @@ public:
         audio_capture->set_wav_file_path("/home/papa/ai/stacks/whisper.cpp/samples/jfk.wav");
     }
 
-    bool initialize() {
-        if (!audio_capture->initialize()) {
+    bool initialize(bool offline = false) {
+        // Offline file transcription never opens the live capture device
+        if (!offline && !audio_capture->initialize()) {
             std::cerr << "Failed to initialize audio capture" << std::endl;
             return false;
         }
@@ -78,6 +93,44 @@ public:
         return true;
     }
 
+    void set_latency_target(int ms) {
+        transcription_engine->set_latency_target_ms(ms);
+    }
+
+    void set_cascade(const std::string& partial_model) {
+        transcription_engine->set_cascade(true, partial_model);
+    }
+
+    void set_decoders(int n) {
+        decoders = n;
+        transcription_engine->set_parallel_decoders(n);
+    }
+
+    void set_draft_model(const std::string& path) {
+        llm_processor->set_draft_model(path);
+    }
+
+    void set_lookup_draft(int tokens) {
+        llm_processor->set_lookup_draft(tokens);
+    }
+    
+    void set_dictation_minutes(int minutes) {
+        // Speech runs at about 150 tokens a minute
+        llm_processor->set_expected_transcript_tokens(minutes * 150);
+    }
+    
+    void set_kv_budget_mb(size_t mb) {
+        llm_processor->set_kv_budget_mb(mb);
+    }
+    
+    bool set_kv_cache_type(const std::string& type) {
+        return llm_processor->set_kv_cache_type(type);
+    }
+
+    void set_max_backlog(int ms) {
+        transcription_engine->set_max_backlog_ms(ms);
+    }
+
     void run() {
         std::cout << "\n=== SpeakPrompt - Simple Speech-to-Text ===" << std::endl;
         std::cout << "Press Enter to start/stop transcription" << std::endl;
@@ -96,7 +149,105 @@ public:
         }
     }
 
+    // Transcribe a WAV file as fast as the engine can consume it
+    int run_offline(const std::string& wav_path) {
+        std::cout << "\n=== SpeakPrompt - Offline Transcription ===" << std::endl;
+        
+        audio_capture->set_wav_file_path(wav_path);
+        audio_capture->set_realtime_pacing(false);
+        transcription_engine->set_backpressure(true);
+        
+        // Nobody watches partials of a file; spend the time on final results
+        transcription_engine->set_partial_callback(nullptr);
+        
+        // There is no real-time deadline to adapt to
+        transcription_engine->set_adaptive_schedule(false);
+        
+        // Decode several segments at once on the one loaded model
+        if (decoders == 0) {
+            unsigned int hardware = std::thread::hardware_concurrency();
+            decoders = static_cast<int>(std::max(1u, std::min(4u, hardware / 4)));
+        }
+        transcription_engine->set_parallel_decoders(decoders);
+        
+        auto start_time = std::chrono::steady_clock::now();
+        
+        if (!transcription_engine->start_transcription()) {
+            return 1;
+        }
+        if (!audio_capture->start_capture()) {
+            std::cerr << "Failed to start file playback" << std::endl;
+            transcription_engine->stop_transcription();
+            return 1;
+        }
+        terminal_output->show_status("TRANSCRIBING " + wav_path);
+        
+        audio_capture->wait_until_finished();
+        transcription_engine->stop_transcription();
+        
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        double audio_seconds = transcription_engine->get_audio_duration();
+        
+        terminal_output->show_status("DONE");
+        
+        if (audio_seconds <= 0.0) {
+            std::cerr << "No audio was read from " << wav_path << std::endl;
+            return 1;
+        }
+        
+        double rtf = elapsed / audio_seconds;
+        std::cout << std::fixed << std::setprecision(2)
+                  << "Transcribed " << audio_seconds << " s of audio in " << elapsed << " s"
+                  << " (RTF " << std::setprecision(3) << rtf
+                  << ", " << std::setprecision(1) << (1.0 / rtf) << "x real time)" << std::endl;
+        
+        double skipped = transcription_engine->get_skipped_duration();
+        if (skipped > 0.0) {
+            std::cout << std::setprecision(2) << "Skipped " << skipped << " s of silence ("
+                      << std::setprecision(0) << (100.0 * skipped / audio_seconds) << "%)" << std::endl;
+        }
+        
+        std::string raw_text = terminal_output->get_accumulated_text();
+        if (!raw_text.empty() && llm_processor && llm_processor->is_ready()) {
+            std::cout << "🧠  Optimizing using [" << llm_processor->get_model_name() << "]..." << std::endl;
+            terminal_output->show_status("OPTIMIZED START");
+            std::string cleaned_text = llm_processor->process_text(raw_text, [this](const std::string& piece) {
+                terminal_output->display_stream(piece);
+            });
+            terminal_output->finish_stream(cleaned_text);
+            terminal_output->show_status("OPTIMIZED END");
+            print_llm_stats();
+        }
+        
+        return 0;
+    }
+
 private:
+    void print_llm_stats() {
+        if (llm_processor->get_last_generated_tokens() == 0) {
+            return;
+        }
+        std::cout << std::fixed << std::setprecision(0)
+                  << "First token after " << llm_processor->get_last_first_token_ms() << " ms, "
+                  << llm_processor->get_last_generated_tokens() << " tokens at "
+                  << std::setprecision(1) << llm_processor->get_last_tokens_per_second() << " tok/s"
+                  << " (" << llm_processor->get_last_reused_tokens() << " of "
+                  << (llm_processor->get_last_reused_tokens() + llm_processor->get_last_prompt_tokens())
+                  << " prompt tokens read while recording)" << std::endl;
+        if (llm_processor->get_last_drafted_tokens() > 0) {
+            std::cout << std::setprecision(0) << "Speculation: " << llm_processor->get_last_accepted_tokens()
+                      << " of " << llm_processor->get_last_drafted_tokens() << " drafted tokens accepted ("
+                      << (100.0 * llm_processor->get_last_acceptance_rate()) << "%), "
+                      << llm_processor->get_last_decode_calls() << " decode calls" << std::endl;
+        }
+        if (llm_processor->get_last_model_drafted_tokens() > 0) {
+            int drafted = llm_processor->get_last_model_drafted_tokens();
+            int accepted = llm_processor->get_last_model_accepted_tokens();
+            std::cout << std::setprecision(0) << "Draft model: " << accepted << " of " << drafted
+                      << " drafted tokens accepted (" << (100.0 * accepted / drafted) << "%)" << std::endl;
+        }
+    }
+
     void toggle_recording() {
         if (is_recording) {
             stop_recording();
@@ -130,18 +281,30 @@ private:
         // Get the accumulated transcribed text
         std::string raw_text = terminal_output->get_accumulated_text();
         
-        if (!raw_text.empty() && llm_processor && !llm_processor->is_busy()) {
+        if (!raw_text.empty() && llm_processor && llm_processor->is_ready()) {
             std::cout << "\n⏹️  Transcription stopped." << std::endl;
-            std::cout << "🧠  Optimizing using [" << llm_processor->get_model_name() << "]..." << std::endl;
+            if (llm_processor->is_busy()) {
+                std::cout << "🧠  Queued for [" << llm_processor->get_model_name() << "] after the current cleanup..." << std::endl;
+            } else {
+                std::cout << "🧠  Optimizing using [" << llm_processor->get_model_name() << "]..." << std::endl;
+            }
             
-            // Process text asynchronously with LLM
-            llm_processor->process_text_async(raw_text, [this](const std::string& cleaned_text) {
-                if (!cleaned_text.empty()) {
-                    terminal_output->show_status("OPTIMIZED START");
-                    terminal_output->display_transcription(cleaned_text);
+            // Process text asynchronously with LLM, showing it as it is
+            // generated. A queued request starts its output once it runs.
+            auto started = std::make_shared<bool>(false);
+            llm_processor->process_text_async(raw_text, [this, started](const std::string& cleaned_text) {
+                if (*started) {
+                    terminal_output->finish_stream(cleaned_text);
                     terminal_output->show_status("OPTIMIZED END");
+                    print_llm_stats();
                 }
                 std::cout << "Press Enter to start again, Ctrl+C to quit" << std::endl;
+            }, [this, started](const std::string& piece) {
+                if (!*started) {
+                    terminal_output->show_status("OPTIMIZED START");
+                    *started = true;
+                }
+                terminal_output->display_stream(piece);
             });
         } else {
             std::cout << "\n⏹️  Transcription stopped." << std::endl;
@@ -150,15 +313,132 @@ private:
     }
 };
 
-int main() {
+static void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [--file <input.wav>] [--latency-ms <ms>] [--max-backlog-ms <ms>] [--decoders <n>] [--cascade] [--partial-model <path>] [--lookup-draft <n>] [--draft-model <path>] [--dictation-minutes <m>] [--kv-budget-mb <mb>] [--kv-type <type>]" << std::endl;
+    std::cout << "  (no arguments)      Interactive live transcription" << std::endl;
+    std::cout << "  -f, --file <path>   Transcribe a WAV file faster than real time and exit" << std::endl;
+    std::cout << "  --latency-ms <ms>   Refresh interval for partial results (default 300)" << std::endl;
+    std::cout << "  --max-backlog-ms <ms>  Lag after which queued audio is skipped (default 10000)" << std::endl;
+    std::cout << "  --decoders <n>      Segments decoded in parallel (default 1 live, automatic for files)" << std::endl;
+    std::cout << "  --cascade           Partials from a small model (tiny/base), finals from the main model" << std::endl;
+    std::cout << "  --partial-model <path>  Model for partials; implies --cascade" << std::endl;
+    std::cout << "  --lookup-draft <n>  Transcript tokens drafted per LLM step, 0 disables (default 8)" << std::endl;
+    std::cout << "  --draft-model <path>  Small GGUF with the same vocabulary that drafts for the LLM" << std::endl;
+    std::cout << "  --dictation-minutes <m>  Typical dictation length the LLM context is sized for (default 10)" << std::endl;
+    std::cout << "  --kv-budget-mb <mb>  Most memory the LLM KV cache may use" << std::endl;
+    std::cout << "  --kv-type <type>    LLM KV cache type: f16, q8_0, q5_0 or q4_0 (default f16)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string offline_file;
+    int latency_ms = 0;
+    int max_backlog_ms = 0;
+    int decoders = 0;
+    bool cascade = false;
+    std::string partial_model;
+    int lookup_draft = -1;
+    std::string draft_model;
+    int dictation_minutes = 0;
+    int kv_budget_mb = 0;
+    std::string kv_type;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "--file" || arg == "-f") && i + 1 < argc) {
+            offline_file = argv[++i];
+        } else if (arg == "--cascade") {
+            cascade = true;
+        } else if (arg == "--partial-model" && i + 1 < argc) {
+            cascade = true;
+            partial_model = argv[++i];
+        } else if (arg == "--decoders" && i + 1 < argc) {
+            decoders = std::atoi(argv[++i]);
+            if (decoders <= 0) {
+                std::cerr << "Invalid decoder count: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--draft-model" && i + 1 < argc) {
+            draft_model = argv[++i];
+        } else if (arg == "--lookup-draft" && i + 1 < argc) {
+            lookup_draft = std::atoi(argv[++i]);
+            if (lookup_draft < 0) {
+                std::cerr << "Invalid draft length: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--dictation-minutes" && i + 1 < argc) {
+            dictation_minutes = std::atoi(argv[++i]);
+            if (dictation_minutes <= 0) {
+                std::cerr << "Invalid dictation length: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--kv-budget-mb" && i + 1 < argc) {
+            kv_budget_mb = std::atoi(argv[++i]);
+            if (kv_budget_mb <= 0) {
+                std::cerr << "Invalid KV cache budget: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--kv-type" && i + 1 < argc) {
+            kv_type = argv[++i];
+        } else if (arg == "--max-backlog-ms" && i + 1 < argc) {
+            max_backlog_ms = std::atoi(argv[++i]);
+            if (max_backlog_ms <= 0) {
+                std::cerr << "Invalid backlog limit: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--latency-ms" && i + 1 < argc) {
+            latency_ms = std::atoi(argv[++i]);
+            if (latency_ms <= 0) {
+                std::cerr << "Invalid latency target: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
     try {
         SimpleSpeakPrompt app;
+        if (latency_ms > 0) {
+            app.set_latency_target(latency_ms);
+        }
+        if (max_backlog_ms > 0) {
+            app.set_max_backlog(max_backlog_ms);
+        }
+        if (decoders > 0) {
+            app.set_decoders(decoders);
+        }
+        if (lookup_draft >= 0) {
+            app.set_lookup_draft(lookup_draft);
+        }
+        if (!draft_model.empty()) {
+            app.set_draft_model(draft_model);
+        }
+        if (dictation_minutes > 0) {
+            app.set_dictation_minutes(dictation_minutes);
+        }
+        if (kv_budget_mb > 0) {
+            app.set_kv_budget_mb(kv_budget_mb);
+        }
+        if (!kv_type.empty() && !app.set_kv_cache_type(kv_type)) {
+            return 1;
+        }
+        if (cascade && offline_file.empty()) {
+            // Files are transcribed without partials, so there is nothing to cascade
+            app.set_cascade(partial_model);
+        }
         
-        if (!app.initialize()) {
+        if (!app.initialize(!offline_file.empty())) {
             std::cerr << "Failed to initialize application" << std::endl;
             return 1;
         }
         
+        if (!offline_file.empty()) {
+            return app.run_offline(offline_file);
+        }
+        
         app.run();
         
     } catch (const std::exception& e) {
@@ -0,0 +1,157 @@
+#include "mel_spectrogram.h"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+
+// Slaney mel scale (librosa default, as used to build Whisper's filterbank)
+const double F_SP = 200.0 / 3.0;
+const double MIN_LOG_HZ = 1000.0;
+const double MIN_LOG_MEL = MIN_LOG_HZ / F_SP;
+const double LOG_STEP = std::log(6.4) / 27.0;
+
+double hz_to_mel(double hz) {
+    return hz < MIN_LOG_HZ ? hz / F_SP : MIN_LOG_MEL + std::log(hz / MIN_LOG_HZ) / LOG_STEP;
+}
+
+double mel_to_hz(double mel) {
+    return mel < MIN_LOG_MEL ? mel * F_SP : MIN_LOG_HZ * std::exp(LOG_STEP * (mel - MIN_LOG_MEL));
+}
+
+} // namespace
+
+MelSpectrogram::MelSpectrogram(int n_mel, int sample_rate)
+    : n_mel(n_mel), fft(N_FFT), window(N_FFT), frame_buffer(N_FFT), power(fft.bins()), tail(n_mel) {
+    // Periodic Hann window, as in whisper.cpp
+    for (int i = 0; i < N_FFT; ++i) {
+        window[i] = static_cast<float>(0.5 * (1.0 - std::cos(2.0 * M_PI * i / N_FFT)));
+    }
+    build_filters(sample_rate);
+}
+
+void MelSpectrogram::build_filters(int sample_rate) {
+    const size_t n_bins = fft.bins();
+    filters.assign(static_cast<size_t>(n_mel) * n_bins, 0.0f);
+
+    // n_mel + 2 band edges evenly spaced on the mel scale up to Nyquist
+    std::vector<double> edges(n_mel + 2);
+    const double mel_max = hz_to_mel(sample_rate / 2.0);
+    for (int i = 0; i < n_mel + 2; ++i) {
+        edges[i] = mel_to_hz(mel_max * i / (n_mel + 1));
+    }
+
+    for (int m = 0; m < n_mel; ++m) {
+        // Slaney normalization: constant energy per band
+        const double norm = 2.0 / (edges[m + 2] - edges[m]);
+        for (size_t k = 0; k < n_bins; ++k) {
+            const double hz = static_cast<double>(k) * sample_rate / N_FFT;
+            const double lower = (hz - edges[m]) / (edges[m + 1] - edges[m]);
+            const double upper = (edges[m + 2] - hz) / (edges[m + 2] - edges[m + 1]);
+            const double weight = std::max(0.0, std::min(lower, upper));
+            filters[m * n_bins + k] = static_cast<float>(weight * norm);
+        }
+    }
+}
+
+void MelSpectrogram::compute_frame(const float* audio, size_t n_audio, uint64_t audio_origin, uint64_t frame, float* out) {
+    // Frame t is centered on sample t * HOP_LENGTH
+    const int64_t first = static_cast<int64_t>(frame * HOP_LENGTH) - N_FFT / 2 - static_cast<int64_t>(audio_origin);
+    for (int i = 0; i < N_FFT; ++i) {
+        const int64_t index = first + i;
+        const float sample = (index >= 0 && index < static_cast<int64_t>(n_audio)) ? audio[index] : 0.0f;
+        frame_buffer[i] = sample * window[i];
+    }
+    fft.power_spectrum(frame_buffer.data(), N_FFT, power.data());
+
+    const size_t n_bins = fft.bins();
+    for (int m = 0; m < n_mel; ++m) {
+        const float* filter = filters.data() + m * n_bins;
+        double sum = 0.0;
+        for (size_t k = 0; k < n_bins; ++k) {
+            sum += static_cast<double>(filter[k]) * power[k];
+        }
+        out[m] = static_cast<float>(std::log10(std::max(sum, 1e-10)));
+    }
+    frames_computed++;
+}
+
+size_t MelSpectrogram::extract(const float* audio, size_t n_audio, uint64_t audio_origin,
+                               uint64_t start_sample, size_t n_samples, size_t min_frames,
+                               std::vector<float>& mel_out) {
+    const uint64_t first_frame = start_sample / HOP_LENGTH;
+    const size_t n_frames = std::max<size_t>(n_samples / HOP_LENGTH, std::max<size_t>(min_frames, 1));
+    const uint64_t end_frame = first_frame + n_frames;
+
+    // The cache must stay contiguous: restart it if the request does not continue it
+    if (first_frame < cache_first || first_frame > cache_first + cache_frames) {
+        cache.clear();
+        cache_first = first_frame;
+        cache_frames = 0;
+    }
+
+    // A frame is final once all of its samples have arrived
+    const uint64_t audio_end = audio_origin + n_audio;
+    uint64_t complete_end = audio_end >= N_FFT / 2 ? (audio_end - N_FFT / 2) / HOP_LENGTH + 1 : 0;
+    complete_end = std::min(complete_end, end_frame);
+
+    frames_reused += std::min<uint64_t>(cache_first + cache_frames, end_frame) - first_frame;
+    while (cache_first + cache_frames < complete_end) {
+        cache.resize((cache_frames + 1) * n_mel);
+        compute_frame(audio, n_audio, audio_origin, cache_first + cache_frames, cache.data() + cache_frames * n_mel);
+        cache_frames++;
+    }
+
+    // Normalize against the maximum of this chunk, then lay out [n_mel][n_len]
+    const size_t n_len = n_frames + PAD_FRAMES;
+    mel_out.resize(static_cast<size_t>(n_mel) * n_len);
+
+    float mmax = -1e20f;
+    for (uint64_t f = first_frame; f < end_frame; ++f) {
+        const float* values;
+        if (f < cache_first + cache_frames) {
+            values = cache.data() + (f - cache_first) * n_mel;
+        } else {
+            compute_frame(audio, n_audio, audio_origin, f, tail.data());
+            values = tail.data();
+        }
+
+        const size_t column = f - first_frame;
+        for (int m = 0; m < n_mel; ++m) {
+            mel_out[m * n_len + column] = values[m];
+            mmax = std::max(mmax, values[m]);
+        }
+    }
+
+    // Padding frames are digital silence: log10(1e-10), clamped like everything else
+    const float floor = mmax - 8.0f;
+    const float padding = (std::max(-10.0f, floor) + 4.0f) / 4.0f;
+    for (int m = 0; m < n_mel; ++m) {
+        float* row = mel_out.data() + m * n_len;
+        for (size_t i = 0; i < n_frames; ++i) {
+            row[i] = (std::max(row[i], floor) + 4.0f) / 4.0f;
+        }
+        std::fill(row + n_frames, row + n_len, padding);
+    }
+
+    return n_frames;
+}
+
+void MelSpectrogram::discard_before(uint64_t sample) {
+    // Keep frames whose window still reaches into the retained audio
+    const uint64_t frame = sample / HOP_LENGTH;
+    if (frame <= cache_first) {
+        return;
+    }
+    const size_t drop = static_cast<size_t>(std::min<uint64_t>(frame - cache_first, cache_frames));
+    cache.erase(cache.begin(), cache.begin() + drop * n_mel);
+    cache_first += drop;
+    cache_frames -= drop;
+}
+
+void MelSpectrogram::reset() {
+    cache.clear();
+    cache_first = 0;
+    cache_frames = 0;
+    frames_computed = 0;
+    frames_reused = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef MEL_SPECTROGRAM_H
+#define MEL_SPECTROGRAM_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "fft.h"
+
+// Whisper-compatible log-mel frontend that caches frames across chunks.
+//
+// Frames are indexed by absolute position in the audio stream (one frame per
+// 10 ms hop), so when consecutive chunks overlap only the frames for the new
+// audio are computed. The output matches whisper.cpp's own preprocessing:
+// 400-point periodic Hann window, power spectrum, Slaney mel filterbank,
+// log10, clamp to (max - 8) and scale to (x + 4) / 4, followed by 30 seconds
+// of padding frames, laid out [n_mel][n_len] for whisper_set_mel().
+class MelSpectrogram {
+public:
+    static const int N_FFT = 400;
+    static const int HOP_LENGTH = 160;
+    static const int PAD_FRAMES = 3000;
+
+private:
+    int n_mel;
+    FFT fft;
+    std::vector<float> window;
+    std::vector<float> filters;   // [n_mel][n_fft / 2 + 1]
+    std::vector<float> frame_buffer;
+    std::vector<float> power;
+
+    // Cached raw log10 frames, [frame][n_mel], starting at absolute frame cache_first
+    std::vector<float> cache;
+    uint64_t cache_first = 0;
+    size_t cache_frames = 0;
+
+    // Frames past the end of the available audio are computed here, uncached
+    std::vector<float> tail;
+
+    uint64_t frames_computed = 0;
+    uint64_t frames_reused = 0;
+
+    void build_filters(int sample_rate);
+    void compute_frame(const float* audio, size_t n_audio, uint64_t audio_origin, uint64_t frame, float* out);
+
+public:
+    explicit MelSpectrogram(int n_mel, int sample_rate = 16000);
+
+    // Writes the normalized spectrogram for [start_sample, start_sample + n_samples)
+    // to mel_out and returns the number of frames covering that audio (at least
+    // min_frames). `audio` holds stream samples from audio_origin onwards; the
+    // requested range must lie within it. Samples outside it read as silence.
+    size_t extract(const float* audio, size_t n_audio, uint64_t audio_origin,
+                   uint64_t start_sample, size_t n_samples, size_t min_frames,
+                   std::vector<float>& mel_out);
+
+    // Drops cached frames that start before this stream position
+    void discard_before(uint64_t sample);
+    void reset();
+
+    int get_n_mel() const { return n_mel; }
+    uint64_t get_frames_computed() const { return frames_computed; }
+    uint64_t get_frames_reused() const { return frames_reused; }
+};
+
+#endif // MEL_SPECTROGRAM_H
@@ -0,0 +1,216 @@
+#include "resampler.h"
+#include "sample_convert.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLER_X86 1
+#endif
+
+namespace {
+
+// Filter length per branch, in input samples, before scaling for decimation
+const int BASE_TAPS = 64;
+// Passband edge as a fraction of the lower Nyquist frequency
+const double ROLLOFF = 0.9;
+// Kaiser window shape, roughly 80 dB stopband attenuation
+const double KAISER_BETA = 8.0;
+
+float dot_scalar(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef RESAMPLER_X86
+
+__attribute__((target("sse2")))
+float dot_sse2(const float* a, const float* b, size_t n) {
+    __m128 acc = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+float dot_avx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// GCC 12 flags the undefined pass-through operand inside its own AVX-512 headers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+__attribute__((target("avx512f")))
+float dot_avx512(const float* a, const float* b, size_t n) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#pragma GCC diagnostic pop
+
+#endif // RESAMPLER_X86
+
+PolyphaseResampler::DotKernel select_dot_kernel() {
+#ifdef RESAMPLER_X86
+    // Same CPU probe as the sample converters
+    switch (SampleConverter::detect_simd_level()) {
+        case SimdLevel::AVX512: return dot_avx512;
+        case SimdLevel::AVX2: return dot_avx2;
+        case SimdLevel::SSE2: return dot_sse2;
+        default: break;
+    }
+#endif
+    return dot_scalar;
+}
+
+double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+} // namespace
+
+PolyphaseResampler::PolyphaseResampler(int input_rate, int output_rate) {
+    int g = std::gcd(input_rate, output_rate);
+    up = output_rate / g;
+    down = input_rate / g;
+    dot = select_dot_kernel();
+    design_filter();
+    reset();
+}
+
+void PolyphaseResampler::design_filter() {
+    // Decimation needs a proportionally longer filter for the same transition width
+    const double ratio = std::max(1.0, static_cast<double>(down) / up);
+    taps = static_cast<size_t>(std::ceil(BASE_TAPS * ratio));
+
+    // Odd length keeps the group delay a whole number of upsampled samples;
+    // the unused last slot of the polyphase table stays zero
+    const size_t length = (taps * up) | 1;
+    const size_t table_length = taps * up;
+    const double cutoff = ROLLOFF * 0.5 / std::max(up, down); // cycles per upsampled sample
+    const double center = (length - 1) / 2.0;
+    const double window_norm = bessel_i0(KAISER_BETA);
+
+    std::vector<double> prototype(length);
+    for (size_t i = 0; i < length; ++i) {
+        double t = i - center;
+        double sinc = (t == 0.0) ? 1.0 : std::sin(2.0 * M_PI * cutoff * t) / (2.0 * M_PI * cutoff * t);
+        double r = t / center;
+        double window = bessel_i0(KAISER_BETA * std::sqrt(std::max(0.0, 1.0 - r * r))) / window_norm;
+        // Gain of up restores the level lost by zero-stuffing
+        prototype[i] = 2.0 * cutoff * sinc * window * up;
+    }
+
+    // Branch p uses prototype[p + k*up]; store reversed so it lines up with
+    // the input history in chronological order
+    coeffs.assign(table_length, 0.0f);
+    for (int p = 0; p < up; ++p) {
+        for (size_t k = 0; k < taps; ++k) {
+            size_t i = p + k * up;
+            if (i < length) {
+                coeffs[p * taps + (taps - 1 - k)] = static_cast<float>(prototype[i]);
+            }
+        }
+    }
+
+    delay = static_cast<size_t>(center);
+}
+
+void PolyphaseResampler::reset() {
+    history.assign(taps - 1, 0.0f);
+    history.reserve(taps + 4096);
+
+    // Start the first output one group delay into the filter so that output n
+    // lines up with input time n * down / up
+    base = taps - 1 + delay / up;
+    phase = static_cast<int>(delay % up);
+    total_input = 0;
+    total_output = 0;
+}
+
+void PolyphaseResampler::run(std::vector<float>& output) {
+    while (base < history.size()) {
+        output.push_back(dot(&coeffs[static_cast<size_t>(phase) * taps], &history[base + 1 - taps], taps));
+
+        phase += down;
+        base += phase / up;
+        phase %= up;
+    }
+
+    // Keep only the history the next output still needs
+    size_t drop = std::min(base + 1 - taps, history.size());
+    history.erase(history.begin(), history.begin() + drop);
+    base -= drop;
+}
+
+void PolyphaseResampler::process(const float* input, size_t n_input, std::vector<float>& output) {
+    output.clear();
+    output.reserve(n_input * up / down + 2);
+
+    history.insert(history.end(), input, input + n_input);
+    total_input += n_input;
+    run(output);
+    total_output += output.size();
+}
+
+void PolyphaseResampler::flush(std::vector<float>& output) {
+    output.clear();
+
+    const uint64_t expected = (total_input * up + down - 1) / down;
+    if (total_output >= expected) {
+        return;
+    }
+
+    // Zero padding releases the samples still inside the filter
+    history.insert(history.end(), taps + delay / up + 1, 0.0f);
+    run(output);
+
+    output.resize(std::min<uint64_t>(output.size(), expected - total_output));
+    total_output += output.size();
+}
@@ -0,0 +1,53 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Streaming rational-ratio resampler (polyphase FIR, Kaiser-windowed sinc).
+//
+// The rate ratio is reduced to up/down; each output sample is a single dot
+// product between one polyphase branch and the most recent input samples, so
+// the cost is independent of the interpolation factor. Only filter-length
+// worth of history is kept between calls, which lets arbitrarily long inputs
+// be converted block by block. The filter delay is compensated, so the output
+// lines up with the input once flush() has been called at the end.
+class PolyphaseResampler {
+public:
+    using DotKernel = float (*)(const float* a, const float* b, size_t n);
+
+private:
+    int up = 1;
+    int down = 1;
+    size_t taps = 0;              // Taps per polyphase branch
+    std::vector<float> coeffs;    // [phase][tap], taps reversed for the dot product
+    DotKernel dot = nullptr;
+
+    std::vector<float> history;
+    size_t base = 0;              // Index in history of the newest input used by the next output
+    int phase = 0;
+    size_t delay = 0;             // Filter group delay in upsampled samples
+    uint64_t total_input = 0;
+    uint64_t total_output = 0;
+
+    void run(std::vector<float>& output);
+
+    void design_filter();
+
+public:
+    PolyphaseResampler(int input_rate, int output_rate);
+
+    // Replaces the contents of output with the samples produced by this block
+    void process(const float* input, size_t n_input, std::vector<float>& output);
+
+    // Pushes out the samples still held back by the filter delay
+    void flush(std::vector<float>& output);
+
+    void reset();
+
+    int get_up() const { return up; }
+    int get_down() const { return down; }
+};
+
+#endif // RESAMPLER_H
@@ -0,0 +1,454 @@
+#include "sample_convert.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86 1
+#endif
+
+// Scalar reference
+
+template <SampleFormat F>
+static inline float load_raw(const uint8_t* p);
+
+template <>
+inline float load_raw<SampleFormat::S16>(const uint8_t* p) {
+    int16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return static_cast<float>(v);
+}
+
+template <>
+inline float load_raw<SampleFormat::S24>(const uint8_t* p) {
+    // Place the 24 bits in the top of an int32, then shift back to sign-extend
+    uint32_t u = (static_cast<uint32_t>(p[0]) << 8) |
+                 (static_cast<uint32_t>(p[1]) << 16) |
+                 (static_cast<uint32_t>(p[2]) << 24);
+    return static_cast<float>(static_cast<int32_t>(u) >> 8);
+}
+
+template <>
+inline float load_raw<SampleFormat::S32>(const uint8_t* p) {
+    int32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return static_cast<float>(v);
+}
+
+template <>
+inline float load_raw<SampleFormat::F32>(const uint8_t* p) {
+    float v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template <SampleFormat F>
+static void convert_scalar(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const size_t sample_bytes = SampleConverter::bytes_per_sample(F);
+    const uint8_t* p = static_cast<const uint8_t*>(input);
+
+    for (size_t i = 0; i < n_frames; ++i) {
+        float sum = load_raw<F>(p);
+        p += sample_bytes;
+        for (int c = 1; c < channels; ++c) {
+            sum += load_raw<F>(p);
+            p += sample_bytes;
+        }
+        output[i] = sum * scale;
+    }
+}
+
+#ifdef SAMPLE_CONVERT_X86
+
+// SSE2 kernels
+
+__attribute__((target("sse2")))
+static void convert_s16_mono_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+        _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+    }
+    convert_scalar<SampleFormat::S16>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16_stereo_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        // Each 32-bit lane holds one L/R pair
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+        __m128i r = _mm_srai_epi32(x, 16);
+        __m128 sum = _mm_add_ps(_mm_cvtepi32_ps(l), _mm_cvtepi32_ps(r));
+        _mm_storeu_ps(output + i, _mm_mul_ps(sum, k));
+    }
+    convert_scalar<SampleFormat::S16>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_mono_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(x), k));
+    }
+    convert_scalar<SampleFormat::S32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_stereo_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        __m128 a = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i)));
+        __m128 b = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i + 4)));
+        __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_add_ps(l, r), k));
+    }
+    convert_scalar<SampleFormat::S32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_f32_mono_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(in + i), k));
+    }
+    convert_scalar<SampleFormat::F32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_f32_stereo_sse2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m128 k = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= n_frames; i += 4) {
+        __m128 a = _mm_loadu_ps(in + 2 * i);
+        __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+        __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_add_ps(l, r), k));
+    }
+    convert_scalar<SampleFormat::F32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+// AVX2 kernels
+
+// _mm256_shuffle_ps works per 128-bit lane, leaving frames in the order
+// 0 1 4 5 | 2 3 6 7; this restores 0..7.
+__attribute__((target("avx2")))
+static inline __m256 fix_lane_order_avx2(__m256 v) {
+    return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(v), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+__attribute__((target("avx2")))
+static void convert_s16_mono_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), k));
+    }
+    convert_scalar<SampleFormat::S16>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16_stereo_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+        __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+        __m256i r = _mm256_srai_epi32(x, 16);
+        __m256 sum = _mm256_add_ps(_mm256_cvtepi32_ps(l), _mm256_cvtepi32_ps(r));
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(sum, k));
+    }
+    convert_scalar<SampleFormat::S16>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_mono_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), k));
+    }
+    convert_scalar<SampleFormat::S32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_stereo_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256 a = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i)));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i + 8)));
+        __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(l, r), k);
+        _mm256_storeu_ps(output + i, fix_lane_order_avx2(v));
+    }
+    convert_scalar<SampleFormat::S32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_f32_mono_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), k));
+    }
+    convert_scalar<SampleFormat::F32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_f32_stereo_avx2(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m256 k = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= n_frames; i += 8) {
+        __m256 a = _mm256_loadu_ps(in + 2 * i);
+        __m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+        __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(l, r), k);
+        _mm256_storeu_ps(output + i, fix_lane_order_avx2(v));
+    }
+    convert_scalar<SampleFormat::F32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+// AVX-512 kernels
+
+// GCC 12 reports the deliberately undefined pass-through operand inside its
+// own AVX-512 intrinsic headers as maybe-uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static void convert_s16_mono_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        __m512i x = _mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)));
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_cvtepi32_ps(x), k));
+    }
+    convert_scalar<SampleFormat::S16>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx512f")))
+static void convert_s16_stereo_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int16_t* in = static_cast<const int16_t*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        __m512i x = _mm512_loadu_si512(in + 2 * i);
+        __m512i l = _mm512_srai_epi32(_mm512_slli_epi32(x, 16), 16);
+        __m512i r = _mm512_srai_epi32(x, 16);
+        __m512 sum = _mm512_add_ps(_mm512_cvtepi32_ps(l), _mm512_cvtepi32_ps(r));
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(sum, k));
+    }
+    convert_scalar<SampleFormat::S16>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx512f")))
+static void convert_s32_mono_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        __m512i x = _mm512_loadu_si512(in + i);
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_cvtepi32_ps(x), k));
+    }
+    convert_scalar<SampleFormat::S32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx512f")))
+static inline void deinterleave_avx512(__m512 a, __m512 b, __m512& l, __m512& r) {
+    const __m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odd = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1);
+    l = _mm512_permutex2var_ps(a, even, b);
+    r = _mm512_permutex2var_ps(a, odd, b);
+}
+
+__attribute__((target("avx512f")))
+static void convert_s32_stereo_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const int32_t* in = static_cast<const int32_t*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        __m512 a = _mm512_cvtepi32_ps(_mm512_loadu_si512(in + 2 * i));
+        __m512 b = _mm512_cvtepi32_ps(_mm512_loadu_si512(in + 2 * i + 16));
+        __m512 l, r;
+        deinterleave_avx512(a, b, l, r);
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_add_ps(l, r), k));
+    }
+    convert_scalar<SampleFormat::S32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx512f")))
+static void convert_f32_mono_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_loadu_ps(in + i), k));
+    }
+    convert_scalar<SampleFormat::F32>(in + i, n_frames - i, channels, scale, output + i);
+}
+
+__attribute__((target("avx512f")))
+static void convert_f32_stereo_avx512(const void* input, size_t n_frames, int channels, float scale, float* output) {
+    const float* in = static_cast<const float*>(input);
+    const __m512 k = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n_frames; i += 16) {
+        __m512 l, r;
+        deinterleave_avx512(_mm512_loadu_ps(in + 2 * i), _mm512_loadu_ps(in + 2 * i + 16), l, r);
+        _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_add_ps(l, r), k));
+    }
+    convert_scalar<SampleFormat::F32>(in + 2 * i, n_frames - i, channels, scale, output + i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // SAMPLE_CONVERT_X86
+
+// Dispatch
+
+static SampleConverter::Kernel scalar_kernel(SampleFormat format) {
+    switch (format) {
+        case SampleFormat::S16: return convert_scalar<SampleFormat::S16>;
+        case SampleFormat::S24: return convert_scalar<SampleFormat::S24>;
+        case SampleFormat::S32: return convert_scalar<SampleFormat::S32>;
+        case SampleFormat::F32: return convert_scalar<SampleFormat::F32>;
+    }
+    return convert_scalar<SampleFormat::S16>;
+}
+
+static SampleConverter::Kernel simd_kernel(SampleFormat format, int channels, SimdLevel level) {
+#ifdef SAMPLE_CONVERT_X86
+    if (channels != 1 && channels != 2) {
+        return nullptr;
+    }
+    const bool mono = channels == 1;
+
+    switch (level) {
+        case SimdLevel::AVX512:
+            switch (format) {
+                case SampleFormat::S16: return mono ? convert_s16_mono_avx512 : convert_s16_stereo_avx512;
+                case SampleFormat::S32: return mono ? convert_s32_mono_avx512 : convert_s32_stereo_avx512;
+                case SampleFormat::F32: return mono ? convert_f32_mono_avx512 : convert_f32_stereo_avx512;
+                default: return nullptr;
+            }
+        case SimdLevel::AVX2:
+            switch (format) {
+                case SampleFormat::S16: return mono ? convert_s16_mono_avx2 : convert_s16_stereo_avx2;
+                case SampleFormat::S32: return mono ? convert_s32_mono_avx2 : convert_s32_stereo_avx2;
+                case SampleFormat::F32: return mono ? convert_f32_mono_avx2 : convert_f32_stereo_avx2;
+                default: return nullptr;
+            }
+        case SimdLevel::SSE2:
+            switch (format) {
+                case SampleFormat::S16: return mono ? convert_s16_mono_sse2 : convert_s16_stereo_sse2;
+                case SampleFormat::S32: return mono ? convert_s32_mono_sse2 : convert_s32_stereo_sse2;
+                case SampleFormat::F32: return mono ? convert_f32_mono_sse2 : convert_f32_stereo_sse2;
+                default: return nullptr;
+            }
+        default:
+            return nullptr;
+    }
+#else
+    (void)format;
+    (void)channels;
+    (void)level;
+    return nullptr;
+#endif
+}
+
+SampleConverter::SampleConverter(SampleFormat format, int channels, SimdLevel max_level)
+    : format(format), channels(channels < 1 ? 1 : channels) {
+    float full_scale = 1.0f;
+    switch (format) {
+        case SampleFormat::S16: full_scale = 1.0f / 32768.0f; break;
+        case SampleFormat::S24: full_scale = 1.0f / 8388608.0f; break;
+        case SampleFormat::S32: full_scale = 1.0f / 2147483648.0f; break;
+        case SampleFormat::F32: full_scale = 1.0f; break;
+    }
+    // Downmix by averaging: fold the 1/channels factor into the scale
+    scale = full_scale / static_cast<float>(this->channels);
+
+    SimdLevel detected = detect_simd_level();
+    level = (max_level == SimdLevel::Best || max_level > detected) ? detected : max_level;
+
+    kernel = simd_kernel(format, this->channels, level);
+    if (!kernel) {
+        level = SimdLevel::Scalar;
+        kernel = scalar_kernel(format);
+    }
+}
+
+void SampleConverter::convert(const void* input, size_t n_frames, float* output) const {
+    kernel(input, n_frames, channels, scale, output);
+}
+
+size_t SampleConverter::bytes_per_sample(SampleFormat format) {
+    switch (format) {
+        case SampleFormat::S16: return 2;
+        case SampleFormat::S24: return 3;
+        case SampleFormat::S32: return 4;
+        case SampleFormat::F32: return 4;
+    }
+    return 2;
+}
+
+SimdLevel SampleConverter::detect_simd_level() {
+    // Probed once via cpuid on first use
+    static const SimdLevel detected = [] {
+#ifdef SAMPLE_CONVERT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return SimdLevel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::AVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return SimdLevel::SSE2;
+        }
+#endif
+        return SimdLevel::Scalar;
+    }();
+    return detected;
+}
+
+const char* SampleConverter::simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Scalar: return "scalar";
+        case SimdLevel::SSE2: return "SSE2";
+        case SimdLevel::AVX2: return "AVX2";
+        case SimdLevel::AVX512: return "AVX-512";
+        case SimdLevel::Best: return "best";
+    }
+    return "unknown";
+}
@@ -0,0 +1,53 @@
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <cstddef>
+
+enum class SampleFormat {
+    S16,  // 16-bit signed little-endian
+    S24,  // 24-bit signed little-endian, packed (3 bytes)
+    S32,  // 32-bit signed little-endian
+    F32   // 32-bit IEEE float
+};
+
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512,
+    Best  // Highest level supported by the running CPU
+};
+
+// Converts interleaved PCM frames to mono float samples in [-1, 1).
+//
+// Every channel is converted to float, the channels of a frame are summed in
+// order and the sum is scaled once, so the SIMD kernels produce bit-identical
+// output to the scalar reference. SIMD kernels cover mono and stereo S16, S32
+// and F32; S24 and more than two channels use the scalar path.
+class SampleConverter {
+public:
+    using Kernel = void (*)(const void* input, size_t n_frames, int channels, float scale, float* output);
+
+private:
+    SampleFormat format;
+    int channels;
+    float scale;
+    SimdLevel level;
+    Kernel kernel;
+
+public:
+    // The kernel is chosen once here; requesting a level above what the CPU
+    // supports falls back to the best available one.
+    SampleConverter(SampleFormat format, int channels, SimdLevel max_level = SimdLevel::Best);
+
+    void convert(const void* input, size_t n_frames, float* output) const;
+
+    size_t bytes_per_frame() const { return bytes_per_sample(format) * channels; }
+    SimdLevel simd_level() const { return level; }
+
+    static size_t bytes_per_sample(SampleFormat format);
+    static SimdLevel detect_simd_level();
+    static const char* simd_level_name(SimdLevel level);
+};
+
+#endif // SAMPLE_CONVERT_H
@@ -60,6 +60,8 @@ void TerminalOutput::display_transcription(const std::string& text) {
         return;
     }
     
+    erase_partial();
+    
     // Accumulate text with space for continuous paragraph
     if (!accumulated_text.empty() && accumulated_text.back() != ' ') {
         accumulated_text += " ";
@@ -81,9 +83,66 @@ void TerminalOutput::display_transcription(const std::string& text) {
     }
 }
 
+void TerminalOutput::display_partial(const std::string& text) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    
+    erase_partial();
+    if (text.empty()) {
+        return;
+    }
+    
+    // Save the cursor so the next partial or final can start over from here
+    std::cout << "\0337\033[2m" << text << "\033[0m" << std::flush;
+    partial_visible = true;
+}
+
+void TerminalOutput::display_stream(const std::string& piece) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    
+    erase_partial();
+    std::cout << "\033[1m" << piece << "\033[0m" << std::flush;
+    
+    if (output_file.is_open()) {
+        output_file << piece;
+        output_file.flush();
+    }
+}
+
+void TerminalOutput::finish_stream(const std::string& text) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    
+    std::cout << " " << std::flush;
+    if (output_file.is_open()) {
+        output_file << " ";
+        output_file.flush();
+    }
+    
+    if (text.empty()) {
+        return;
+    }
+    if (!accumulated_text.empty() && accumulated_text.back() != ' ') {
+        accumulated_text += " ";
+    }
+    accumulated_text += text;
+    
+    if (external_callback) {
+        external_callback(text);
+    }
+}
+
+void TerminalOutput::erase_partial() {
+    // Caller holds output_mutex
+    if (partial_visible) {
+        std::cout << "\0338\033[J";
+        partial_visible = false;
+    }
+}
+
 void TerminalOutput::show_status(const std::string& status) {
     std::lock_guard<std::mutex> lock(output_mutex);
     
+    erase_partial();
+    
     // Output status to console with spacing
     std::cout << std::endl << "\033[1;34m[STATUS]\033[0m " << status << std::endl;
     std::cout.flush();
@@ -12,6 +12,9 @@ private:
     std::mutex output_mutex;
     std::string output_filename;
     std::string accumulated_text;
+    bool partial_visible = false;  // Cursor position after the last final is saved while set
+    
+    void erase_partial();
     
     std::function<void(const std::string&)> external_callback;
     
@@ -23,6 +26,16 @@ public:
     void cleanup();
     
     void display_transcription(const std::string& text);
+    
+    // Shows a provisional result after the final text, rewriting the previous
+    // one in place; an empty string removes it. Not written to the output file.
+    void display_partial(const std::string& text);
+    
+    // Prints text as it is generated, without a line break or spacing of its
+    // own. finish_stream() ends it and records the complete text the way
+    // display_transcription() would, without printing it again.
+    void display_stream(const std::string& piece);
+    void finish_stream(const std::string& text);
     void show_status(const std::string& status);
     void clear_output();
     
@@ -0,0 +1,178 @@
+#include "token_merger.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+TokenMerger::TokenMerger() {
+}
+
+std::string TokenMerger::normalize(const std::string& text) {
+    // Case, spacing and punctuation differ between decodes of the same audio
+    std::string result;
+    for (unsigned char c : text) {
+        if (std::isalnum(c) || c >= 0x80) {
+            result += static_cast<char>(std::tolower(c));
+        }
+    }
+    return result;
+}
+
+bool TokenMerger::same_word(const TranscribedToken& a, const TranscribedToken& b) {
+    if (a.id == b.id) {
+        return true;
+    }
+    std::string na = normalize(a.text);
+    return !na.empty() && na == normalize(b.text);
+}
+
+size_t TokenMerger::find_alignment(const std::vector<TranscribedToken>& hypothesis, size_t& matched) const {
+    // Earliest position in the tentative tokens from which they agree with the
+    // start of the hypothesis, either to their end or for at least 3 tokens
+    for (size_t pos = 0; pos < tentative.size(); ++pos) {
+        size_t run = 0;
+        while (pos + run < tentative.size() && run < hypothesis.size() &&
+               same_word(tentative[pos + run], hypothesis[run])) {
+            run++;
+        }
+        if (run > 0 && (pos + run == tentative.size() || run >= 3)) {
+            matched = run;
+            return pos;
+        }
+    }
+    matched = 0;
+    return tentative.size();
+}
+
+size_t TokenMerger::committed_overlap(const std::vector<TranscribedToken>& hypothesis) const {
+    // Longest committed suffix that the hypothesis starts with
+    size_t longest = std::min({max_dedup_ngram, committed.size(), hypothesis.size()});
+    for (size_t n = longest; n > 0; --n) {
+        bool match = true;
+        for (size_t i = 0; i < n && match; ++i) {
+            match = same_word(committed[committed.size() - n + i], hypothesis[i]);
+        }
+        if (match) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+void TokenMerger::commit(const TranscribedToken* tokens, size_t n, std::string& text) {
+    for (size_t i = 0; i < n; ++i) {
+        text += tokens[i].text;
+        committed.push_back(tokens[i]);
+    }
+
+    if (committed.size() > max_history) {
+        committed.erase(committed.begin(), committed.end() - max_history);
+    }
+    prompt.clear();
+    for (const auto& token : committed) {
+        prompt.push_back(token.id);
+    }
+}
+
+size_t TokenMerger::overlap_begin(const std::vector<TranscribedToken>& hypothesis, size_t start,
+                                 int64_t overlap_start, int64_t duration) {
+    // First token that starts in the shared audio
+    bool timed = true;
+    for (size_t i = start; i < hypothesis.size() && timed; ++i) {
+        timed = hypothesis[i].t0 >= 0;
+    }
+    if (timed) {
+        size_t i = start;
+        while (i < hypothesis.size() && hypothesis[i].t0 < overlap_start) {
+            i++;
+        }
+        return i;
+    }
+
+    // Without timestamps, estimate by the overlap's share of the audio
+    size_t remaining = hypothesis.size() - start;
+    double fraction = duration > 0 ? static_cast<double>(duration - overlap_start) / duration : 0.0;
+    size_t hold = std::min(remaining, static_cast<size_t>(std::lround(remaining * std::max(0.0, fraction))));
+    return hypothesis.size() - hold;
+}
+
+std::string TokenMerger::merge(const std::vector<TranscribedToken>& hypothesis, int64_t overlap_start, int64_t duration) {
+    std::string text;
+    size_t start = 0;
+
+    if (previous_overlaps) {
+        // Tentative tokens before the point where this hypothesis picks up were
+        // not decoded again, so they are final as they stand
+        size_t matched = 0;
+        size_t pos = hypothesis.empty() ? tentative.size() : find_alignment(hypothesis, matched);
+        if (pos == tentative.size() && !hypothesis.empty() && hypothesis[0].t0 >= 0) {
+            // No agreement: the newer decode of the shared audio wins, but only
+            // from its first word on; what was heard before that is kept
+            pos = 0;
+            while (pos < tentative.size() && tentative[pos].t0 >= 0 && tentative[pos].t0 < hypothesis[0].t0) {
+                pos++;
+            }
+            revised_tokens += tentative.size() - pos;
+        } else if (pos == tentative.size() && !hypothesis.empty()) {
+            pos = 0;
+            revised_tokens += tentative.size();
+        }
+        commit(tentative.data(), pos, text);
+        tentative.clear();
+
+        // Words from the shared audio that were already committed
+        start = committed_overlap(hypothesis);
+        duplicate_tokens += start;
+    }
+
+    size_t end = hypothesis.size();
+    if (overlap_start >= 0) {
+        end = std::max(start, overlap_begin(hypothesis, start, overlap_start, duration));
+    }
+
+    commit(hypothesis.data() + start, end - start, text);
+
+    // Kept with timestamps from the start of the next chunk, which begins at the overlap
+    tentative.assign(hypothesis.begin() + end, hypothesis.end());
+    for (auto& token : tentative) {
+        if (token.t0 >= 0) {
+            token.t0 = std::max<int64_t>(0, token.t0 - overlap_start);
+        }
+    }
+    previous_overlaps = overlap_start >= 0;
+
+    return text;
+}
+
+std::string TokenMerger::preview(const std::vector<TranscribedToken>& hypothesis) const {
+    size_t start = previous_overlaps ? committed_overlap(hypothesis) : 0;
+    std::string text;
+    for (size_t i = start; i < hypothesis.size(); ++i) {
+        text += hypothesis[i].text;
+    }
+    return text;
+}
+
+std::string TokenMerger::flush() {
+    std::string text;
+    commit(tentative.data(), tentative.size(), text);
+    tentative.clear();
+    previous_overlaps = false;
+    return text;
+}
+
+std::string TokenMerger::get_committed_text() const {
+    std::string text;
+    for (const auto& token : committed) {
+        text += token.text;
+    }
+    return text;
+}
+
+void TokenMerger::reset() {
+    committed.clear();
+    tentative.clear();
+    prompt.clear();
+    previous_overlaps = false;
+    duplicate_tokens = 0;
+    revised_tokens = 0;
+}
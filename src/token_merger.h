@@ -0,0 +1,73 @@
+#ifndef TOKEN_MERGER_H
+#define TOKEN_MERGER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct TranscribedToken {
+    int32_t id;
+    std::string text;
+    int64_t t0 = -1;   // Start in centiseconds from the chunk start, -1 if unknown
+};
+
+// Merges the token hypotheses of consecutive, possibly overlapping chunks
+// into a single stream without duplicated words.
+//
+// When a chunk overlaps the next one, the tokens whose timestamps fall in the
+// shared audio are held back as tentative. The next chunk decodes that audio
+// again with more right-hand context; its hypothesis is aligned against the
+// tentative tokens and the previously committed text, so the region is
+// emitted once, in the version both decodes agree on or the newer one.
+// Committed token ids are also kept as the decoder prompt for the next chunk.
+class TokenMerger {
+private:
+    std::vector<TranscribedToken> committed;   // Most recent committed tokens only
+    std::vector<TranscribedToken> tentative;
+    bool previous_overlaps = false;
+
+    size_t max_history = 64;
+    size_t max_dedup_ngram = 5;
+    std::vector<int32_t> prompt;
+
+    uint64_t duplicate_tokens = 0;   // Dropped because they were already committed
+    uint64_t revised_tokens = 0;     // Tentative tokens replaced by a later decode
+
+    static std::string normalize(const std::string& text);
+    static bool same_word(const TranscribedToken& a, const TranscribedToken& b);
+
+    size_t find_alignment(const std::vector<TranscribedToken>& hypothesis, size_t& matched) const;
+    size_t committed_overlap(const std::vector<TranscribedToken>& hypothesis) const;
+    static size_t overlap_begin(const std::vector<TranscribedToken>& hypothesis, size_t start,
+                                int64_t overlap_start, int64_t duration);
+    void commit(const TranscribedToken* tokens, size_t n, std::string& text);
+
+public:
+    TokenMerger();
+
+    // Takes the hypothesis for the next chunk, duration centiseconds long;
+    // overlap_start is where the audio the following chunk will decode again
+    // begins (negative when nothing follows). Returns the text that became final.
+    std::string merge(const std::vector<TranscribedToken>& hypothesis, int64_t overlap_start, int64_t duration);
+
+    // Text of a provisional hypothesis for the audio after the committed
+    // text, without words already committed. Changes no state.
+    std::string preview(const std::vector<TranscribedToken>& hypothesis) const;
+
+    // Commits whatever is still tentative
+    std::string flush();
+
+    void reset();
+
+    // Recent committed tokens, for whisper_full_params::prompt_tokens
+    const std::vector<int32_t>& get_prompt_tokens() const { return prompt; }
+
+    // The same recent history as text, for prompting a model with another vocabulary
+    std::string get_committed_text() const;
+
+    uint64_t get_duplicate_tokens() const { return duplicate_tokens; }
+    uint64_t get_revised_tokens() const { return revised_tokens; }
+};
+
+#endif // TOKEN_MERGER_H
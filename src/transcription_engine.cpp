@@ -1,10 +1,177 @@
 #include "transcription_engine.h"
 #include "whisper.h"
+#include "decode_watchdog.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 
-TranscriptionEngine::TranscriptionEngine() : ctx(nullptr) {
+namespace {
+
+whisper_full_params decode_params(size_t n_frames, bool partial, int beam_size, bool fit_audio_ctx, int n_threads, int sample_rate) {
+    // Partials decode greedily; finals use beam search
+    bool beam = !partial && beam_size > 1;
+    whisper_full_params params = whisper_full_default_params(beam ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+    params.print_realtime = false;
+    params.print_progress = false;
+    params.print_timestamps = false;
+    params.print_special = false;
+    params.translate = false;
+    params.language = "en";
+    params.n_threads = n_threads;
+    params.offset_ms = 0;
+    params.duration_ms = static_cast<int>(n_frames * MelSpectrogram::HOP_LENGTH * 1000 / sample_rate);
+    if (beam) {
+        params.beam_search.beam_size = beam_size;
+    }
+    params.no_context = true;
+    
+    // Real-time optimizations
+    params.max_tokens = 32;  // Limit output tokens for faster processing
+    params.audio_ctx = 0;    // Use full context for better accuracy
+    if (partial || fit_audio_ctx) {
+        // Encode only the frames that hold audio (two mel frames per encoder position)
+        params.audio_ctx = std::min(1500, (static_cast<int>(n_frames) / 2 / 64 + 1) * 64);
+    }
+    return params;
+}
+
+// Collects the text tokens of a finished decode; timestamps and other special
+// tokens sort after EOT. Silent segments and a looping tail are left out.
+// Decodes fed a spectrogram have no signal for per-token timestamps, so each
+// token's start is placed within its segment's timestamps by text length.
+void collect_tokens(whisper_context* ctx, whisper_state* state, DecodeWatchdog& watchdog,
+                    std::vector<TranscribedToken>& tokens) {
+    tokens.clear();
+    const whisper_token eot = whisper_token_eot(ctx);
+    int n_segments = state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
+    for (int i = 0; i < n_segments; ++i) {
+        int n_tokens = state ? whisper_full_n_tokens_from_state(state, i) : whisper_full_n_tokens(ctx, i);
+        
+        float logprob_sum = 0.0f;
+        for (int j = 0; j < n_tokens; ++j) {
+            whisper_token_data data = state ? whisper_full_get_token_data_from_state(state, i, j)
+                                            : whisper_full_get_token_data(ctx, i, j);
+            logprob_sum += data.plog;
+        }
+        float no_speech = state ? whisper_full_get_segment_no_speech_prob_from_state(state, i)
+                                : whisper_full_get_segment_no_speech_prob(ctx, i);
+        if (n_tokens > 0 && !watchdog.keep_segment(no_speech, logprob_sum / n_tokens)) {
+            continue;
+        }
+        
+        size_t first = tokens.size();
+        for (int j = 0; j < n_tokens; ++j) {
+            whisper_token id = state ? whisper_full_get_token_id_from_state(state, i, j)
+                                     : whisper_full_get_token_id(ctx, i, j);
+            if (id >= eot) {
+                continue;
+            }
+            const char* token_text = state ? whisper_full_get_token_text_from_state(ctx, state, i, j)
+                                           : whisper_full_get_token_text(ctx, i, j);
+            tokens.push_back({id, token_text ? token_text : ""});
+        }
+        
+        int64_t t0 = state ? whisper_full_get_segment_t0_from_state(state, i) : whisper_full_get_segment_t0(ctx, i);
+        int64_t t1 = state ? whisper_full_get_segment_t1_from_state(state, i) : whisper_full_get_segment_t1(ctx, i);
+        if (t0 < 0 || t1 < t0) {
+            continue;
+        }
+        size_t length = 0;
+        for (size_t k = first; k < tokens.size(); ++k) {
+            length += tokens[k].text.size();
+        }
+        size_t before = 0;
+        for (size_t k = first; k < tokens.size(); ++k) {
+            tokens[k].t0 = t0 + static_cast<int64_t>(length > 0 ? (t1 - t0) * static_cast<double>(before) / length : 0.0);
+            before += tokens[k].text.size();
+        }
+    }
+    
+    // Beams cut short for looping may still end in a copy or two
+    std::vector<int32_t> ids;
+    for (const auto& token : tokens) {
+        ids.push_back(token.id);
+    }
+    tokens.resize(DecodeWatchdog::repetition_start(ids, watchdog.get_limits()));
+}
+
+// Decodes a spectrogram on the given state (the context's own state if null)
+bool decode_mel(whisper_context* ctx, whisper_state* state, const std::vector<float>& mel, int n_mel,
+                whisper_full_params params, const std::vector<int32_t>& prompt,
+                std::vector<TranscribedToken>& tokens, DecodeWatchdog::Stats& watchdog_stats) {
+    int n_len = static_cast<int>(mel.size() / n_mel);
+    int set = state ? whisper_set_mel_with_state(ctx, state, mel.data(), n_len, n_mel)
+                    : whisper_set_mel(ctx, mel.data(), n_len, n_mel);
+    if (set != 0) {
+        std::cerr << "Failed to set mel spectrogram" << std::endl;
+        return false;
+    }
+    
+    // Condition on what has been committed so far
+    params.prompt_tokens = prompt.empty() ? nullptr : prompt.data();
+    params.prompt_n_tokens = static_cast<int>(prompt.size());
+    
+    DecodeWatchdog watchdog(ctx, params.max_tokens > 0 ? params.max_tokens : whisper_n_text_ctx(ctx) / 2);
+    watchdog.attach(params);
+    
+    // Run inference on the spectrogram set above
+    int result = state ? whisper_full_with_state(ctx, state, params, nullptr, 0)
+                       : whisper_full(ctx, params, nullptr, 0);
+    if (result != 0 && !watchdog.aborted()) {
+        std::cerr << "Failed to process audio" << std::endl;
+        return false;
+    }
+    
+    // An aborted decode keeps only the windows finished before it went wrong
+    collect_tokens(ctx, state, watchdog, tokens);
+    watchdog_stats.record(watchdog);
+    return true;
+}
+
+// Loads a model with whisper.cpp's console output suppressed
+whisper_context* load_model(const std::string& path) {
+    // Save original stdout and stderr
+    FILE *stdout_orig = stdout, *stderr_orig = stderr;
+    
+    // Suppress whisper.cpp verbose output by redirecting to /dev/null
+    FILE *devnull = fopen("/dev/null", "w");
+    stdout = devnull;
+    stderr = devnull;
+    
+    whisper_context* model = whisper_init_from_file(path.c_str());
+    
+    // Restore original stdout and stderr
+    stdout = stdout_orig;
+    stderr = stderr_orig;
+    fclose(devnull);
+    
+    return model;
+}
+
+std::string model_display_name(const std::string& path) {
+    // Extract just the model filename from the path
+    std::string name = path.substr(path.find_last_of("/\\") + 1);
+    // Remove .bin extension
+    return name.substr(0, name.find_last_of('.'));
+}
+
+// A final decode running on the state pool
+struct PooledDecode {
+    std::vector<float> mel;
+    whisper_full_params params;
+    std::vector<int32_t> prompt;
+    std::vector<TranscribedToken> tokens;
+    int64_t overlap_start = -1;   // Centiseconds, as TokenMerger::merge takes them
+    int64_t duration = 0;
+    uint64_t audio_end = 0;
+    double seconds = 0.0;
+    bool decoded = false;
+};
+
+} // namespace
+
+TranscriptionEngine::TranscriptionEngine()
+    : ctx(nullptr), audio_ring(ring_capacity_samples), audio_window(window_capacity_samples) {
 }
 
 TranscriptionEngine::~TranscriptionEngine() {
@@ -37,34 +204,59 @@ bool TranscriptionEngine::initialize() {
         return false;
     }
     
-    // Save original stdout and stderr
-    FILE *stdout_orig = stdout, *stderr_orig = stderr;
-    
-    // Suppress whisper.cpp verbose output by redirecting to /dev/null
-    FILE *devnull = fopen("/dev/null", "w");
-    stdout = devnull;
-    stderr = devnull;
-    
-    ctx = whisper_init_from_file(model_path.c_str());
-    
-    // Restore original stdout and stderr
-    stdout = stdout_orig;
-    stderr = stderr_orig;
-    fclose(devnull);
-    
+    ctx = load_model(model_path);
     if (!ctx) {
         std::cerr << "Failed to initialize whisper context" << std::endl;
         return false;
     }
     
-    // Extract just the model filename from the path
-    std::string model_name = model_path.substr(model_path.find_last_of("/\\") + 1);
-    // Remove .bin extension and add brackets
-    model_name = model_name.substr(0, model_name.find_last_of('.'));
-    std::cout << "Loaded [" << model_name << "] for real-time transcription" << std::endl;
+    mel_spectrogram = std::make_unique<MelSpectrogram>(whisper_model_n_mels(ctx), sample_rate);
+    std::cout << "Loaded [" << model_display_name(model_path) << "] for real-time transcription" << std::endl;
+    
+    if (cascade) {
+        load_partial_model(model_path);
+    }
     return true;
 }
 
+void TranscriptionEngine::load_partial_model(const std::string& final_model_path) {
+    // Fastest models first; the model used for finals does not qualify
+    std::vector<std::string> model_paths;
+    if (!partial_model_path.empty()) {
+        model_paths.push_back(partial_model_path);
+    } else {
+        for (const char* dir : {"./models/", "../models/", "/usr/share/speakprompt/models/"}) {
+            for (const char* name : {"ggml-tiny.en.bin", "ggml-base.en.bin", "ggml-tiny.bin", "ggml-base.bin"}) {
+                model_paths.push_back(std::string(dir) + name);
+            }
+        }
+    }
+    
+    std::string model_path;
+    for (const auto& path : model_paths) {
+        std::ifstream file(path);
+        if (file.good() && model_display_name(path) != model_display_name(final_model_path)) {
+            model_path = path;
+            break;
+        }
+    }
+    
+    if (model_path.empty()) {
+        std::cerr << "No smaller Whisper model found for partial results (e.g. ggml-tiny.en.bin); "
+                  << "using one model for everything" << std::endl;
+        return;
+    }
+    
+    partial_ctx = load_model(model_path);
+    if (!partial_ctx) {
+        std::cerr << "Failed to load partial model " << model_path << "; using one model for everything" << std::endl;
+        return;
+    }
+    
+    partial_mel = std::make_unique<MelSpectrogram>(whisper_model_n_mels(partial_ctx), sample_rate);
+    std::cout << "Loaded [" << model_display_name(model_path) << "] for partial results" << std::endl;
+}
+
 bool TranscriptionEngine::start_transcription() {
     if (is_transcribing.load()) {
         return true; // Already transcribing
@@ -75,7 +267,52 @@ bool TranscriptionEngine::start_transcription() {
         return false;
     }
     
-    audio_buffer.clear();
+    audio_window.clear();
+    audio_ring.clear();
+    samples_received = 0;
+    skipped_samples = 0;
+    window_origin = 0;
+    mel_spectrogram->reset();
+    if (partial_mel) {
+        partial_mel->reset();
+    }
+    
+    // Decoder states are created once and kept across sessions. With a
+    // partial model, finals always run in the background, even on one state.
+    int pool_size = partial_ctx ? parallel_decoders : (parallel_decoders > 1 ? parallel_decoders : 0);
+    if (pool_size > 0 && (!state_pool || state_pool->size() != pool_size)) {
+        state_pool.reset();
+        state_pool = std::make_unique<WhisperStatePool>(ctx, pool_size);
+        if (state_pool->size() < (partial_ctx ? 1 : 2)) {
+            state_pool.reset();
+        }
+    } else if (pool_size == 0) {
+        state_pool.reset();
+    }
+    
+    token_merger.reset();
+    scheduler.reset();
+    apply_schedule();
+    pending_decode_seconds = 0.0;
+    measured_end = 0;
+    partials_suspended = false;
+    partial_suspensions = 0;
+    catch_up_entries = 0;
+    backlog_drops = 0;
+    backlog_dropped_samples = 0;
+    partial_shown = false;
+    partial_text.clear();
+    provisional_text.clear();
+    partial_audio_end = 0;
+    last_partial_ms = 0.0;
+    partials_emitted = 0;
+    watchdog_stats.reset();
+    vad.reset();
+    in_segment = false;
+    vad_position = 0;
+    segment_start = 0;
+    segment_speech = 0;
+    trailing_silence = 0;
     is_transcribing = true;
     transcription_thread = std::thread(&TranscriptionEngine::transcription_loop, this);
     
@@ -84,127 +321,602 @@ bool TranscriptionEngine::start_transcription() {
 
 void TranscriptionEngine::stop_transcription() {
     is_transcribing = false;
-    queue_cv.notify_all();
+    audio_ring.notify();
+    
+    // Nothing to flush or report when already stopped (cleanup() after a stop)
+    if (!transcription_thread.joinable()) {
+        return;
+    }
+    transcription_thread.join();
     
-    if (transcription_thread.joinable()) {
-        transcription_thread.join();
+    size_t dropped = audio_ring.dropped_samples();
+    if (dropped > 0) {
+        std::cerr << "Warning: transcription fell behind, dropped "
+                  << (dropped * 1000 / sample_rate) << " ms of audio" << std::endl;
+    }
+    if (backlog_drops.load() > 0) {
+        std::cerr << "Warning: backlog exceeded " << max_backlog_ms << " ms " << backlog_drops.load()
+                  << " time(s), skipped " << static_cast<int>(get_backlog_dropped_duration() * 1000) << " ms of audio" << std::endl;
+    }
+    if (catch_up_entries.load() > 0) {
+        std::cerr << "Transcription switched to catch-up mode " << catch_up_entries.load()
+                  << " time(s); partials suspended " << partial_suspensions.load() << " time(s)" << std::endl;
     }
+    scheduler.set_catch_up(false);
+    
+    // Process any remaining audio, including whatever is still in the ring
+    do {
+        drain_ring_buffer();
+        if (use_vad) {
+            segment_audio();
+        } else {
+            process_fixed_chunks();
+        }
+    } while (audio_ring.available() > 0);
     
-    // Process any remaining audio
-    if (!audio_buffer.empty()) {
-        std::string final_text = transcribe_audio(audio_buffer);
-        if (!final_text.empty() && transcription_callback) {
-            transcription_callback(final_text);
+    if (use_vad) {
+        // Close a segment cut off by the stop; trailing silence is dropped
+        if (in_segment) {
+            finish_segment(audio_window.size());
         }
-        audio_buffer.clear();
+        skipped_samples += audio_window.size();
+        consume_window(audio_window.size());
+        in_segment = false;
+    } else if (!audio_window.empty()) {
+        process_audio_chunk(0, audio_window.size(), false);
+        consume_window(audio_window.size());
+    }
+    
+    // Wait for decodes still running on the pool
+    if (state_pool) {
+        state_pool->wait_idle();
+    }
+    
+    if (watchdog_stats.interventions() > 0) {
+        std::cerr << "Decode watchdog: " << watchdog_stats.repetitions.load() << " repetition loop(s) cut, "
+                  << watchdog_stats.low_logprob.load() << " low-confidence and " << watchdog_stats.fallbacks.load()
+                  << " fallback abort(s), " << watchdog_stats.no_speech.load() << " no-speech segment(s) dropped; about "
+                  << static_cast<int>(watchdog_stats.saved_seconds() * 1000) << " ms of decoding saved" << std::endl;
     }
+    
+    std::lock_guard<std::mutex> lock(result_mutex);
+    emit_text(token_merger.flush());
+    partial_text.clear();
+    provisional_text.clear();
+    clear_partial();
 }
 
 void TranscriptionEngine::cleanup() {
     stop_transcription();
     
+    // States reference the model, so they go first
+    state_pool.reset();
+    
     if (ctx) {
         whisper_free(ctx);
         ctx = nullptr;
     }
+    if (partial_ctx) {
+        whisper_free(partial_ctx);
+        partial_ctx = nullptr;
+    }
+}
+
+whisper_state* TranscriptionEngine::create_decoder_state() {
+    if (!ctx) {
+        return nullptr;
+    }
+    whisper_state* state = whisper_init_state(ctx);
+    if (!state) {
+        std::cerr << "Failed to create whisper state" << std::endl;
+    }
+    return state;
+}
+
+void TranscriptionEngine::free_decoder_state(whisper_state* state) {
+    if (state) {
+        whisper_free_state(state);
+    }
+}
+
+bool TranscriptionEngine::transcribe_segment(whisper_state* state, const float* samples, size_t n_samples,
+                                             int threads, std::string& text) {
+    text.clear();
+    if (!ctx || !state) {
+        return false;
+    }
+    
+    // Whisper ignores input under a second; pad short segments with silence
+    std::vector<float> padded;
+    if (n_samples < static_cast<size_t>(min_decode_samples)) {
+        padded.assign(samples, samples + n_samples);
+        padded.resize(min_decode_samples, 0.0f);
+        samples = padded.data();
+        n_samples = padded.size();
+    }
+    
+    size_t n_frames = n_samples / MelSpectrogram::HOP_LENGTH;
+    whisper_full_params params = decode_params(n_frames, false, final_beam_size, false, threads, sample_rate);
+    params.max_tokens = 0;  // Whole segments, not short streaming chunks
+    
+    DecodeWatchdog watchdog(ctx, whisper_n_text_ctx(ctx) / 2);
+    watchdog.attach(params);
+    if (whisper_full_with_state(ctx, state, params, samples, static_cast<int>(n_samples)) != 0 && !watchdog.aborted()) {
+        std::cerr << "Failed to process audio" << std::endl;
+        return false;
+    }
+    
+    std::vector<TranscribedToken> tokens;
+    collect_tokens(ctx, state, watchdog, tokens);
+    watchdog_stats.record(watchdog);
+    for (const auto& token : tokens) {
+        text += token.text;
+    }
+    
+    size_t first = text.find_first_not_of(' ');
+    text.erase(0, first == std::string::npos ? text.size() : first);
+    return true;
 }
 
 void TranscriptionEngine::add_audio_data(const std::vector<float>& audio) {
+    add_audio_data(audio.data(), audio.size());
+}
+
+void TranscriptionEngine::add_audio_data(const float* samples, size_t n_samples) {
     if (!is_transcribing.load()) {
         return;
     }
     
-    {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        audio_queue.push(audio);
+    if (!backpressure) {
+        // Called from the capture thread: lock-free, no allocation
+        samples_received += audio_ring.write(samples, n_samples);
+        return;
     }
-    queue_cv.notify_one();
+    
+    // Offline input: wait for the transcription thread to make room
+    size_t written = 0;
+    while (written < n_samples && is_transcribing.load()) {
+        written += audio_ring.write(samples + written, n_samples - written);
+        if (written < n_samples) {
+            audio_ring.wait_for_space(n_samples - written, std::chrono::milliseconds(100));
+        }
+    }
+    samples_received += written;
 }
 
 void TranscriptionEngine::set_transcription_callback(std::function<void(const std::string&)> callback) {
     transcription_callback = callback;
 }
 
+void TranscriptionEngine::drain_ring_buffer() {
+    // Whatever does not fit stays in the ring until the next pass
+    size_t n = std::min(audio_ring.available(), audio_window.free_space());
+    if (n == 0) {
+        return;
+    }
+    
+    // Read straight into the tail of the window
+    size_t n_read = audio_ring.read(audio_window.prepare_write(n), n);
+    audio_window.commit(n_read);
+}
+
 void TranscriptionEngine::transcription_loop() {
     while (is_transcribing.load()) {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        
         // Wait for short time or new audio data (real-time processing)
-        queue_cv.wait_for(lock, std::chrono::milliseconds(100), [this] { 
-            return !audio_queue.empty() || !is_transcribing.load(); 
-        });
+        audio_ring.wait_for_data(1, std::chrono::milliseconds(100));
         
         if (!is_transcribing.load()) {
             break;
         }
         
+        check_backlog();
+        
         // Collect available audio data
-        while (!audio_queue.empty()) {
-            auto audio_chunk = audio_queue.front();
-            audio_queue.pop();
-            audio_buffer.insert(audio_buffer.end(), audio_chunk.begin(), audio_chunk.end());
+        drain_ring_buffer();
+        
+        if (use_vad) {
+            segment_audio();
+        } else {
+            process_fixed_chunks();
+        }
+        
+        update_partial();
+    }
+}
+
+void TranscriptionEngine::process_fixed_chunks() {
+    // Process in chunks if we have enough data for real-time streaming
+    while (audio_window.size() >= static_cast<size_t>(chunk_samples)) {
+        apply_schedule();
+        
+        // The chunk is a view into the window, no copy
+        process_audio_chunk(0, chunk_samples, true);
+        
+        // Advance past the processed chunk, but keep overlap for continuity
+        consume_window(chunk_samples - overlap_samples);
+    }
+}
+
+void TranscriptionEngine::segment_audio() {
+    const size_t frame = vad.frame_size();
+    
+    while (vad_position + frame <= audio_window.size()) {
+        apply_schedule();
+        
+        bool speech = vad.process_frame(audio_window.data() + vad_position);
+        vad_position += frame;
+        
+        if (!in_segment) {
+            if (speech) {
+                // Start a little before the onset; the VAD needs a few frames to commit
+                size_t onset = vad_position - frame;
+                segment_start = onset > static_cast<size_t>(pre_roll_samples) ? onset - pre_roll_samples : 0;
+                segment_speech = frame;
+                trailing_silence = 0;
+                in_segment = true;
+            } else if (vad_position > static_cast<size_t>(pre_roll_samples)) {
+                // Silence never reaches Whisper; only the pre-roll is retained
+                size_t drop = vad_position - pre_roll_samples;
+                consume_window(drop);
+                skipped_samples += drop;
+            }
+            continue;
         }
-        lock.unlock();
         
-        // Process in chunks if we have enough data for real-time streaming
-        while (audio_buffer.size() >= chunk_samples) {
-            std::vector<float> chunk(audio_buffer.begin(), audio_buffer.begin() + chunk_samples);
-            process_audio_chunk(chunk);
-            
-            // Remove processed chunk, but keep overlap for continuity
-            audio_buffer.erase(audio_buffer.begin(), audio_buffer.begin() + (chunk_samples - overlap_samples));
+        if (speech) {
+            segment_speech += frame;
+            trailing_silence = 0;
+        } else {
+            trailing_silence += frame;
         }
+        
+        if (trailing_silence >= static_cast<size_t>(endpoint_silence_samples)) {
+            // Natural pause: end the segment shortly after the last speech
+            size_t speech_end = vad_position - trailing_silence;
+            finish_segment(speech_end + std::min(trailing_silence, static_cast<size_t>(post_roll_samples)));
+        } else if (vad_position - segment_start >= static_cast<size_t>(max_segment_samples)) {
+            // No pause within the limit: cut here and keep overlap for continuity
+            process_audio_chunk(segment_start, vad_position - segment_start, true);
+            consume_window(vad_position - overlap_samples);
+            segment_start = 0;
+            segment_speech = std::min(segment_speech, static_cast<size_t>(overlap_samples));
+        }
+    }
+}
+
+void TranscriptionEngine::finish_segment(size_t end) {
+    size_t length = end - segment_start;
+    if (segment_speech >= static_cast<size_t>(min_speech_samples)) {
+        process_audio_chunk(segment_start, length, false);
+    } else {
+        skipped_samples += length;
+        std::lock_guard<std::mutex> lock(result_mutex);
+        partial_text.clear();
+        show_partial();
+    }
+    
+    // Audio between the segment end and vad_position stays as pre-roll for the next onset
+    skipped_samples += segment_start;
+    consume_window(end);
+    in_segment = false;
+    segment_start = 0;
+    segment_speech = 0;
+    trailing_silence = 0;
+}
+
+void TranscriptionEngine::consume_window(size_t n) {
+    audio_window.consume(n);
+    window_origin += n;
+    mel_spectrogram->discard_before(window_origin);
+    if (partial_mel) {
+        partial_mel->discard_before(window_origin);
     }
+    vad_position = vad_position > n ? vad_position - n : 0;
+    segment_start = segment_start > n ? segment_start - n : 0;
 }
 
-void TranscriptionEngine::process_audio_chunk(const std::vector<float>& audio) {
-    std::string text = transcribe_audio(audio);
-    if (!text.empty() && transcription_callback) {
+void TranscriptionEngine::process_audio_chunk(size_t offset, size_t n_samples, bool overlaps_next) {
+    if (state_pool) {
+        submit_final(offset, n_samples, overlaps_next);
+        return;
+    }
+    
+    std::string text = transcribe_audio(offset, n_samples, overlaps_next);
+    std::lock_guard<std::mutex> lock(result_mutex);
+    emit_text(text);
+    
+    // The final now covers the audio the partial was showing
+    partial_text.clear();
+}
+
+void TranscriptionEngine::submit_final(size_t offset, size_t n_samples, bool overlaps_next) {
+    // The job owns copies of everything it needs: the window moves on while it runs
+    auto job = std::make_shared<PooledDecode>();
+    size_t n_frames = prepare_mel(offset, n_samples);
+    job->mel.swap(mel_buffer);
+    
+    // Decoders share the cores (less what partials on the small model use)
+    int threads = std::max(1, (n_threads - (partial_ctx ? partial_thread_count() : 0)) / state_pool->size());
+    job->params = decode_params(n_frames, false, beam_size, fit_audio_ctx, threads, sample_rate);
+    job->duration = static_cast<int64_t>(n_samples) * 100 / sample_rate;
+    if (overlaps_next) {
+        job->overlap_start = static_cast<int64_t>(n_samples - std::min(n_samples, static_cast<size_t>(overlap_samples))) * 100 / sample_rate;
+    }
+    job->audio_end = window_origin + offset + n_samples;
+    {
+        // Decodes already in flight cannot contribute to the prompt
+        std::lock_guard<std::mutex> lock(result_mutex);
+        job->prompt = token_merger.get_prompt_tokens();
+        
+        // The partial for this audio stays on screen until the final arrives
+        provisional_text.push_back(partial_text);
+        partial_text.clear();
+    }
+    
+    int n_mel = mel_spectrogram->get_n_mel();
+    int n_decoders = state_pool->size();
+    state_pool->submit(
+        [this, job, n_mel](whisper_state* state) {
+            auto start = std::chrono::steady_clock::now();
+            job->decoded = decode_mel(ctx, state, job->mel, n_mel, job->params, job->prompt, job->tokens, watchdog_stats);
+            job->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        },
+        [this, job, n_decoders]() {
+            // Runs in submission order, so merging sees chunks in stream order
+            std::lock_guard<std::mutex> lock(result_mutex);
+            record_decode(job->seconds / n_decoders, job->audio_end);
+            emit_text(job->decoded ? token_merger.merge(job->tokens, job->overlap_start, job->duration) : token_merger.flush());
+            provisional_text.pop_front();
+            show_partial();
+        },
+        2 * static_cast<size_t>(n_decoders));
+}
+
+void TranscriptionEngine::emit_text(std::string text) {
+    // Caller holds result_mutex
+    // Clean up whitespace
+    text.erase(0, text.find_first_not_of(" \t\n\r"));
+    text.erase(text.find_last_not_of(" \t\n\r") + 1);
+    
+    if (text.empty()) {
+        clear_partial();
+    } else if (transcription_callback) {
+        // The final result takes the place of the partial on screen
+        partial_shown = false;
         transcription_callback(text);
     }
 }
 
-std::string TranscriptionEngine::transcribe_audio(const std::vector<float>& audio) {
-    if (!ctx || audio.empty()) {
-        return "";
+std::string TranscriptionEngine::transcribe_audio(size_t offset, size_t n_samples, bool overlaps_next) {
+    auto start = std::chrono::steady_clock::now();
+    bool decoded = run_whisper(offset, n_samples, false);
+    
+    std::lock_guard<std::mutex> lock(result_mutex);
+    record_decode(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                  window_origin + offset + n_samples);
+    if (!decoded) {
+        return token_merger.flush();
     }
     
-    // Set up whisper parameters for real-time streaming
-    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    params.print_realtime = false;
-    params.print_progress = false;
-    params.print_timestamps = false;
-    params.print_special = false;
-    params.translate = false;
-    params.language = "en";
-    params.n_threads = 8;  // Use more threads for faster processing
-    params.offset_ms = 0;
-    params.duration_ms = (audio.size() * 1000) / sample_rate;
+    int64_t duration = static_cast<int64_t>(n_samples) * 100 / sample_rate;
+    int64_t overlap_start = -1;
+    if (overlaps_next) {
+        overlap_start = static_cast<int64_t>(n_samples - std::min(n_samples, static_cast<size_t>(overlap_samples))) * 100 / sample_rate;
+    }
+    return token_merger.merge(hypothesis, overlap_start, duration);
+}
+
+void TranscriptionEngine::record_decode(double seconds, uint64_t audio_end) {
+    // Caller holds result_mutex
+    pending_decode_seconds += seconds;
+    if (audio_end <= measured_end) {
+        return;
+    }
     
-    // Real-time optimizations
-    params.max_tokens = 32;  // Limit output tokens for faster processing
-    params.audio_ctx = 0;    // Use full context for better accuracy
+    // Stream time includes skipped silence: that is what has to be kept up with
+    double audio_seconds = static_cast<double>(audio_end - measured_end) / sample_rate;
+    double backlog_seconds = backpressure ? 0.0 : static_cast<double>(audio_ring.available()) / sample_rate;
+    scheduler.record(pending_decode_seconds, audio_seconds, backlog_seconds);
+    pending_decode_seconds = 0.0;
+    measured_end = audio_end;
+}
+
+void TranscriptionEngine::set_max_backlog_ms(int ms) {
+    int ring_ms = static_cast<int>(static_cast<int64_t>(audio_ring.capacity()) * 1000 / sample_rate);
+    max_backlog_ms = std::max(300, std::min(ms, ring_ms));
+    catch_up_enter_ms = max_backlog_ms / 3;
+    catch_up_exit_ms = std::min(1000, catch_up_enter_ms / 2);
+    partial_suspend_ms = catch_up_exit_ms;
+}
+
+void TranscriptionEngine::check_backlog() {
+    if (backpressure) {
+        // Offline input waits for us; there is nothing to catch up with
+        return;
+    }
     
-    // Run inference
-    int result = whisper_full(ctx, params, audio.data(), audio.size());
-    if (result != 0) {
-        std::cerr << "Failed to process audio" << std::endl;
-        return "";
+    size_t queued = audio_ring.available();
+    int64_t lag_ms = static_cast<int64_t>(queued) * 1000 / sample_rate;
+    
+    // Hard bound: skip ahead so latency cannot grow without limit
+    if (lag_ms > max_backlog_ms) {
+        size_t keep = static_cast<size_t>(catch_up_exit_ms) * sample_rate / 1000;
+        size_t dropped = audio_ring.discard(queued - keep);
+        backlog_drops++;
+        backlog_dropped_samples += dropped;
+        lag_ms = catch_up_exit_ms;
     }
     
-    // Extract text
-    std::string text;
-    int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char* segment_text = whisper_full_get_segment_text(ctx, i);
-        if (segment_text) {
-            text += segment_text;
+    // Catch-up mode: cheapest decode settings until the lag is small again
+    std::lock_guard<std::mutex> lock(result_mutex);
+    if (!scheduler.is_catching_up() && lag_ms > catch_up_enter_ms) {
+        scheduler.set_catch_up(true);
+        catch_up_entries++;
+    } else if (scheduler.is_catching_up() && lag_ms < catch_up_exit_ms) {
+        scheduler.set_catch_up(false);
+    }
+    
+    // Partials are the first thing to go when falling behind
+    bool suspend = scheduler.is_catching_up() || lag_ms > partial_suspend_ms;
+    if (suspend && !partials_suspended) {
+        partial_suspensions++;
+        clear_partial();
+    }
+    partials_suspended = suspend;
+}
+
+void TranscriptionEngine::apply_schedule() {
+    std::lock_guard<std::mutex> lock(result_mutex);
+    const ChunkSettings& settings = adaptive_schedule ? scheduler.current() : scheduler.most_accurate();
+    chunk_samples = settings.chunk_ms * sample_rate / 1000;
+    overlap_samples = settings.overlap_ms * sample_rate / 1000;
+    max_segment_samples = 3 * chunk_samples;
+    fit_audio_ctx = settings.fit_audio_ctx;
+    beam_size = std::min(final_beam_size, settings.beam_size);
+}
+
+void TranscriptionEngine::update_partial() {
+    if (!partial_callback || partials_suspended) {
+        return;
+    }
+    
+    // The audio that has no final result yet
+    size_t offset = 0;
+    size_t n_samples = audio_window.size();
+    if (use_vad) {
+        if (!in_segment) {
+            return;
         }
+        offset = segment_start;
+        n_samples = vad_position - segment_start;
     }
     
-    // Clean up whitespace
+    uint64_t audio_end = window_origin + offset + n_samples;
+    if (n_samples < static_cast<size_t>(min_partial_samples) || audio_end == partial_audio_end) {
+        return;
+    }
+    
+    // Do not let partials take more than about half of the decoder's time
+    auto now = std::chrono::steady_clock::now();
+    double interval_ms = std::max(static_cast<double>(latency_target_ms), 2.0 * last_partial_ms);
+    if (std::chrono::duration<double, std::milli>(now - last_partial_time).count() < interval_ms) {
+        return;
+    }
+    
+    bool decoded = run_whisper(offset, n_samples, true);
+    last_partial_time = std::chrono::steady_clock::now();
+    last_partial_ms = std::chrono::duration<double, std::milli>(last_partial_time - now).count();
+    partial_audio_end = audio_end;
+    
+    std::lock_guard<std::mutex> lock(result_mutex);
+    pending_decode_seconds += last_partial_ms / 1000.0;
+    
+    if (!decoded) {
+        return;
+    }
+    
+    std::string text = token_merger.preview(hypothesis);
     text.erase(0, text.find_first_not_of(" \t\n\r"));
     text.erase(text.find_last_not_of(" \t\n\r") + 1);
+    if (!text.empty()) {
+        partial_text = text;
+        show_partial();
+        partials_emitted++;
+    }
+}
+
+void TranscriptionEngine::show_partial() {
+    // Caller holds result_mutex
+    if (!partial_callback || partials_suspended) {
+        clear_partial();
+        return;
+    }
     
-    return text;
+    // Partials of segments whose finals are still decoding come first
+    std::string text;
+    for (const auto& provisional : provisional_text) {
+        if (!provisional.empty()) {
+            text += (text.empty() ? "" : " ") + provisional;
+        }
+    }
+    if (!partial_text.empty()) {
+        text += (text.empty() ? "" : " ") + partial_text;
+    }
+    
+    if (text.empty()) {
+        clear_partial();
+        return;
+    }
+    partial_callback(text);
+    partial_shown = true;
+}
+
+void TranscriptionEngine::clear_partial() {
+    if (partial_shown && partial_callback) {
+        partial_callback("");
+    }
+    partial_shown = false;
+}
+
+size_t TranscriptionEngine::prepare_mel(size_t offset, size_t n_samples) {
+    // Only frames not already computed for an overlapping chunk are analysed here.
+    // Short utterances ("yes", "stop") are padded with silence frames up to
+    // Whisper's 1 s minimum so they are not skipped.
+    return mel_spectrogram->extract(audio_window.data(), audio_window.size(), window_origin,
+                                    window_origin + offset, n_samples,
+                                    min_decode_samples / MelSpectrogram::HOP_LENGTH, mel_buffer);
+}
+
+bool TranscriptionEngine::run_whisper(size_t offset, size_t n_samples, bool partial) {
+    if (!ctx || n_samples == 0) {
+        return false;
+    }
+    
+    if (partial && partial_ctx) {
+        return run_partial_model(offset, n_samples);
+    }
+    
+    size_t n_frames = prepare_mel(offset, n_samples);
+    whisper_full_params params = decode_params(n_frames, partial, beam_size, fit_audio_ctx, n_threads, sample_rate);
+    
+    std::vector<int32_t> prompt;
+    {
+        std::lock_guard<std::mutex> lock(result_mutex);
+        prompt = token_merger.get_prompt_tokens();
+    }
+    
+    return decode_mel(ctx, nullptr, mel_buffer, mel_spectrogram->get_n_mel(), params, prompt, hypothesis, watchdog_stats);
+}
+
+int TranscriptionEngine::partial_thread_count() const {
+    // Enough for a tiny model to keep up; the rest goes to the finals
+    return std::max(1, n_threads / 4);
+}
+
+bool TranscriptionEngine::run_partial_model(size_t offset, size_t n_samples) {
+    size_t n_frames = partial_mel->extract(audio_window.data(), audio_window.size(), window_origin,
+                                           window_origin + offset, n_samples,
+                                           min_decode_samples / MelSpectrogram::HOP_LENGTH, partial_mel_buffer);
+    whisper_full_params params = decode_params(n_frames, true, 1, true, partial_thread_count(), sample_rate);
+    
+    // The models need not share a vocabulary: the committed text is prompted
+    // in the small model's own tokens
+    std::string committed;
+    {
+        std::lock_guard<std::mutex> lock(result_mutex);
+        committed = token_merger.get_committed_text();
+    }
+    std::vector<int32_t> prompt(committed.size() + 8);
+    int n_prompt = committed.empty() ? 0 : whisper_tokenize(partial_ctx, committed.c_str(), prompt.data(), static_cast<int>(prompt.size()));
+    prompt.resize(std::max(0, n_prompt));
+    
+    if (!decode_mel(partial_ctx, nullptr, partial_mel_buffer, partial_mel->get_n_mel(), params, prompt, hypothesis, watchdog_stats)) {
+        return false;
+    }
+    
+    // Ids from another vocabulary must not be matched against committed ones
+    for (auto& token : hypothesis) {
+        token.id = -1;
+    }
+    return true;
 }
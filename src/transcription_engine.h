@@ -6,35 +6,166 @@
 #include <functional>
 #include <thread>
 #include <atomic>
-#include <queue>
+#include <cstdint>
+#include <memory>
+#include <chrono>
 #include <mutex>
-#include <condition_variable>
+#include <algorithm>
+#include <deque>
+#include "audio_ring_buffer.h"
+#include "audio_window.h"
+#include "voice_activity_detector.h"
+#include "mel_spectrogram.h"
+#include "token_merger.h"
+#include "chunk_scheduler.h"
+#include "whisper_state_pool.h"
+#include "decode_watchdog.h"
 
-// Forward declaration for Whisper context
+// Forward declarations for Whisper context and decoder state
 struct whisper_context;
+struct whisper_state;
 
 class TranscriptionEngine {
 private:
     whisper_context* ctx = nullptr;
     std::thread transcription_thread;
     std::atomic<bool> is_transcribing{false};
-    
-    // Audio buffer management
-    std::queue<std::vector<float>> audio_queue;
-    std::mutex queue_mutex;
-    std::condition_variable queue_cv;
+    bool backpressure = false;
+    std::atomic<uint64_t> samples_received{0};
     
     // Configuration
     const int sample_rate = 16000;
-    const int chunk_samples = 2 * sample_rate; // 2 second chunks for real-time streaming
-    const int overlap_samples = 1 * sample_rate; // 1 second overlap for continuity
-    std::vector<float> audio_buffer;
+    const int ring_capacity_samples = 30 * sample_rate; // Capture-to-transcription backlog
+    const int window_capacity_samples = 16 * sample_rate; // Sliding window storage
+    
+    // Chunking and decoder settings, chosen by the scheduler from the measured
+    // real-time factor (the initial values are its most accurate level)
+    ChunkScheduler scheduler;
+    bool adaptive_schedule = true;
+    int chunk_samples = 2 * sample_rate; // 2 second chunks for real-time streaming
+    int overlap_samples = 1 * sample_rate; // 1 second overlap for continuity
+    int max_segment_samples = 3 * chunk_samples; // Forced cut for long run-on speech (VAD mode)
+    bool fit_audio_ctx = false;
+    int beam_size = 5;
+    int n_threads = ChunkScheduler::default_thread_count();
+    double pending_decode_seconds = 0.0; // Decode time since the last measurement
+    uint64_t measured_end = 0;           // Stream position covered by the last measurement
+    
+    void apply_schedule();
+    
+    // Overload control (live input only). Lag is audio queued in the ring.
+    int max_backlog_ms = 10000;      // Beyond this the oldest audio is dropped
+    int catch_up_enter_ms = 3000;    // Switch to the cheapest decode settings
+    int catch_up_exit_ms = 1000;     // ...until the lag is back under this
+    int partial_suspend_ms = 1000;   // No partials while lagging by more than this
+    bool partials_suspended = false;
+    std::atomic<uint64_t> partial_suspensions{0};
+    std::atomic<uint64_t> catch_up_entries{0};
+    std::atomic<uint64_t> backlog_drops{0};
+    std::atomic<uint64_t> backlog_dropped_samples{0};
+    
+    void check_backlog();
+    void record_decode(double seconds, uint64_t audio_end);
+    
+    // Endpoint segmentation (VAD mode)
+    const int pre_roll_samples = sample_rate / 5;          // Audio kept ahead of speech onset
+    const int post_roll_samples = sample_rate / 5;         // Audio kept after the last speech frame
+    const int endpoint_silence_samples = sample_rate / 2;  // Pause that ends a segment
+    const int min_speech_samples = sample_rate / 4;        // Shorter segments are treated as noise
+    const int min_decode_samples = sample_rate + sample_rate / 10; // Whisper ignores input under 1 s
+    
+    // Audio buffer management: capture thread writes the ring lock-free,
+    // transcription thread drains it into the sliding window
+    AudioRingBuffer audio_ring;
+    AudioWindow audio_window;
+    
+    void drain_ring_buffer();
+    
+    // Log-mel frames are cached by stream position so overlapping audio is
+    // only analysed once; window_origin is the stream position of the window head
+    std::unique_ptr<MelSpectrogram> mel_spectrogram;
+    std::vector<float> mel_buffer;
+    uint64_t window_origin = 0;
+    
+    // Voice activity detection: silence is dropped before it reaches Whisper
+    // and segments are cut at pauses. Offsets are relative to the window head.
+    VoiceActivityDetector vad;
+    bool use_vad = true;
+    bool in_segment = false;
+    size_t vad_position = 0;      // Samples already classified
+    size_t segment_start = 0;
+    size_t segment_speech = 0;    // Speech samples in the open segment
+    size_t trailing_silence = 0;  // Non-speech samples at the end of the open segment
+    std::atomic<uint64_t> skipped_samples{0};
+    
+    void process_fixed_chunks();
+    void segment_audio();
+    void finish_segment(size_t end);
+    void consume_window(size_t n);
     
     std::function<void(const std::string&)> transcription_callback;
     
     void transcription_loop();
-    void process_audio_chunk(const std::vector<float>& audio);
-    std::string transcribe_audio(const std::vector<float>& audio);
+    // Overlapping chunks are stitched at token level; committed tokens
+    // become the decoder prompt for the next chunk
+    TokenMerger token_merger;
+    std::vector<TranscribedToken> hypothesis;
+    
+    void emit_text(std::string text);
+    
+    // Partial results: cheap greedy decodes of the audio not yet final, at a
+    // cadence set by the latency target (stretched when decoding is slower)
+    std::function<void(const std::string&)> partial_callback;
+    int latency_target_ms = 300;
+    int final_beam_size = 5;
+    const int min_partial_samples = sample_rate / 2;
+    bool partial_shown = false;
+    std::string partial_text;                  // Partial for the audio not yet submitted
+    std::deque<std::string> provisional_text;  // Partials of finals still decoding, oldest first
+    uint64_t partial_audio_end = 0;
+    double last_partial_ms = 0.0;
+    std::chrono::steady_clock::time_point last_partial_time;
+    std::atomic<uint64_t> partials_emitted{0};
+    
+    void update_partial();
+    void show_partial();
+    void clear_partial();
+    
+    // Optional cascade: a small model decodes the partials while the main
+    // model decodes finals in the background on the state pool
+    bool cascade = false;
+    std::string partial_model_path;
+    whisper_context* partial_ctx = nullptr;
+    std::unique_ptr<MelSpectrogram> partial_mel;
+    std::vector<float> partial_mel_buffer;
+    
+    void load_partial_model(const std::string& final_model_path);
+    int partial_thread_count() const;
+    bool run_partial_model(size_t offset, size_t n_samples);
+    
+    // Computes the spectrogram for the range into mel_buffer; returns its frames
+    size_t prepare_mel(size_t offset, size_t n_samples);
+    
+    // Decodes the range on the context's own state and fills hypothesis
+    bool run_whisper(size_t offset, size_t n_samples, bool partial);
+    
+    // Optional pool of extra decoder states: finals are decoded concurrently
+    // and merged in stream order. result_mutex guards everything a finished
+    // decode touches (merger, scheduler, partial display).
+    int parallel_decoders = 1;
+    std::unique_ptr<WhisperStatePool> state_pool;
+    std::mutex result_mutex;
+    
+    void submit_final(size_t offset, size_t n_samples, bool overlaps_next);
+    
+    // Every decode runs under a watchdog that cuts loops and abandons
+    // hallucinations; these are its totals
+    DecodeWatchdog::Stats watchdog_stats;
+    
+    // Offsets are relative to the head of audio_window; overlaps_next tells
+    // whether the following chunk will decode the last overlap_samples again
+    void process_audio_chunk(size_t offset, size_t n_samples, bool overlaps_next);
+    std::string transcribe_audio(size_t offset, size_t n_samples, bool overlaps_next);
     
 public:
     TranscriptionEngine();
@@ -46,9 +177,74 @@ public:
     void cleanup();
     
     void add_audio_data(const std::vector<float>& audio);
+    void add_audio_data(const float* samples, size_t n_samples);
     void set_transcription_callback(std::function<void(const std::string&)> callback);
     
+    // Receives the current unstable hypothesis; an empty string withdraws it.
+    // Finals delivered to the transcription callback replace the last partial.
+    void set_partial_callback(std::function<void(const std::string&)> callback) { partial_callback = callback; }
+    
+    // Decode partials with a small model (tiny/base) and only finals with the
+    // main one; an empty path searches the model directories. Set before initialize().
+    void set_cascade(bool enabled, const std::string& model_path = "") { cascade = enabled; partial_model_path = model_path; }
+    bool is_cascaded() const { return partial_ctx != nullptr; }
+    
+    // How often partials are refreshed, in milliseconds
+    void set_latency_target_ms(int ms) { latency_target_ms = ms; }
+    
+    // Upper bound on the beam width for final results (1 = greedy)
+    void set_final_beam_size(int beam_size) { final_beam_size = beam_size; }
+    
+    // Whisper threads; defaults to the hardware thread count (at most 16)
+    void set_thread_count(int threads) { n_threads = threads; }
+    
+    // Number of segments decoded concurrently on the shared model; each
+    // decoder beyond the first costs one whisper_state. Set before start.
+    void set_parallel_decoders(int n) { parallel_decoders = std::max(1, n); }
+    
+    // When disabled, the most accurate settings are used regardless of speed
+    void set_adaptive_schedule(bool enabled) { adaptive_schedule = enabled; }
+    
+    // Lag allowed before the oldest queued audio is discarded (at most the
+    // 30 s ring capacity); catch-up starts at a third of it
+    void set_max_backlog_ms(int ms);
+    
+    uint64_t get_partial_suspensions() const { return partial_suspensions.load(); }
+    uint64_t get_catch_up_entries() const { return catch_up_entries.load(); }
+    uint64_t get_backlog_drops() const { return backlog_drops.load(); }
+    double get_backlog_dropped_duration() const { return static_cast<double>(backlog_dropped_samples.load()) / sample_rate; }
+    
+    size_t get_schedule_level() const { return scheduler.get_level(); }
+    double get_decode_load() const { return scheduler.get_load(); }
+    
+    uint64_t get_partials_emitted() const { return partials_emitted.load(); }
+    
+    // Decodes cut short or dropped by the watchdog, and the decode time that
+    // saved (an upper-bound estimate), since start_transcription()
+    const DecodeWatchdog::Stats& get_watchdog_stats() const { return watchdog_stats; }
+    
+    // When enabled, add_audio_data() blocks until the engine has room instead
+    // of dropping samples. Meant for offline input that can run faster than real time.
+    void set_backpressure(bool enabled) { backpressure = enabled; }
+    
+    // Fixed-length chunking instead of VAD segmentation; set before start_transcription()
+    void set_vad_enabled(bool enabled) { use_vad = enabled; }
+    
+    // Audio discarded as silence without running Whisper, in seconds
+    double get_skipped_duration() const { return static_cast<double>(skipped_samples.load()) / sample_rate; }
+    
+    // Audio accepted since start_transcription(), in seconds
+    double get_audio_duration() const { return static_cast<double>(samples_received.load()) / sample_rate; }
+    
     bool is_active() const { return is_transcribing.load(); }
+    
+    // Offline decoding of complete segments for callers with their own worker
+    // threads. Each thread decodes on its own state from create_decoder_state();
+    // nothing else in the engine is touched, so this may run concurrently.
+    whisper_state* create_decoder_state();
+    void free_decoder_state(whisper_state* state);
+    bool transcribe_segment(whisper_state* state, const float* samples, size_t n_samples,
+                            int threads, std::string& text);
 };
 
 #endif // TRANSCRIPTION_ENGINE_H
@@ -0,0 +1,115 @@
+#include "voice_activity_detector.h"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+
+const int FRAME_MS = 20;
+const size_t FFT_SIZE = 512;
+
+// Speech band used for spectral flatness
+const float BAND_LOW_HZ = 300.0f;
+const float BAND_HIGH_HZ = 4000.0f;
+
+// Noise floor tracking: fall quickly, rise slowly (dB per frame)
+const float NOISE_FALL = 0.5f;
+const float NOISE_RISE_DB = 0.02f;
+
+} // namespace
+
+VoiceActivityDetector::VoiceActivityDetector(int sample_rate)
+    : sample_rate(sample_rate),
+      frame_samples(static_cast<size_t>(sample_rate * FRAME_MS / 1000)),
+      fft(FFT_SIZE),
+      window(frame_samples),
+      frame_buffer(frame_samples),
+      power(fft.bins()) {
+    for (size_t i = 0; i < frame_samples; ++i) {
+        window[i] = 0.5f - 0.5f * static_cast<float>(std::cos(2.0 * M_PI * i / frame_samples));
+    }
+
+    const float bin_hz = static_cast<float>(sample_rate) / FFT_SIZE;
+    band_begin = static_cast<size_t>(BAND_LOW_HZ / bin_hz);
+    band_end = std::min(fft.bins(), static_cast<size_t>(BAND_HIGH_HZ / bin_hz) + 1);
+}
+
+void VoiceActivityDetector::reset() {
+    noise_floor_db = -60.0f;
+    noise_floor_initialized = false;
+    speaking = false;
+    speech_run = 0;
+    silence_run = 0;
+}
+
+bool VoiceActivityDetector::process_frame(const float* frame) {
+    bool raw_speech = classify_frame(frame);
+    update_noise_floor(last_energy_db, raw_speech);
+
+    if (raw_speech) {
+        speech_run++;
+        silence_run = 0;
+        if (!speaking && speech_run >= onset_frames) {
+            speaking = true;
+        }
+    } else {
+        silence_run++;
+        speech_run = 0;
+        if (speaking && silence_run > hangover_frames) {
+            speaking = false;
+        }
+    }
+
+    return speaking;
+}
+
+bool VoiceActivityDetector::classify_frame(const float* frame) {
+    // Energy and zero crossings straight from the samples
+    double sum_squares = 0.0;
+    size_t crossings = 0;
+    for (size_t i = 0; i < frame_samples; ++i) {
+        sum_squares += static_cast<double>(frame[i]) * frame[i];
+        if (i > 0 && (frame[i] >= 0.0f) != (frame[i - 1] >= 0.0f)) {
+            crossings++;
+        }
+    }
+    last_energy_db = 10.0f * static_cast<float>(std::log10(sum_squares / frame_samples + 1e-10));
+    last_zcr = static_cast<float>(crossings) / (frame_samples - 1);
+
+    if (!noise_floor_initialized) {
+        noise_floor_db = last_energy_db;
+        noise_floor_initialized = true;
+    }
+
+    if (last_energy_db < min_energy_db || last_energy_db < noise_floor_db + energy_margin_db) {
+        return false;
+    }
+
+    // Spectral flatness: geometric over arithmetic mean of the band power
+    for (size_t i = 0; i < frame_samples; ++i) {
+        frame_buffer[i] = frame[i] * window[i];
+    }
+    fft.power_spectrum(frame_buffer.data(), frame_samples, power.data());
+
+    double log_sum = 0.0;
+    double linear_sum = 0.0;
+    for (size_t k = band_begin; k < band_end; ++k) {
+        double p = power[k] + 1e-12;
+        log_sum += std::log(p);
+        linear_sum += p;
+    }
+    const double n_band = static_cast<double>(band_end - band_begin);
+    last_flatness = static_cast<float>(std::exp(log_sum / n_band) / (linear_sum / n_band));
+
+    return last_flatness < max_flatness || last_zcr > fricative_zcr;
+}
+
+void VoiceActivityDetector::update_noise_floor(float energy_db, bool raw_speech) {
+    if (energy_db < noise_floor_db) {
+        noise_floor_db += NOISE_FALL * (energy_db - noise_floor_db);
+    } else if (!raw_speech) {
+        noise_floor_db = std::min(energy_db, noise_floor_db + NOISE_RISE_DB);
+    } else {
+        // Keep rising slowly during speech so a step up in background noise is eventually absorbed
+        noise_floor_db += NOISE_RISE_DB * 0.25f;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef VOICE_ACTIVITY_DETECTOR_H
+#define VOICE_ACTIVITY_DETECTOR_H
+
+#include <vector>
+#include <cstddef>
+#include "fft.h"
+
+// Lightweight frame-level voice activity detector for 16 kHz mono audio.
+//
+// Each 20 ms frame is scored on three cheap features: energy relative to an
+// adaptive noise floor, zero-crossing rate and spectral flatness over the
+// speech band. Voiced speech is loud and tonal (low flatness); unvoiced
+// consonants are noise-like but have a high zero-crossing rate. The raw
+// per-frame decision is smoothed with an onset count and a hangover so that
+// clicks do not open speech and short gaps inside words do not close it.
+class VoiceActivityDetector {
+private:
+    const int sample_rate;
+    const size_t frame_samples;
+    FFT fft;
+    std::vector<float> window;    // Hann window over one frame
+    std::vector<float> frame_buffer;
+    std::vector<float> power;
+    size_t band_begin = 0;        // Spectral flatness is measured over [band_begin, band_end)
+    size_t band_end = 0;
+
+    // Thresholds
+    float energy_margin_db = 10.0f;   // Required level above the noise floor
+    float min_energy_db = -55.0f;     // Absolute level below which nothing is speech
+    float max_flatness = 0.45f;       // Above this a frame is noise-like...
+    float fricative_zcr = 0.25f;      // ...unless it crosses zero this often
+    int onset_frames = 3;             // Consecutive speech frames needed to open speech
+    int hangover_frames = 8;          // Non-speech frames tolerated before closing
+
+    // State
+    float noise_floor_db = -60.0f;
+    bool noise_floor_initialized = false;
+    bool speaking = false;
+    int speech_run = 0;
+    int silence_run = 0;
+
+    // Last frame's features, kept for diagnostics
+    float last_energy_db = -100.0f;
+    float last_zcr = 0.0f;
+    float last_flatness = 1.0f;
+
+    bool classify_frame(const float* frame);
+    void update_noise_floor(float energy_db, bool raw_speech);
+
+public:
+    explicit VoiceActivityDetector(int sample_rate = 16000);
+
+    // Classifies the next frame_size() samples; returns the smoothed decision
+    bool process_frame(const float* frame);
+
+    void reset();
+
+    size_t frame_size() const { return frame_samples; }
+    bool is_speaking() const { return speaking; }
+    float get_noise_floor_db() const { return noise_floor_db; }
+    float get_last_energy_db() const { return last_energy_db; }
+    float get_last_zcr() const { return last_zcr; }
+    float get_last_flatness() const { return last_flatness; }
+};
+
+#endif // VOICE_ACTIVITY_DETECTOR_H
@@ -0,0 +1,212 @@
+#include "wav_reader.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const uint16_t WAVE_FORMAT_PCM = 0x0001;
+const uint16_t WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+const uint16_t WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+
+// Consumed audio is handed back to the kernel in steps of this size
+const size_t RELEASE_GRANULARITY = 8 * 1024 * 1024;
+
+uint16_t read_u16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t read_u32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t read_u64(const uint8_t* p) {
+    return static_cast<uint64_t>(read_u32(p)) | (static_cast<uint64_t>(read_u32(p + 4)) << 32);
+}
+
+} // namespace
+
+WavReader::WavReader() {
+}
+
+WavReader::~WavReader() {
+    close();
+}
+
+bool WavReader::open(const std::string& path) {
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Failed to open WAV file: " << path << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) {
+        std::cerr << "WAV file is too small: " << path << std::endl;
+        close();
+        return false;
+    }
+
+    mapped_size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Failed to map WAV file: " << path << std::endl;
+        mapped_size = 0;
+        close();
+        return false;
+    }
+    mapped = static_cast<const uint8_t*>(addr);
+    madvise(const_cast<uint8_t*>(mapped), mapped_size, MADV_SEQUENTIAL);
+
+    if (!parse(path)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void WavReader::close() {
+    if (mapped) {
+        munmap(const_cast<uint8_t*>(mapped), mapped_size);
+        mapped = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+
+    mapped_size = 0;
+    data_begin = nullptr;
+    n_frames = 0;
+    frame_position = 0;
+    released_bytes = 0;
+    sample_rate = channels = bits_per_sample = 0;
+    converter.reset();
+}
+
+bool WavReader::parse(const std::string& path) {
+    const bool is_rf64 = std::memcmp(mapped, "RF64", 4) == 0;
+    if ((!is_rf64 && std::memcmp(mapped, "RIFF", 4) != 0) || std::memcmp(mapped + 8, "WAVE", 4) != 0) {
+        std::cerr << "Not a RIFF/WAVE file: " << path << std::endl;
+        return false;
+    }
+
+    uint64_t ds64_data_size = 0;
+    bool have_fmt = false;
+    uint16_t format_tag = 0;
+    uint16_t block_align = 0;
+    uint64_t data_size = 0;
+
+    size_t offset = 12;
+    while (offset + 8 <= mapped_size && !(have_fmt && data_begin)) {
+        const uint8_t* chunk = mapped + offset;
+        const uint32_t chunk_size32 = read_u32(chunk + 4);
+        const uint8_t* body = chunk + 8;
+        const size_t body_available = mapped_size - offset - 8;
+        uint64_t chunk_size = chunk_size32;
+
+        if (std::memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 16 && body_available >= 16) {
+            // RF64: 64-bit RIFF size followed by 64-bit data size
+            ds64_data_size = read_u64(body + 8);
+        } else if (std::memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && body_available >= 16) {
+            format_tag = read_u16(body);
+            channels = read_u16(body + 2);
+            sample_rate = static_cast<int>(read_u32(body + 4));
+            block_align = read_u16(body + 12);
+            bits_per_sample = read_u16(body + 14);
+
+            // The real format of an extensible file is the first two bytes of the sub-format GUID
+            if (format_tag == WAVE_FORMAT_EXTENSIBLE && chunk_size >= 40 && body_available >= 40) {
+                format_tag = read_u16(body + 24);
+            }
+            have_fmt = true;
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            if (is_rf64 && chunk_size32 == 0xFFFFFFFF) {
+                chunk_size = ds64_data_size;
+            } else if (chunk_size32 == 0xFFFFFFFF) {
+                // Unfinalized stream dump: audio runs to the end of the file
+                chunk_size = body_available;
+            }
+            data_begin = body;
+            data_size = std::min<uint64_t>(chunk_size, body_available);
+        }
+
+        // Chunks are word aligned
+        uint64_t advance = 8 + chunk_size + (chunk_size & 1);
+        if (advance > mapped_size - offset) {
+            break;
+        }
+        offset += static_cast<size_t>(advance);
+    }
+
+    if (!have_fmt || !data_begin) {
+        std::cerr << "WAV file is missing its " << (have_fmt ? "data" : "fmt") << " chunk: " << path << std::endl;
+        return false;
+    }
+
+    SampleFormat format;
+    if (format_tag == WAVE_FORMAT_PCM && bits_per_sample == 16) {
+        format = SampleFormat::S16;
+    } else if (format_tag == WAVE_FORMAT_PCM && bits_per_sample == 24) {
+        format = SampleFormat::S24;
+    } else if (format_tag == WAVE_FORMAT_PCM && bits_per_sample == 32) {
+        format = SampleFormat::S32;
+    } else if (format_tag == WAVE_FORMAT_IEEE_FLOAT && bits_per_sample == 32) {
+        format = SampleFormat::F32;
+    } else {
+        std::cerr << "Unsupported WAV encoding (format " << format_tag << ", "
+                  << bits_per_sample << " bits): " << path << std::endl;
+        return false;
+    }
+
+    if (channels < 1 || sample_rate <= 0) {
+        std::cerr << "Invalid WAV format: " << channels << " channels, " << sample_rate << " Hz" << std::endl;
+        return false;
+    }
+
+    converter = std::make_unique<SampleConverter>(format, channels);
+    if (block_align != converter->bytes_per_frame()) {
+        std::cerr << "Unexpected WAV block alignment " << block_align << " in " << path << std::endl;
+        return false;
+    }
+
+    n_frames = data_size / block_align;
+    frame_position = 0;
+    released_bytes = 0;
+    return true;
+}
+
+size_t WavReader::read(float* output, size_t max_frames) {
+    if (!converter || frame_position >= n_frames) {
+        return 0;
+    }
+
+    const size_t frame_bytes = converter->bytes_per_frame();
+    const size_t frames = static_cast<size_t>(std::min<uint64_t>(max_frames, n_frames - frame_position));
+
+    converter->convert(data_begin + frame_position * frame_bytes, frames, output);
+    frame_position += frames;
+
+    release_consumed_pages();
+    return frames;
+}
+
+void WavReader::release_consumed_pages() {
+    // Drop pages behind the read position so multi-GB files do not pile up in RSS
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t consumed = static_cast<size_t>(data_begin - mapped) +
+                            static_cast<size_t>(frame_position * converter->bytes_per_frame());
+    const size_t release_end = consumed / page_size * page_size;
+
+    if (release_end >= released_bytes + RELEASE_GRANULARITY) {
+        madvise(const_cast<uint8_t*>(mapped) + released_bytes, release_end - released_bytes, MADV_DONTNEED);
+        released_bytes = release_end;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef WAV_READER_H
+#define WAV_READER_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include "sample_convert.h"
+
+// Memory-mapped WAV file reader.
+//
+// Walks every RIFF chunk (so "LIST", "fact", "JUNK" etc. before or after the
+// audio are skipped correctly), understands WAVE_FORMAT_EXTENSIBLE and RF64
+// files larger than 4 GB, and returns mono float frames. Nothing is copied
+// through stream buffers: frames are converted straight from the mapping and
+// pages that have been consumed are released as reading advances.
+class WavReader {
+private:
+    int fd = -1;
+    const uint8_t* mapped = nullptr;
+    size_t mapped_size = 0;
+
+    const uint8_t* data_begin = nullptr;
+    uint64_t n_frames = 0;
+    uint64_t frame_position = 0;
+    size_t released_bytes = 0;
+
+    int sample_rate = 0;
+    int channels = 0;
+    int bits_per_sample = 0;
+    std::unique_ptr<SampleConverter> converter;
+
+    bool parse(const std::string& path);
+    void release_consumed_pages();
+
+public:
+    WavReader();
+    ~WavReader();
+
+    WavReader(const WavReader&) = delete;
+    WavReader& operator=(const WavReader&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    // Reads up to max_frames frames, downmixed to mono. Returns frames read.
+    size_t read(float* output, size_t max_frames);
+
+    int get_sample_rate() const { return sample_rate; }
+    int get_channels() const { return channels; }
+    int get_bits_per_sample() const { return bits_per_sample; }
+    uint64_t get_total_frames() const { return n_frames; }
+    double get_duration() const { return sample_rate > 0 ? static_cast<double>(n_frames) / sample_rate : 0.0; }
+};
+
+#endif // WAV_READER_H
@@ -0,0 +1,105 @@
+#include "whisper_state_pool.h"
+#include "whisper.h"
+#include <iostream>
+
+WhisperStatePool::WhisperStatePool(whisper_context* ctx, int n_states)
+    : ctx(ctx) {
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state* state = whisper_init_state(ctx);
+        if (!state) {
+            std::cerr << "Failed to create whisper state " << i << ", decoding with " << states.size() << std::endl;
+            break;
+        }
+        states.push_back(state);
+    }
+
+    for (whisper_state* state : states) {
+        workers.emplace_back(&WhisperStatePool::worker_loop, this, state);
+    }
+}
+
+WhisperStatePool::~WhisperStatePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_cv.notify_all();
+
+    for (auto& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    for (whisper_state* state : states) {
+        whisper_free_state(state);
+    }
+}
+
+void WhisperStatePool::submit(Work work, Completion completion, size_t max_pending) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return next_sequence - next_delivery < max_pending; });
+
+    queue.push_back({next_sequence++, std::move(work), std::move(completion)});
+    work_cv.notify_one();
+}
+
+void WhisperStatePool::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return next_delivery == next_sequence; });
+}
+
+size_t WhisperStatePool::pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<size_t>(next_sequence - next_delivery);
+}
+
+void WhisperStatePool::worker_loop(whisper_state* state) {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_cv.wait(lock, [&] { return stopping || !queue.empty(); });
+            // Drain the queue before exiting so no completion is lost
+            if (queue.empty()) {
+                return;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        if (task.work) {
+            task.work(state);
+        }
+        deliver(task.sequence, std::move(task.completion));
+    }
+}
+
+void WhisperStatePool::deliver(uint64_t sequence, Completion completion) {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.emplace(sequence, std::move(completion));
+
+    // Whoever is already delivering will pick this one up in turn
+    if (delivering) {
+        return;
+    }
+    delivering = true;
+
+    auto it = finished.find(next_delivery);
+    while (it != finished.end()) {
+        Completion next = std::move(it->second);
+        finished.erase(it);
+
+        lock.unlock();
+        if (next) {
+            next();
+        }
+        lock.lock();
+
+        next_delivery++;
+        done_cv.notify_all();
+        it = finished.find(next_delivery);
+    }
+
+    delivering = false;
+}
@@ -0,0 +1,72 @@
+#ifndef WHISPER_STATE_POOL_H
+#define WHISPER_STATE_POOL_H
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+struct whisper_context;
+struct whisper_state;
+
+// Worker threads that decode concurrently on one loaded Whisper model.
+//
+// Each worker owns a whisper_state (KV cache and compute buffers) created
+// from the shared context, so the model weights are loaded once. Work items
+// run on whichever worker is free; their completions run one at a time in
+// submission order, which lets callers stitch results together as if the
+// decodes had been serial.
+class WhisperStatePool {
+public:
+    using Work = std::function<void(whisper_state* state)>;
+    using Completion = std::function<void()>;
+
+private:
+    struct Task {
+        uint64_t sequence;
+        Work work;
+        Completion completion;
+    };
+
+    whisper_context* ctx;
+    std::vector<whisper_state*> states;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::deque<Task> queue;
+    std::map<uint64_t, Completion> finished;  // Waiting for earlier tasks
+    uint64_t next_sequence = 0;
+    uint64_t next_delivery = 0;
+    bool delivering = false;
+    bool stopping = false;
+
+    void worker_loop(whisper_state* state);
+    void deliver(uint64_t sequence, Completion completion);
+
+public:
+    // Creates up to n_states states; check size() for how many succeeded
+    WhisperStatePool(whisper_context* ctx, int n_states);
+    ~WhisperStatePool();
+
+    WhisperStatePool(const WhisperStatePool&) = delete;
+    WhisperStatePool& operator=(const WhisperStatePool&) = delete;
+
+    // Queues work; blocks while max_pending tasks are queued, running or
+    // waiting for their completion
+    void submit(Work work, Completion completion, size_t max_pending);
+
+    // Blocks until every submitted task has completed
+    void wait_idle();
+
+    int size() const { return static_cast<int>(states.size()); }
+    size_t pending();
+};
+
+#endif // WHISPER_STATE_POOL_H
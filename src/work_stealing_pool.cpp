@@ -0,0 +1,111 @@
+#include "work_stealing_pool.h"
+#include <algorithm>
+
+WorkStealingPool::WorkStealingPool(int n_workers) {
+    for (int i = 0; i < std::max(1, n_workers); ++i) {
+        queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (int i = 0; i < static_cast<int>(queues.size()); ++i) {
+        workers.emplace_back(&WorkStealingPool::worker_loop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake_cv.notify_all();
+
+    for (auto& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+void WorkStealingPool::submit(Task task) {
+    int worker;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        worker = static_cast<int>(next_queue++ % queues.size());
+    }
+    push(worker, std::move(task));
+}
+
+void WorkStealingPool::spawn(int worker, Task task) {
+    push(worker, std::move(task));
+}
+
+void WorkStealingPool::wait_idle() {
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    idle_cv.wait(lock, [&] { return outstanding == 0; });
+}
+
+void WorkStealingPool::push(int worker, Task task) {
+    {
+        // Counted before the task becomes visible, so it cannot be taken
+        // (and uncounted) first; under wake_mutex so a sleeping worker sees it
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        ++queued;
+        ++outstanding;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+        queues[worker]->tasks.push_back(std::move(task));
+    }
+    wake_cv.notify_one();
+}
+
+bool WorkStealingPool::take(int worker, Task& task) {
+    // Own deque first, newest task
+    {
+        WorkerQueue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Then the oldest task of the next worker that has any
+    size_t n = queues.size();
+    for (size_t i = 1; i < n; ++i) {
+        WorkerQueue& victim = *queues[(worker + i) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::worker_loop(int worker) {
+    while (true) {
+        Task task;
+        if (take(worker, task)) {
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                --queued;
+            }
+            task(worker);
+            tasks_run++;
+
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            if (--outstanding == 0) {
+                idle_cv.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cv.wait(lock, [&] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Fixed set of worker threads with one task deque each.
+//
+// A worker pushes the tasks it spawns onto the back of its own deque and
+// takes work from the back as well, so related work (the segments of the
+// file it just split) stays on the thread that produced it. A worker whose
+// deque is empty steals from the front of another worker's deque, which
+// hands it the oldest and usually largest piece of outstanding work. Tasks
+// receive the index of the worker running them, for per-worker resources.
+class WorkStealingPool {
+public:
+    using Task = std::function<void(int worker)>;
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    std::condition_variable idle_cv;
+    size_t queued = 0;        // Tasks waiting in any deque (guarded by wake_mutex)
+    size_t outstanding = 0;   // Queued plus running (guarded by wake_mutex)
+    bool stopping = false;
+    size_t next_queue = 0;    // Round-robin target for submit()
+
+    std::atomic<uint64_t> tasks_run{0};
+    std::atomic<uint64_t> steals{0};
+
+    void worker_loop(int worker);
+    void push(int worker, Task task);
+    bool take(int worker, Task& task);
+
+public:
+    explicit WorkStealingPool(int n_workers);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Queues a task from outside the pool; deques are filled round-robin
+    void submit(Task task);
+
+    // Queues a task on the calling worker's own deque (call from inside a task)
+    void spawn(int worker, Task task);
+
+    // Blocks until every task, including those spawned meanwhile, has finished
+    void wait_idle();
+
+    int size() const { return static_cast<int>(queues.size()); }
+    uint64_t get_tasks_run() const { return tasks_run.load(); }
+    uint64_t get_steals() const { return steals.load(); }
+};
+
+#endif // WORK_STEALING_POOL_H
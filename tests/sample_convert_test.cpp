@@ -0,0 +1,109 @@
+// Checks every SIMD level of SampleConverter against the scalar reference,
+// bit for bit, for every format, 1-8 channels and lengths around each
+// vector width
+
+#include "sample_convert.h"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cstdint>
+
+static void fill_input(std::vector<uint8_t>& input, SampleFormat format, std::mt19937& rng) {
+    for (auto& byte : input) {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    if (format == SampleFormat::F32) {
+        // Random bytes would include NaNs, which never compare equal
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (size_t i = 0; i + 4 <= input.size(); i += 4) {
+            float value = dist(rng);
+            std::memcpy(&input[i], &value, sizeof(value));
+        }
+    }
+
+    // Full-scale values at the start, where each kernel's first vector loads them
+    size_t sample_bytes = SampleConverter::bytes_per_sample(format);
+    if (format != SampleFormat::F32 && input.size() >= 2 * sample_bytes) {
+        std::memset(&input[0], 0x00, sample_bytes);
+        input[sample_bytes - 1] = 0x80;                  // Most negative
+        std::memset(&input[sample_bytes], 0xff, sample_bytes);
+        input[2 * sample_bytes - 1] = 0x7f;              // Most positive
+    }
+}
+
+static int check_known_values() {
+    int failures = 0;
+    float output[2];
+
+    const int16_t s16[4] = {-32768, 32767, -32768, -32768};
+    SampleConverter stereo(SampleFormat::S16, 2);
+    stereo.convert(s16, 2, output);
+    if (output[0] != (-32768.0f + 32767.0f) / 65536.0f || output[1] != -1.0f) {
+        std::cerr << "S16 stereo full scale: " << output[0] << " " << output[1] << std::endl;
+        failures++;
+    }
+
+    const uint8_t s24[3] = {0x00, 0x00, 0x80};
+    SampleConverter mono24(SampleFormat::S24, 1);
+    mono24.convert(s24, 1, output);
+    if (output[0] != -1.0f) {
+        std::cerr << "S24 most negative: " << output[0] << std::endl;
+        failures++;
+    }
+    return failures;
+}
+
+int main() {
+    const SampleFormat formats[] = {SampleFormat::S16, SampleFormat::S24, SampleFormat::S32, SampleFormat::F32};
+    const char* format_names[] = {"s16", "s24", "s32", "f32"};
+    const SimdLevel levels[] = {SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512, SimdLevel::Best};
+
+    // Every length up to four of the widest vectors (16 floats), plus a few long runs
+    std::vector<size_t> lengths;
+    for (size_t n = 0; n <= 64; ++n) {
+        lengths.push_back(n);
+    }
+    for (size_t n : {127, 128, 129, 1000, 4099}) {
+        lengths.push_back(n);
+    }
+
+    std::cout << "CPU supports " << SampleConverter::simd_level_name(SampleConverter::detect_simd_level()) << std::endl;
+
+    std::mt19937 rng(1234);
+    int failures = check_known_values();
+    size_t checks = 0;
+    for (int f = 0; f < 4; ++f) {
+        for (int channels = 1; channels <= 8; ++channels) {
+            SampleConverter reference(formats[f], channels, SimdLevel::Scalar);
+            for (size_t n : lengths) {
+                std::vector<uint8_t> input(n * reference.bytes_per_frame());
+                fill_input(input, formats[f], rng);
+
+                std::vector<float> expected(n);
+                reference.convert(input.data(), n, expected.data());
+
+                for (SimdLevel requested : levels) {
+                    SampleConverter converter(formats[f], channels, requested);
+
+                    // One extra slot catches writes past the end
+                    std::vector<float> actual(n + 1, 12345.0f);
+                    converter.convert(input.data(), n, actual.data());
+                    checks++;
+
+                    bool same = std::memcmp(expected.data(), actual.data(), n * sizeof(float)) == 0;
+                    if (!same || actual[n] != 12345.0f) {
+                        std::cerr << "Mismatch: " << format_names[f] << ", " << channels << " channels, "
+                                  << n << " frames, " << SampleConverter::simd_level_name(converter.simd_level())
+                                  << (same ? " (wrote past the end)" : "") << std::endl;
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << checks << " conversions checked, " << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}